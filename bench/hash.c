@@ -0,0 +1,97 @@
+/*
+ * Microbenchmark for the hashes in hash_functions.
+ *
+ * Every hash is run over keys of MIN_KEY_SIZE up to MAX_KEY_SIZE bytes,
+ * doubling the length every time, plus a few lengths in between that fall
+ * off the ends of the hashes' word and stripe loops. A run hashes OPS keys
+ * of one length, each starting one byte further into a random buffer so
+ * the loads are not all aligned, and reports the time per hash and the
+ * bytes hashed per second.
+ */
+
+#include "hash.h"
+#include "cream.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+#include "unistd.h"
+
+#define USAGE "./cream_hash_bench [-n OPS] [-H HASH]\n" \
+"-n OPS             Keys hashed for every hash and length (default 1000000).\n" \
+"-H HASH            Only run the hash of that name.\n"
+
+// Lengths run on top of the powers of two
+static const size_t odd_lengths[] = {3, 12, 24, 48, 100, 513, 1000};
+
+static uint8_t buffer[MAX_KEY_SIZE + 64];
+
+static long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int cmp_size(const void *a, const void *b)
+{
+	size_t x = *(const size_t *)a, y = *(const size_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void run(const hash_entry_t *entry, size_t len, int ops)
+{
+	volatile uint32_t sink;
+	uint32_t h = 0;
+	long start, elapsed;
+
+	start = now_ns();
+	for(int i = 0; i < ops; i++)
+		h ^= entry->function(MAP_KEY(buffer + (i & 63), len));
+	elapsed = now_ns() - start;
+	sink = h;
+	(void)sink;
+
+	printf("%-8s %5zu bytes %9.1f ns/hash %8.2f GB/s\n", entry->name, len,
+		(double)elapsed / ops, (double)len * ops / elapsed);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t lengths[64], num_lengths = 0;
+	const char *only = NULL;
+	int opt, ops = 1000000;
+
+	while((opt = getopt(argc, argv, "n:H:")) != -1) {
+		switch(opt) {
+			case 'n': ops = atoi(optarg); break;
+			case 'H': only = optarg; break;
+			default:
+				fprintf(stderr, USAGE);
+				exit(1);
+		}
+	}
+	if(argc != optind || ops <= 0 || (only != NULL && hash_by_name(only) == NULL)) {
+		fprintf(stderr, USAGE);
+		exit(1);
+	}
+
+	srand(1);
+	for(size_t i = 0; i < sizeof(buffer); i++)
+		buffer[i] = rand();
+
+	for(size_t len = MIN_KEY_SIZE; len <= MAX_KEY_SIZE; len *= 2)
+		lengths[num_lengths++] = len;
+	for(size_t i = 0; i < sizeof(odd_lengths) / sizeof(odd_lengths[0]); i++)
+		lengths[num_lengths++] = odd_lengths[i];
+	qsort(lengths, num_lengths, sizeof(size_t), cmp_size);
+
+	for(const hash_entry_t *entry = hash_functions; entry->name != NULL; entry++) {
+		if(only != NULL && strcmp(only, entry->name) != 0)
+			continue;
+		for(size_t i = 0; i < num_lengths; i++)
+			run(entry, lengths[i], ops);
+	}
+	return 0;
+}
@@ -0,0 +1,275 @@
+/*
+ * Load generator for cream.
+ *
+ * Every connection runs in its own thread and sends batches of DEPTH
+ * pipelined requests, a GET_PERCENT share of them GETs and the rest PUTs,
+ * over a key space of KEYS keys. Latency is measured per batch and
+ * reported per request type.
+ */
+
+#include "cream.h"
+#include "errno.h"
+#include "netinet/in.h"
+#include "arpa/inet.h"
+#include "pthread.h"
+#include "stdbool.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "sys/socket.h"
+#include "time.h"
+#include "unistd.h"
+
+#define USAGE "./cream_load [-c CONNS] [-n REQUESTS] [-d DEPTH] [-k KEYS] [-v VALUE_SIZE] [-r GET_PERCENT] PORT\n" \
+"-c CONNS           Number of connections, each driven by its own thread (default 4).\n" \
+"-n REQUESTS        Requests sent on every connection (default 100000).\n" \
+"-d DEPTH           Requests pipelined before waiting for their responses (default 1).\n" \
+"-k KEYS            Number of distinct keys (default 10000).\n" \
+"-v VALUE_SIZE      Size of the PUT values (default 64).\n" \
+"-r GET_PERCENT     Share of the requests that are GETs (default 90).\n"
+
+#define KEY_FMT "key-%08d" // KEY_LEN bytes for up to 10^8 keys
+#define KEY_LEN 12
+
+typedef struct load_conf_t {
+	int port;
+	int conns;
+	int requests;
+	int depth;
+	int keys;
+	int val_size;
+	int get_percent;
+} load_conf_t;
+
+typedef struct load_thread_t {
+	load_conf_t *conf;
+	pthread_t thread;
+	unsigned int seed;
+	// latency of every request in nanoseconds, split by type
+	long *get_lat;
+	long *put_lat;
+	int nget;
+	int nput;
+	int errors;
+} load_thread_t;
+
+static long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int writen(int fd, char *buf, size_t n)
+{
+	ssize_t nbytes;
+
+	while(n > 0) {
+		if((nbytes = write(fd, buf, n)) < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += nbytes;
+		n -= nbytes;
+	}
+	return 0;
+}
+
+static int readn(int fd, char *buf, size_t n)
+{
+	ssize_t nbytes;
+
+	while(n > 0) {
+		if((nbytes = read(fd, buf, n)) <= 0) {
+			if(nbytes < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += nbytes;
+		n -= nbytes;
+	}
+	return 0;
+}
+
+static int connect_to(int port)
+{
+	struct sockaddr_in addr;
+	int fd;
+
+	if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	bzero(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void *load_thread(void *arg)
+{
+	load_thread_t *self = arg;
+	load_conf_t *conf = self->conf;
+	size_t frame_max = sizeof(request_header_t) + KEY_LEN + conf->val_size;
+	char *out, *in, key[32];
+	bool *is_get;
+	response_header_t resp;
+	request_header_t hdr;
+	long start, lat;
+	int fd, batch;
+	size_t len;
+
+	if((fd = connect_to(conf->port)) < 0) {
+		perror("connect");
+		return NULL;
+	}
+	out = malloc(frame_max * conf->depth);
+	in = malloc(MAX_VALUE_SIZE);
+	is_get = malloc(sizeof(bool) * conf->depth);
+	if(out == NULL || in == NULL || is_get == NULL)
+		goto load_thread_done;
+	memset(in, 'v', MAX_VALUE_SIZE);
+
+	for(int sent = 0; sent < conf->requests; sent += batch) {
+		batch = conf->requests - sent;
+		if(batch > conf->depth)
+			batch = conf->depth;
+
+		len = 0;
+		for(int i = 0; i < batch; i++) {
+			snprintf(key, sizeof(key), KEY_FMT,
+				rand_r(&self->seed) % conf->keys);
+			is_get[i] = rand_r(&self->seed) % 100 < conf->get_percent;
+			hdr.request_code = is_get[i] ? GET : PUT;
+			hdr.key_size = KEY_LEN;
+			hdr.value_size = is_get[i] ? 0 : conf->val_size;
+			memcpy(out + len, &hdr, sizeof(hdr));
+			len += sizeof(hdr);
+			memcpy(out + len, key, KEY_LEN);
+			len += KEY_LEN;
+			if(!is_get[i]) {
+				memcpy(out + len, in, conf->val_size);
+				len += conf->val_size;
+			}
+		}
+
+		start = now_ns();
+		if(writen(fd, out, len) < 0)
+			goto load_thread_done;
+		for(int i = 0; i < batch; i++) {
+			if(readn(fd, (char *)&resp, sizeof(resp)) < 0 ||
+				readn(fd, in, resp.value_size) < 0)
+				goto load_thread_done;
+			if(resp.response_code != OK && resp.response_code != NOT_FOUND)
+				self->errors++;
+		}
+		lat = now_ns() - start;
+
+		for(int i = 0; i < batch; i++) {
+			if(is_get[i])
+				self->get_lat[self->nget++] = lat;
+			else
+				self->put_lat[self->nput++] = lat;
+		}
+	}
+
+	load_thread_done:
+	free(out);
+	free(in);
+	free(is_get);
+	close(fd);
+	return NULL;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+	return (x > y) - (x < y);
+}
+
+static void report(const char *name, long *lat, int n)
+{
+	if(n == 0)
+		return;
+	qsort(lat, n, sizeof(long), cmp_long);
+	printf("%-4s %9d reqs  p50 %8.1f us  p99 %8.1f us  p99.9 %8.1f us  max %8.1f us\n",
+		name, n, lat[n / 2] / 1e3, lat[(long)n * 99 / 100] / 1e3,
+		lat[(long)n * 999 / 1000] / 1e3, lat[n - 1] / 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+	load_conf_t conf = {0, 4, 100000, 1, 10000, 64, 90};
+	load_thread_t *threads;
+	long *get_lat, *put_lat, start, elapsed;
+	int nget = 0, nput = 0, errors = 0, opt;
+
+	while((opt = getopt(argc, argv, "c:n:d:k:v:r:")) != -1) {
+		switch(opt) {
+			case 'c': conf.conns = atoi(optarg); break;
+			case 'n': conf.requests = atoi(optarg); break;
+			case 'd': conf.depth = atoi(optarg); break;
+			case 'k': conf.keys = atoi(optarg); break;
+			case 'v': conf.val_size = atoi(optarg); break;
+			case 'r': conf.get_percent = atoi(optarg); break;
+			default:
+				fprintf(stderr, USAGE);
+				exit(1);
+		}
+	}
+	if(argc - optind != 1 || (conf.port = atoi(argv[optind])) <= 0 ||
+		conf.conns <= 0 || conf.requests <= 0 || conf.depth <= 0 ||
+		conf.keys <= 0 || conf.val_size < MIN_VALUE_SIZE ||
+		conf.val_size > MAX_VALUE_SIZE) {
+		fprintf(stderr, USAGE);
+		exit(1);
+	}
+
+	if((threads = calloc(conf.conns, sizeof(load_thread_t))) == NULL)
+		exit(2);
+	for(int i = 0; i < conf.conns; i++) {
+		threads[i].conf = &conf;
+		threads[i].seed = i + 1;
+		threads[i].get_lat = malloc(sizeof(long) * conf.requests);
+		threads[i].put_lat = malloc(sizeof(long) * conf.requests);
+		if(threads[i].get_lat == NULL || threads[i].put_lat == NULL)
+			exit(2);
+	}
+
+	start = now_ns();
+	for(int i = 0; i < conf.conns; i++)
+		pthread_create(&threads[i].thread, NULL, load_thread, &threads[i]);
+	for(int i = 0; i < conf.conns; i++)
+		pthread_join(threads[i].thread, NULL);
+	elapsed = now_ns() - start;
+
+	for(int i = 0; i < conf.conns; i++) {
+		nget += threads[i].nget;
+		nput += threads[i].nput;
+		errors += threads[i].errors;
+	}
+	get_lat = malloc(sizeof(long) * (nget + 1));
+	put_lat = malloc(sizeof(long) * (nput + 1));
+	if(get_lat == NULL || put_lat == NULL)
+		exit(2);
+	nget = nput = 0;
+	for(int i = 0; i < conf.conns; i++) {
+		memcpy(get_lat + nget, threads[i].get_lat,
+			sizeof(long) * threads[i].nget);
+		memcpy(put_lat + nput, threads[i].put_lat,
+			sizeof(long) * threads[i].nput);
+		nget += threads[i].nget;
+		nput += threads[i].nput;
+	}
+
+	printf("%d requests in %.3f s, %.0f req/s, %d errors\n", nget + nput,
+		elapsed / 1e9, (nget + nput) / (elapsed / 1e9), errors);
+	report("GET", get_lat, nget);
+	report("PUT", put_lat, nput);
+	return errors != 0 || nget + nput != conf.conns * conf.requests;
+}
@@ -0,0 +1,310 @@
+/*
+ * Scaling benchmark for the map.
+ *
+ * A map is filled with KEYS keys and then hammered by 1, 2, 4, ... up to
+ * MAX_THREADS threads at once, each doing OPS operations on random keys,
+ * a GET_PERCENT share of them gets and the rest puts. The throughput of
+ * every run is reported next to its speedup over the single thread run.
+ *
+ * With -l the map is instead read by READERS threads doing nothing but
+ * gets, while one more thread does OPS puts and times every one of them,
+ * which shows how long writers wait behind a steady stream of readers.
+ *
+ * With -f gets take no lock at all, see map_config_t.lockfree_get.
+ *
+ * With -c the segments use cuckoo tables, see map_table_t.
+ *
+ * With -H the map hashes its keys with one of hash_functions instead of
+ * jenkins. Keys are hashed with a seed, as the server does.
+ *
+ * With -d every put copies its key and value into an allocation of their
+ * own, which the map frees once they are overwritten, as the server does.
+ *
+ * cream_ec_map_bench runs the same against the map of the ec build, which
+ * has a single lock. Built with MAP_LOCK_STATS, as the lock_stats target
+ * builds cream_map_lock_bench and cream_ec_map_lock_bench, the mean time
+ * the map's write locks were held is reported as well. Timing the locks
+ * slows every write, so only compare those runs with each other.
+ */
+
+#include "utils.h"
+#include "hash.h"
+#include "pthread.h"
+#include "stdbool.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+#include "unistd.h"
+
+#define USAGE "./cream_map_bench [-t MAX_THREADS] [-n OPS] [-k KEYS] [-r GET_PERCENT] [-s SEGMENTS] [-l READERS] [-f] [-c] [-d] [-H HASH]\n" \
+"-t MAX_THREADS     Largest number of threads to run with (default 64).\n" \
+"-n OPS             Operations done by every thread (default 200000).\n" \
+"-k KEYS            Number of distinct keys (default 100000).\n" \
+"-r GET_PERCENT     Share of the operations that are gets (default 90).\n" \
+"-s SEGMENTS        Number of segments, or 0 to let create_map pick (default 0).\n" \
+"-l READERS         Time the puts of one thread against READERS threads doing gets.\n" \
+"-f                 Serve gets without taking a lock.\n" \
+"-c                 Use cuckoo tables.\n" \
+"-d                 Allocate every entry put in and let the map free it.\n" \
+"-H HASH            Hash keys with jenkins, word or stripe (default jenkins).\n"
+
+#define KEY_FMT "key-%08d" // KEY_LEN bytes for up to 10^8 keys
+#define KEY_LEN 12
+#define VAL_LEN 64
+
+typedef struct bench_conf_t {
+	int max_threads;
+	int ops;
+	int keys;
+	int get_percent;
+	int segments;
+	int readers;
+	bool lockfree;
+	bool cuckoo;
+	bool alloc;
+	const char *hash;
+} bench_conf_t;
+
+typedef struct bench_thread_t {
+	bench_conf_t *conf;
+	pthread_t thread;
+	unsigned int seed;
+	int misses;
+} bench_thread_t;
+
+static hashmap_t *map;
+static char *key_pool;
+static char val_pool[VAL_LEN];
+static pthread_barrier_t start_barrier;
+static volatile bool stop;
+
+// Keys and values live in the pools for the whole run
+static void no_destroy(map_key_t key, map_val_t val)
+{
+}
+
+// With -d the key and value share one allocation, see bench_put()
+static void free_entry(map_key_t key, map_val_t val)
+{
+	free(key.key_base);
+}
+
+static long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static map_key_t pool_key(int i)
+{
+	return MAP_KEY(key_pool + (size_t)i * KEY_LEN, KEY_LEN);
+}
+
+static void bench_put(bench_conf_t *conf, map_key_t key)
+{
+	char *entry;
+
+	if(!conf->alloc) {
+		put(map, key, MAP_VAL(val_pool, VAL_LEN), true);
+		return;
+	}
+	if((entry = malloc(KEY_LEN + VAL_LEN)) == NULL)
+		exit(2);
+	memcpy(entry, key.key_base, KEY_LEN);
+	memcpy(entry + KEY_LEN, val_pool, VAL_LEN);
+	if(!put(map, MAP_KEY(entry, KEY_LEN), MAP_VAL(entry + KEY_LEN, VAL_LEN), true))
+		free(entry);
+}
+
+static void *bench_thread(void *arg)
+{
+	bench_thread_t *self = arg;
+	bench_conf_t *conf = self->conf;
+	map_key_t key;
+
+	pthread_barrier_wait(&start_barrier);
+	for(int i = 0; i < conf->ops; i++) {
+		key = pool_key(rand_r(&self->seed) % conf->keys);
+		if(rand_r(&self->seed) % 100 < conf->get_percent) {
+			if(get(map, key).val_base == NULL)
+				self->misses++;
+		}
+		else
+			bench_put(conf, key);
+	}
+	return NULL;
+}
+
+static void *reader_thread(void *arg)
+{
+	bench_thread_t *self = arg;
+	bench_conf_t *conf = self->conf;
+
+	pthread_barrier_wait(&start_barrier);
+	while(!stop) {
+		if(get(map, pool_key(rand_r(&self->seed) % conf->keys)).val_base == NULL)
+			self->misses++;
+	}
+	return NULL;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+	return (x > y) - (x < y);
+}
+
+// Times conf->ops puts while conf->readers threads keep getting
+static void run_latency(bench_conf_t *conf)
+{
+	bench_thread_t *threads;
+	unsigned int seed = 0;
+	long *lat, start;
+	int n = conf->ops;
+
+	if((threads = calloc(conf->readers, sizeof(bench_thread_t))) == NULL ||
+		(lat = malloc(sizeof(long) * n)) == NULL)
+		exit(2);
+	pthread_barrier_init(&start_barrier, NULL, conf->readers + 1);
+	for(int i = 0; i < conf->readers; i++) {
+		threads[i].conf = conf;
+		threads[i].seed = i + 1;
+		pthread_create(&threads[i].thread, NULL, reader_thread, &threads[i]);
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	for(int i = 0; i < n; i++) {
+		map_key_t key = pool_key(rand_r(&seed) % conf->keys);
+		start = now_ns();
+		bench_put(conf, key);
+		lat[i] = now_ns() - start;
+	}
+	stop = true;
+	for(int i = 0; i < conf->readers; i++)
+		pthread_join(threads[i].thread, NULL);
+
+	qsort(lat, n, sizeof(long), cmp_long);
+	printf("PUT %9d puts  %d readers  p50 %8.1f us  p99 %8.1f us  p99.9 %8.1f us  max %8.1f us\n",
+		n, conf->readers, lat[n / 2] / 1e3, lat[(long)n * 99 / 100] / 1e3,
+		lat[(long)n * 999 / 1000] / 1e3, lat[n - 1] / 1e3);
+	pthread_barrier_destroy(&start_barrier);
+	free(threads);
+	free(lat);
+}
+
+// Runs num_threads threads against the map and returns the operations
+// done per second
+static double run(bench_conf_t *conf, int num_threads, int *misses)
+{
+	bench_thread_t *threads;
+	long start, elapsed;
+
+	if((threads = calloc(num_threads, sizeof(bench_thread_t))) == NULL)
+		exit(2);
+	pthread_barrier_init(&start_barrier, NULL, num_threads + 1);
+	for(int i = 0; i < num_threads; i++) {
+		threads[i].conf = conf;
+		threads[i].seed = i + 1;
+		pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i]);
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	start = now_ns();
+	for(int i = 0; i < num_threads; i++)
+		pthread_join(threads[i].thread, NULL);
+	elapsed = now_ns() - start;
+
+	*misses = 0;
+	for(int i = 0; i < num_threads; i++)
+		*misses += threads[i].misses;
+	pthread_barrier_destroy(&start_barrier);
+	free(threads);
+	return (double)num_threads * conf->ops / (elapsed / 1e9);
+}
+
+static void print_lock_stats(void)
+{
+#ifdef MAP_LOCK_STATS
+	uint64_t holds, hold_ns;
+
+	map_lock_stats(map, &holds, &hold_ns);
+	printf("%lu write locks held %.1f ns on average\n", holds,
+		holds ? (double)hold_ns / holds : 0.0);
+#endif
+}
+
+int main(int argc, char *argv[])
+{
+	bench_conf_t conf = {64, 200000, 100000, 90, 0, 0, false, false, false,
+		"jenkins"};
+	char key[32];
+	double base = 0, rate;
+	int opt, misses;
+
+	while((opt = getopt(argc, argv, "t:n:k:r:s:l:fcdH:")) != -1) {
+		switch(opt) {
+			case 't': conf.max_threads = atoi(optarg); break;
+			case 'n': conf.ops = atoi(optarg); break;
+			case 'k': conf.keys = atoi(optarg); break;
+			case 'r': conf.get_percent = atoi(optarg); break;
+			case 's': conf.segments = atoi(optarg); break;
+			case 'l': conf.readers = atoi(optarg); break;
+			case 'f': conf.lockfree = true; break;
+			case 'c': conf.cuckoo = true; break;
+			case 'd': conf.alloc = true; break;
+			case 'H': conf.hash = optarg; break;
+			default:
+				fprintf(stderr, USAGE);
+				exit(1);
+		}
+	}
+	if(argc != optind || conf.max_threads <= 0 || conf.ops <= 0 ||
+		conf.keys <= 0 || conf.segments < 0 || conf.readers < 0 ||
+		hash_by_name(conf.hash) == NULL) {
+		fprintf(stderr, USAGE);
+		exit(1);
+	}
+
+	// twice the keys, so the map never fills up and evicts
+	map_config_t map_config = {conf.keys * 2, conf.segments,
+		hash_by_name(conf.hash)->function, conf.alloc ? free_entry : no_destroy,
+		conf.lockfree, 0, hash_by_name(conf.hash)->keyed_function, conf.cuckoo};
+	map = create_map_config(&map_config);
+	if(map == NULL || (key_pool = malloc((size_t)conf.keys * KEY_LEN)) == NULL)
+		exit(2);
+	memset(val_pool, 'v', VAL_LEN);
+	for(int i = 0; i < conf.keys; i++) {
+		snprintf(key, sizeof(key), KEY_FMT, i);
+		memcpy(key_pool + (size_t)i * KEY_LEN, key, KEY_LEN);
+		bench_put(&conf, pool_key(i));
+	}
+
+#ifdef EC
+	uint32_t num_segments = 1;
+#else
+	uint32_t num_segments = map->num_segments;
+#endif
+	printf("%u %ssegments%s, %s hash, %d keys, %d%% gets, %ld online CPUs\n",
+		num_segments, conf.cuckoo ? "cuckoo " : "",
+		conf.lockfree ? " (lock-free gets)" : "", conf.hash,
+		conf.keys, conf.get_percent,
+		sysconf(_SC_NPROCESSORS_ONLN));
+	if(conf.readers > 0) {
+		run_latency(&conf);
+		print_lock_stats();
+		return 0;
+	}
+	for(int n = 1; n <= conf.max_threads; n *= 2) {
+		rate = run(&conf, n, &misses);
+		if(n == 1)
+			base = rate;
+		printf("%3d threads %12.0f ops/s  speedup %5.2f  misses %d\n",
+			n, rate, rate / base, misses);
+	}
+	printf("%u long probes, %u reseeds\n", map->long_probes, map->reseeds);
+	print_lock_stats();
+	return 0;
+}
@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# Counts the system calls cream makes per request with each I/O backend.
+# The server runs under `strace -f -c` while cream_load drives it, and the
+# total number of calls is divided by the number of requests served.
+#
+# usage: bench/syscalls.sh [PORT] [REQUESTS] [DEPTH]
+# Run `make bench` first. Needs strace.
+
+PORT=${1:-9990}
+REQUESTS=${2:-20000}
+DEPTH=${3:-16}
+CONNS=4
+BIN=$(dirname "$0")/../bin
+
+command -v strace >/dev/null || { echo "strace not found" >&2; exit 1; }
+
+for backend in "threads:" "epoll:-e" "io_uring:-u"; do
+	name=${backend%%:*}
+	flag=${backend#*:}
+	out=$(mktemp)
+
+	strace -f -c -o "$out" "$BIN/cream" $flag $CONNS "$PORT" 100000 &
+	tracer=$!
+	sleep 0.5
+	"$BIN/cream_load" -c $CONNS -n "$REQUESTS" -d "$DEPTH" "$PORT" >/dev/null
+	# strace prints its summary once the server, its only child, is gone.
+	# A background job of a script ignores SIGINT, so it gets SIGTERM
+	pkill -TERM -P $tracer
+	wait $tracer
+
+	# the errors column is left blank when there are none, so count
+	# columns from the left: % time, seconds, usecs/call, calls
+	calls=$(awk '$NF == "total" { print $4 }' "$out")
+	awk -v name="$name" -v calls="$calls" -v requests=$((CONNS * REQUESTS)) \
+		'BEGIN { printf "%s: %d syscalls for %d requests, %.3f per request\n",
+			name, calls, requests, calls / requests }'
+	rm -f "$out"
+done
@@ -0,0 +1,162 @@
+/*
+ * Head-to-head benchmark of the two kinds of tables a segment can use,
+ * linear probing and cuckoo, at a fixed load.
+ *
+ * For every kind of table and every load, a map of one segment is filled
+ * until its table has grown to SLOTS slots and holds the given share of
+ * them. Both kinds of tables are allowed to grow up to 95% full, so the
+ * same keys fill both to the same load. One thread then times OPS gets of
+ * keys that are in the map, OPS gets of keys that are not, and OPS puts
+ * that replace the value of a key that is, all in random order.
+ *
+ * For linear probing the mean and longest distance of an entry from its
+ * home slot are reported too. A cuckoo lookup never looks past the two
+ * buckets of its key.
+ */
+
+#include "utils.h"
+#include "hash.h"
+#include "stdbool.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+#include "unistd.h"
+
+#define USAGE "./cream_table_bench [-n OPS] [-s SLOTS] [-f] [-H HASH]\n" \
+"-n OPS             Operations timed for every kind of operation (default 1000000).\n" \
+"-s SLOTS           Slots of the table, rounded up to a power of two (default 1048576).\n" \
+"-f                 Serve gets without taking a lock.\n" \
+"-H HASH            Hash keys with jenkins, word or stripe (default jenkins).\n"
+
+#define KEY_FMT "key-%08d" // KEY_LEN bytes for up to 10^8 keys
+#define KEY_LEN 12
+#define VAL_LEN 64
+#define BENCH_LOAD_PERCENT 95
+
+static const int loads[] = {50, 80, 95};
+
+static char *key_pool;
+static char val_pool[VAL_LEN];
+
+// Keys and values live in the pools for the whole run
+static void no_destroy(map_key_t key, map_val_t val)
+{
+}
+
+static long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static map_key_t pool_key(int i)
+{
+	return MAP_KEY(key_pool + (size_t)i * KEY_LEN, KEY_LEN);
+}
+
+// Runs ops operations on random keys below limit, starting at base, and
+// returns the time per operation
+static double time_ops(hashmap_t *map, int ops, int base, int limit, bool write)
+{
+	unsigned int seed = 1;
+	long start, misses = 0;
+
+	start = now_ns();
+	for(int i = 0; i < ops; i++) {
+		map_key_t key = pool_key(base + rand_r(&seed) % limit);
+		if(write)
+			put(map, key, MAP_VAL(val_pool, VAL_LEN), true);
+		else if(get(map, key).val_base == NULL)
+			misses++;
+	}
+	// keeps the gets from being thrown away
+	if(misses < 0)
+		printf("%ld\n", misses);
+	return (double)(now_ns() - start) / ops;
+}
+
+static void run(const char *hash, bool cuckoo, bool lockfree, int load,
+	uint32_t slots, int ops)
+{
+	int keys = (uint64_t)slots * load / 100;
+	map_table_t *table;
+	uint64_t dists = 0;
+	uint32_t longest = 0;
+
+	map_config_t config = {slots, 1, hash_by_name(hash)->function, no_destroy,
+		lockfree, 0, hash_by_name(hash)->keyed_function, cuckoo,
+		BENCH_LOAD_PERCENT};
+	hashmap_t *map = create_map_config(&config);
+	if(map == NULL)
+		exit(2);
+	for(int i = 0; i < keys; i++)
+		put(map, pool_key(i), MAP_VAL(val_pool, VAL_LEN), true);
+
+	table = &(map->segments[0].table);
+	for(uint64_t i = 0; i < table->capacity; i++) {
+		if(table->nodes[i].key.key_base == NULL)
+			continue;
+		dists += table->nodes[i].dist;
+		if(table->nodes[i].dist > longest)
+			longest = table->nodes[i].dist;
+	}
+
+	printf("%-7s %3lu%% %8lu slots  hit %6.1f ns  miss %6.1f ns  replace %6.1f ns",
+		cuckoo ? "cuckoo" : "linear", map_size(map) * 100 / table->capacity,
+		table->capacity, time_ops(map, ops, 0, keys, false),
+		time_ops(map, ops, keys, keys, false), time_ops(map, ops, 0, keys, true));
+	if(!cuckoo)
+		printf("  dist mean %5.2f max %4u", (double)dists / keys, longest);
+	printf("\n");
+	invalidate_map(map);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *hash = "jenkins";
+	bool lockfree = false;
+	int opt, ops = 1000000;
+	long slots = 1 << 20;
+	uint32_t capacity = MAP_TABLE_MIN_CAPACITY;
+	char key[32];
+
+	while((opt = getopt(argc, argv, "n:s:fH:")) != -1) {
+		switch(opt) {
+			case 'n': ops = atoi(optarg); break;
+			case 's': slots = atol(optarg); break;
+			case 'f': lockfree = true; break;
+			case 'H': hash = optarg; break;
+			default:
+				fprintf(stderr, USAGE);
+				exit(1);
+		}
+	}
+	if(argc != optind || ops <= 0 || slots <= 0 || slots > 1 << 26 ||
+		hash_by_name(hash) == NULL) {
+		fprintf(stderr, USAGE);
+		exit(1);
+	}
+	// tables always have a power of two of slots
+	while(capacity < slots)
+		capacity *= 2;
+
+	// the keys past the ones put in are the misses
+	if((key_pool = malloc((size_t)capacity * 2 * KEY_LEN)) == NULL)
+		exit(2);
+	memset(val_pool, 'v', VAL_LEN);
+	for(uint32_t i = 0; i < capacity * 2; i++) {
+		snprintf(key, sizeof(key), KEY_FMT, i);
+		memcpy(key_pool + (size_t)i * KEY_LEN, key, KEY_LEN);
+	}
+
+	printf("%s hash%s, %d operations each\n", hash,
+		lockfree ? ", lock-free gets" : "", ops);
+	for(int i = 0; i < sizeof(loads) / sizeof(loads[0]); i++) {
+		run(hash, false, lockfree, loads[i], capacity, ops);
+		run(hash, true, lockfree, loads[i], capacity, ops);
+	}
+	return 0;
+}
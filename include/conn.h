@@ -0,0 +1,214 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include "stdbool.h"
+#include "sys/uio.h"
+
+#define CONN_BUFSIZE 8192
+
+// Values at least this large are written straight from where they are
+// stored instead of being copied into wbuf
+#define CONN_DIRECT_MIN 1024
+
+// Lets go of a value queued by conn_write_value, see conn_value_t
+typedef void (*conn_release_f)(void *ctx, void *arg);
+
+/*
+ * A value that goes out from where it is stored. It is sent after the
+ * first at bytes of wbuf and before the rest, base and len are moved past
+ * whatever part of it has been sent, and release is called with ctx and
+ * arg once all of it has been.
+ */
+typedef struct conn_value_t {
+	int at;
+	char *base;
+	int len;
+	conn_release_f release;
+	void *ctx;
+	void *arg;
+} conn_value_t;
+
+typedef enum conn_mode {
+	CONN_BLOCKING,          // a worker thread reads and writes fd itself
+	CONN_POLLED,            // fd is non-blocking and polled by an event loop
+	CONN_ASYNC              // the owner submits all I/O, handlers only stage
+} conn_mode;
+
+/*
+ * State kept for one client socket across requests.
+ *
+ * Input is read in chunks as large as the socket has ready, and requests
+ * are parsed where they landed in rbuf, so several pipelined requests that
+ * arrive together are served without going back to the kernel and without
+ * copying their keys and values anywhere but into the map. Responses
+ * are collected in wbuf and only written once the buffered input has been
+ * consumed, which keeps them in request order and sends a whole pipeline
+ * of responses with one write(). rbuf starts out at CONN_BUFSIZE and only
+ * grows for a request that does not fit, such as a large batch, and goes
+ * back to CONN_BUFSIZE once that request has been consumed.
+ *
+ * A connection that is not CONN_BLOCKING is owned by an event loop. Its
+ * handlers are only called once a whole request is buffered, and its
+ * responses are kept until the socket has room for them.
+ *
+ * Large values are not copied into wbuf but queued in vals, in the order
+ * they go out, and sent from where they are stored, see conn_write_value.
+ */
+typedef struct conn_t {
+	int fd;
+	conn_mode mode;
+	unsigned int events;    // what the owning event loop waits for
+	int rcnt;               // unread bytes left in rbuf
+	char *rbufptr;          // next unread byte in rbuf
+	int rcap;               // size of rbuf
+	char *rbuf;
+	int wcnt;               // bytes waiting to be written from wbuf
+	int wcap;               // size of wbuf
+	char *wbuf;
+	int nvals;              // values queued behind parts of wbuf
+	int vcap;               // size of vals
+	conn_value_t *vals;
+} conn_t;
+
+/*
+ * Associates a connection with a socket and empties its buffers.
+ *
+ * @param conn The connection to initialize
+ * @param fd The connected socket
+ * @param mode Who does the I/O on fd
+ * @return 0 on success, -1 if the buffers could not be allocated.
+ */
+int conn_init(conn_t *conn, int fd, conn_mode mode);
+
+/*
+ * Releases the buffers of a connection and the values it still had queued.
+ * The socket is not closed.
+ *
+ * @param conn The connection to tear down
+ */
+void conn_destroy(conn_t *conn);
+
+/*
+ * Moves the input that has not been consumed yet to the front of rbuf, and
+ * shrinks rbuf back to CONN_BUFSIZE if it was grown and is now empty.
+ *
+ * @param conn The connection to compact
+ * @return The number of bytes free behind the unconsumed input.
+ */
+int conn_compact(conn_t *conn);
+
+/*
+ * Reads whatever the socket has ready into the input buffer, behind the
+ * bytes that have not been consumed yet.
+ *
+ * @param conn The connection to read from
+ * @return The number of bytes read, 0 on EOF, -1 on error, or -2 if a
+ *         polled socket had nothing to read.
+ */
+int conn_recv(conn_t *conn);
+
+/*
+ * Makes sure the next n bytes of input are buffered, so that they can be
+ * parsed in place at rbufptr. A blocking connection reads as much as the
+ * socket has ready each time it needs more, after flushing pending output.
+ * A connection owned by an event loop only looks at what is buffered. rbuf
+ * is grown first if n bytes would not fit.
+ *
+ * @param conn The connection to read from
+ * @param n The number of bytes wanted
+ * @return n once the bytes are buffered, the number of bytes buffered if
+ *         EOF came first or the owner has to poll for more, or -1 on error.
+ */
+int conn_frame(conn_t *conn, int n);
+
+/*
+ * Marks the next n bytes of buffered input as consumed.
+ *
+ * @param conn The connection that was read from
+ * @param n The number of bytes parsed at rbufptr
+ */
+void conn_consume(conn_t *conn, int n);
+
+/*
+ * Queues n bytes to be sent to the client.
+ *
+ * @param conn The connection to write to
+ * @param buf The bytes to send
+ * @param n The number of bytes to send
+ * @return n on success, -1 on error.
+ */
+int conn_write(conn_t *conn, void *buf, int n);
+
+/*
+ * Queues n bytes to be sent to the client without ever writing to the
+ * socket, growing the output buffer as needed. Unlike conn_write it never
+ * blocks.
+ *
+ * @param conn The connection to write to
+ * @param buf The bytes to send
+ * @param n The number of bytes to send
+ * @return n on success, -1 on error.
+ */
+int conn_stage(conn_t *conn, void *buf, int n);
+
+/*
+ * Queues a response header followed by a value that lives elsewhere, such
+ * as in the map. A large value is never copied in user space: it is queued
+ * in vals and sent straight from that memory, and release is called once
+ * it is out, or once the connection is destroyed. Unless the owner does the
+ * sending, as much as the socket has room for goes out right away with one
+ * sendmsg() that also carries the output queued before it. A small value is
+ * copied and released before this returns. This never blocks.
+ *
+ * @param conn The connection to write to
+ * @param hdr The response header
+ * @param hdr_len The size of the header
+ * @param val The value to send after the header
+ * @param val_len The size of the value
+ * @param release Called with ctx and arg once val is no longer used, even
+ *                if this fails
+ * @param ctx Passed to release
+ * @param arg Passed to release
+ * @return 0 on success, -1 on error.
+ */
+int conn_write_value(conn_t *conn, void *hdr, int hdr_len, void *val,
+	int val_len, conn_release_f release, void *ctx, void *arg);
+
+/*
+ * Whether there is any output waiting to be sent.
+ *
+ * @param conn The connection to look at
+ * @return true if wbuf or vals hold anything.
+ */
+bool conn_pending(conn_t *conn);
+
+/*
+ * Points iov at the output waiting to be sent, in order, for the owner of a
+ * CONN_ASYNC connection to send itself.
+ *
+ * @param conn The connection to send from
+ * @param iov Set to the pieces of the output
+ * @param max The number of entries of iov
+ * @return The number of entries used, up to max.
+ */
+int conn_iov(conn_t *conn, struct iovec *iov, int max);
+
+/*
+ * Drops output that the owner of a CONN_ASYNC connection has sent itself,
+ * releasing the values that are all out.
+ *
+ * @param conn The connection that was written to
+ * @param n The number of bytes sent from the front of the output
+ */
+void conn_drain(conn_t *conn, int n);
+
+/*
+ * Writes out everything queued by conn_write and conn_write_value.
+ *
+ * @param conn The connection to flush
+ * @return 0 if everything was written, 1 if a polled socket is full and
+ *         output is still pending, -1 on error.
+ */
+int conn_flush(conn_t *conn);
+
+#endif
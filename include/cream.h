@@ -19,7 +19,27 @@ typedef struct request_header_t {
     uint32_t value_size;
 } __attribute__((packed)) request_header_t;
 
-typedef enum request_codes { PUT = 0x01, GET = 0x02, EVICT = 0x04, CLEAR = 0x08 } request_codes;
+typedef enum request_codes { PUT = 0x01, GET = 0x02, EVICT = 0x04, CLEAR = 0x08,
+    MGET = 0x10, MPUT = 0x20, MEVICT = 0x40 } request_codes;
+
+/*
+ * A batch request (MGET, MPUT or MEVICT) carries the number of entries in
+ * key_size and the size of the payload after the header in value_size. The
+ * payload is one batch_entry_t per entry, each followed by its key and, for
+ * MPUT, its value. MGET and MEVICT entries have a value_size of 0.
+ *
+ * The response is one response_header_t whose value_size is the size of
+ * the payload after it, followed by a response_header_t and, for MGET hits,
+ * the value for every entry in request order.
+ */
+typedef struct batch_entry_t {
+    uint32_t key_size;
+    uint32_t value_size;
+} __attribute__((packed)) batch_entry_t;
+
+#define MAX_BATCH_KEYS 256
+#define MAX_BATCH_SIZE (MAX_BATCH_KEYS * \
+    (sizeof(batch_entry_t) + MAX_KEY_SIZE + MAX_VALUE_SIZE))
 
 typedef struct response_header_t {
     uint32_t response_code;
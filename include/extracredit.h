@@ -25,31 +25,112 @@ typedef struct map_val_t {
 } map_val_t;
 
 typedef uint32_t (*hash_func_f)(map_key_t);
+typedef uint32_t (*keyed_hash_func_f)(map_key_t, uint64_t);
 typedef void (*destructor_f)(map_key_t, map_val_t);
+typedef int *(*refs_func_f)(map_key_t, map_val_t);
 
 typedef struct map_node_t {
     map_key_t key;
     map_val_t val;
     bool tombstone;
+    uint16_t generation;             // the map's when the entry went in
+    uint32_t hash;                   // the key's hash, compared before the key
     struct map_node_t *next;
     struct map_node_t *prev;
     time_t last_time;
 } map_node_t;
 
+/*
+ * With a keyed hash, keys are hashed with seed, which is random. A put
+ * that probes more than MAP_PROBE_LIMIT slots while the map is less than
+ * MAP_PROBE_LOAD_PERCENT full counts as a long probe, which only a flood of
+ * colliding keys makes likely, and the map is moved to a new seed right
+ * away, as long as it has taken at least as many inserts since the last
+ * reseed as it holds entries.
+ *
+ * nodes has capacity rounded up to a power of two slots, so probes wrap
+ * around its end by masking rather than dividing. The map still holds no
+ * more than capacity entries.
+ *
+ * refs_function finds the pin count an entry carries, see get_pinned(). An
+ * entry the map lets go of while it is pinned is destroyed by its last
+ * unpin instead.
+ *
+ * Entries a put replaces, evicts or finds expired are not destroyed under
+ * write_lock but put on the writing thread's retire list, and destroyed
+ * together once the lock is released.
+ *
+ * clear_map() only bumps generation. Entries of an earlier generation are
+ * gone from the map at once, but stay in their nodes until a put probes
+ * past them or the sweep, which goes through MAP_SWEEP_STEP slots per put,
+ * gets to them, and are retired then. Before generation wraps around every
+ * one left is swept, so none can come back.
+ */
 typedef struct hashmap_t {
-    uint32_t capacity;
-    uint32_t size;
+    uint64_t capacity;
+    uint64_t size;
+    uint64_t slots;                  // nodes in nodes, a power of two
     map_node_t *nodes;
     map_node_t *front;
     map_node_t *rear;
     hash_func_f hash_function;
+    keyed_hash_func_f keyed_hash_function; // used with seed if set
+    uint64_t seed;
+    uint64_t inserts;                // since the map was last reseeded
+    uint32_t long_probes;
+    uint32_t reseeds;
     destructor_f destroy_function;
+    refs_func_f refs_function;       // NULL if entries cannot be pinned
+    size_t memory;                   // bytes the entries count, see map_memory()
+    size_t max_memory;               // 0 if only capacity limits the map
+    uint16_t generation;             // bumped by every clear_map()
+    uint64_t stale;                  // entries of earlier generations left
+    uint64_t swept;                  // slot the sweep goes on from
     int num_readers;
     pthread_mutex_t write_lock;
     pthread_mutex_t fields_lock;
+#ifdef MAP_LOCK_STATS
+    uint64_t write_holds;            // see map_lock_stats()
+    uint64_t write_hold_ns;
+    uint64_t locked_at;
+#endif
     bool invalid;
 } hashmap_t;
 
+typedef struct map_config_t {
+    uint64_t capacity;
+    uint32_t num_segments;           // not supported, the map is one segment
+    hash_func_f hash_function;
+    destructor_f destroy_function;
+    bool lockfree_get;               // not supported, gets reorder the LRU list
+    size_t max_memory;               // bytes entries may count, 0 for no limit
+    keyed_hash_func_f keyed_hash_function; // if set, keys are hashed with it
+                                     // and a random seed, not hash_function
+    bool cuckoo;                     // not supported, deletes leave tombstones
+    uint32_t max_load_percent;       // not supported, the map never grows
+    refs_func_f refs_function;       // if set, entries can be pinned, see
+                                     // get_pinned()
+} map_config_t;
+
+// A key's hash along with the seed it was taken with, see map_hash()
+typedef struct map_hash_t {
+    uint32_t hash;
+    uint64_t seed;
+} map_hash_t;
+
+// Slots a put may probe before the map is reseeded
+#define MAP_PROBE_LIMIT 64
+// Above this load long probes are expected and do not count
+#define MAP_PROBE_LOAD_PERCENT 85
+
+// What an entry costs on top of its key and value: its node
+#define MAP_ENTRY_OVERHEAD sizeof(map_node_t)
+
+// Entries a thread's retire list starts out with room for
+#define MAP_RETIRE_BATCH 64
+// Slots swept for entries of earlier generations by every put
+#define MAP_SWEEP_STEP 64
+
 /* **DO NOT** modify the function prototypes below */
 
 /*
@@ -61,7 +142,85 @@ typedef struct hashmap_t {
  *                         when the map is destroyed.
  * @return A pointer to the new hashmap_t instance.
  */
-hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f destroy_function);
+hashmap_t *create_map(uint64_t capacity, hash_func_f hash_function, destructor_f destroy_function);
+
+/*
+ * Create a new hash map as described by a configuration. Options this map
+ * does not support are ignored.
+ *
+ * @param config The capacity, functions and options to use.
+ * @return A pointer to the new hashmap_t instance.
+ */
+hashmap_t *create_map_config(map_config_t *config);
+
+/*
+ * Open a read section. Every operation here takes the map's lock, so this
+ * map has nothing to defer and read sections are empty.
+ *
+ * @param self The hash map to use
+ * @return A token to pass to map_read_end().
+ */
+int map_read_begin(hashmap_t *self);
+
+/*
+ * Close a read section.
+ *
+ * @param self The hash map to use
+ * @param token What map_read_begin() returned
+ */
+void map_read_end(hashmap_t *self, int token);
+
+/*
+ * Destroy an entry returned by delete() with the map's destroy function,
+ * or leave it to its last unpin if it is pinned.
+ *
+ * @param self The hash map to use
+ * @param key The key of the removed entry
+ * @param val The value of the removed entry
+ */
+void map_retire(hashmap_t *self, map_key_t key, map_val_t val);
+
+/*
+ * Pick a new random seed for the map's keyed hash and move every entry to
+ * where it puts it, which also clears out the tombstones. The map does this
+ * by itself when it sees long probes.
+ *
+ * @param self The hash map to reseed
+ * @return true if the map was reseeded, false if it has no keyed hash or
+ *         the new nodes could not be allocated.
+ */
+bool map_reseed(hashmap_t *self);
+
+/*
+ * Count the bytes the entries of the map take up: their keys and values,
+ * and MAP_ENTRY_OVERHEAD each for their nodes. This is what
+ * map_config_t.max_memory limits, evicting the least recently used
+ * entries to stay under it.
+ *
+ * @param self The hash map to use
+ * @return The bytes counted, 0 if the map is invalid.
+ */
+size_t map_memory(hashmap_t *self);
+
+#ifdef MAP_LOCK_STATS
+/*
+ * Report how often the map's write locks were taken and for how long, for
+ * benchmarks. Only built with MAP_LOCK_STATS, which times every write lock.
+ *
+ * @param self The hash map to use
+ * @param holds Set to the number of times a write lock was taken
+ * @param hold_ns Set to the nanoseconds they were held in all
+ */
+void map_lock_stats(hashmap_t *self, uint64_t *holds, uint64_t *hold_ns);
+#endif
+
+/*
+ * Count the entries in the map.
+ *
+ * @param self The hash map to use
+ * @return The number of entries.
+ */
+uint64_t map_size(hashmap_t *self);
 
 /*
  * Insert a new key/value pair into the map.
@@ -98,7 +257,129 @@ map_val_t get(hashmap_t *self, map_key_t key);
 map_node_t delete(hashmap_t *self, map_key_t key);
 
 /*
- * Clears and destroys all entries in the map.
+ * Hash a key the way the map does, so that it can be hashed once ahead of
+ * put_hashed(), get_hashed() or delete_hashed(). A hash taken before the
+ * map was reseeded still works, the key is just hashed again under the lock.
+ *
+ * @param self The hash map to use
+ * @param key The key to hash
+ * @return The hash and the seed it was taken with, zeroed if the map or the
+ *         key is not valid.
+ */
+map_hash_t map_hash(hashmap_t *self, map_key_t key);
+
+/*
+ * put() for a key already hashed by map_hash() on this map.
+ *
+ * @param self The hash map to use
+ * @param key The key to insert
+ * @param val The value to insert
+ * @param hash What map_hash() returned for key
+ * @param force Whether or not entries should be overwritten if the map is full.
+ * @return true if the insertion was sucessful, false otherwise.
+ */
+bool put_hashed(hashmap_t *self, map_key_t key, map_val_t val,
+    map_hash_t hash, bool force);
+
+/*
+ * get() for a key already hashed by map_hash() on this map.
+ *
+ * @param self The hash map to use
+ * @param key The key to search for
+ * @param hash What map_hash() returned for key
+ * @return The corresponding value, or a map_val_t instance with a null
+ *         pointer and a value length of 0 if the key is not found.
+ */
+map_val_t get_hashed(hashmap_t *self, map_key_t key, map_hash_t hash);
+
+/*
+ * delete() for a key already hashed by map_hash() on this map.
+ *
+ * @param self The hash map to use
+ * @param key The key to remove.
+ * @param hash What map_hash() returned for key
+ * @return The removed map_node_t instance.
+ */
+map_node_t delete_hashed(hashmap_t *self, map_key_t key, map_hash_t hash);
+
+/*
+ * Insert several key/value pairs, each as put() would, under one
+ * acquisition of the map's lock.
+ *
+ * @param self The hash map to use
+ * @param keys The keys to insert
+ * @param vals The values to insert, vals[i] goes with keys[i]
+ * @param done Set to whether each pair was inserted
+ * @param n The number of pairs
+ * @param force Whether or not entries should be overwritten if the map is full.
+ * @return true if the map could be locked, false otherwise.
+ */
+bool put_many(hashmap_t *self, map_key_t *keys, map_val_t *vals, bool *done,
+    size_t n, bool force);
+
+/*
+ * Retrieve the values associated with several keys under one acquisition
+ * of the map's lock.
+ *
+ * @param self The hash map to use
+ * @param keys The keys to search for
+ * @param vals Set to what get() would return for each key
+ * @param n The number of keys
+ * @return true if the map could be locked, false otherwise.
+ */
+bool get_many(hashmap_t *self, map_key_t *keys, map_val_t *vals, size_t n);
+
+/*
+ * get_hashed() that also pins the entry found, so that it is not destroyed
+ * before map_unpin() even if it is overwritten, evicted or deleted
+ * meanwhile. Needs the map's refs_function.
+ *
+ * @param self The hash map to use
+ * @param key The key to search for
+ * @param hash What map_hash() returned for key
+ * @return The pinned entry, or a map_node_t instance with null pointers if
+ *         the key is not found.
+ */
+map_node_t get_pinned(hashmap_t *self, map_key_t key, map_hash_t hash);
+
+/*
+ * get_many() that pins every entry found, as get_pinned() does.
+ *
+ * @param self The hash map to use
+ * @param keys The keys to search for
+ * @param pins Set to what get_pinned() would return for each key
+ * @param n The number of keys
+ * @return true if the map could be locked, false otherwise.
+ */
+bool get_many_pinned(hashmap_t *self, map_key_t *keys, map_node_t *pins,
+    size_t n);
+
+/*
+ * Release a pin taken by get_pinned() or get_many_pinned(), destroying the
+ * entry if the map already let go of it and this was its last pin. This may
+ * be called after the map was invalidated.
+ *
+ * @param self The hash map the entry was pinned in
+ * @param pin The pinned entry
+ */
+void map_unpin(hashmap_t *self, map_node_t pin);
+
+/*
+ * Remove the entries associated with several keys under one acquisition
+ * of the map's lock.
+ *
+ * @param self The hash map to use
+ * @param keys The keys to remove
+ * @param removed Set to what delete() would return for each key
+ * @param n The number of keys
+ * @return true if the map could be locked, false otherwise.
+ */
+bool delete_many(hashmap_t *self, map_key_t *keys, map_node_t *removed,
+    size_t n);
+
+/*
+ * Clears all entries in the map in O(1). They are destroyed later, by the
+ * puts that come after, see hashmap_t.
  *
  * @param self The hash map to clear.
  * @return true if the operation was successful, false otherwise
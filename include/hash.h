@@ -0,0 +1,89 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include "utils.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Keys this long or shorter are hashed by word_hash() even by stripe_hash()
+#define HASH_STRIPE_MIN 512
+
+typedef struct hash_entry_t {
+    const char *name;
+    hash_func_f function;
+    keyed_hash_func_f keyed_function; // the same hash taking a seed
+} hash_entry_t;
+
+// Every hash the server can be started with, ending with a NULL name
+extern const hash_entry_t hash_functions[];
+
+/*
+ * Hash a key 8 bytes at a time, folding every 16 bytes in with one 64 by
+ * 64 bit multiplication, in the style of wyhash. Long keys are read as
+ * three independent streams of 16 bytes.
+ *
+ * @param map_key The key to hash
+ * @return The hash of the key.
+ */
+uint32_t word_hash(map_key_t map_key);
+
+/*
+ * word_hash() keyed with a seed. The constants the input is mixed with are
+ * derived from the seed as well, so keys that collide under one seed do
+ * not collide under every other.
+ *
+ * @param map_key The key to hash
+ * @param seed The seed to use
+ * @return The hash of the key.
+ */
+uint32_t word_keyed_hash(map_key_t map_key, uint64_t seed);
+
+/*
+ * Hash a key 64 bytes at a time into eight independent accumulators, in the
+ * style of XXH3's loop for long inputs, with AVX2 or SSE2 where the CPU
+ * has them. Keys of up to HASH_STRIPE_MIN bytes go to word_hash(), which is
+ * faster for them.
+ *
+ * @param map_key The key to hash
+ * @return The hash of the key.
+ */
+uint32_t stripe_hash(map_key_t map_key);
+
+/*
+ * stripe_hash() keyed with a seed, which goes into the secret the stripes
+ * are mixed with. Short keys go to word_keyed_hash().
+ *
+ * @param map_key The key to hash
+ * @param seed The seed to use
+ * @return The hash of the key.
+ */
+uint32_t stripe_keyed_hash(map_key_t map_key, uint64_t seed);
+
+/*
+ * jenkins_one_at_a_time_hash() starting from half of the seed and mixing
+ * in the other half at the end. Its state is only 32 bits, so it is the
+ * weakest of the keyed hashes.
+ *
+ * @param map_key The key to hash
+ * @param seed The seed to use
+ * @return The hash of the key.
+ */
+uint32_t jenkins_keyed_hash(map_key_t map_key, uint64_t seed);
+
+/*
+ * Get a seed for a keyed hash from the kernel, or from the clock if the
+ * kernel has no entropy to give yet.
+ *
+ * @return The seed.
+ */
+uint64_t random_seed(void);
+
+/*
+ * Find a hash by its name in hash_functions.
+ *
+ * @param name The name to look for
+ * @return The hash's entry, or NULL if there is none by that name.
+ */
+const hash_entry_t *hash_by_name(const char *name);
+
+#endif
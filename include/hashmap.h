@@ -23,25 +23,286 @@ typedef struct map_val_t {
 } map_val_t;
 
 typedef uint32_t (*hash_func_f)(map_key_t);
+typedef uint32_t (*keyed_hash_func_f)(map_key_t, uint64_t);
 typedef void (*destructor_f)(map_key_t, map_val_t);
+typedef int *(*refs_func_f)(map_key_t, map_val_t);
+
+/*
+ * An entry of the map. Entries are kept in Robin Hood order: dist is how
+ * far the entry sits past its home slot, and an entry is never placed
+ * behind one that is further from home than it would be. Deleting shifts
+ * the entries after it back instead of leaving a tombstone, except in a
+ * table that is being migrated out of, see map_segment_t. In a cuckoo
+ * table, see map_table_t, dist is always 0. hash is the key's
+ * hash under the seed of the table it is in, see map_segment_t, kept so
+ * that probes can skip other keys without reading them and the key is
+ * only hashed again when its segment is reseeded, not when it moves to a
+ * new table.
+ * key_inline is a copy of the first MAP_INLINE_KEY_SIZE bytes of the key,
+ * so keys up to that long are compared without following key.key_base.
+ * The fields add up to one cache line.
+ */
+#define MAP_INLINE_KEY_SIZE 23
 
 typedef struct map_node_t {
     map_key_t key;
     map_val_t val;
+    uint32_t dist;
+    uint32_t hash;
     bool tombstone;
+    uint8_t key_inline[MAP_INLINE_KEY_SIZE];
 } map_node_t;
 
-typedef struct hashmap_t {
-    uint32_t capacity;
-    uint32_t size;
+/*
+ * A reader count on a cache line of its own. Every reader thread sticks to
+ * one slot, so readers of a segment do not write to memory that other
+ * readers use.
+ */
+typedef struct map_reader_slot_t {
+    int count;
+} __attribute__((aligned(64))) map_reader_slot_t;
+
+/*
+ * The read sections of the threads using one slot, counted separately for
+ * those that began in an even and in an odd epoch.
+ */
+typedef struct map_epoch_slot_t {
+    int readers[2];
+} __attribute__((aligned(64))) map_epoch_slot_t;
+
+#define MAP_READER_SLOTS 32
+
+// Nodes of a bucket of a cuckoo table
+#define MAP_BUCKET_SIZE 4
+
+// Tags compared by one probe step
+#define MAP_GROUP_SIZE 16
+#define MAP_TAG_DELETED 0x01
+
+/*
+ * The slots of a segment. tags holds one byte per node: 0 if the node is
+ * empty, MAP_TAG_DELETED for a tombstone, otherwise up to seven bits of
+ * its key's hash that the segment and the home slot were not picked by,
+ * with the high bit set. Lookups compare the tags of MAP_GROUP_SIZE nodes
+ * at once and only look at a node when its tag matches. The first
+ * MAP_GROUP_SIZE - 1 tags are repeated after the last, so a group starting
+ * at any node is one unaligned load. Both arrays share one allocation,
+ * which starts at nodes on a cache line boundary. capacity is always a
+ * power of two, so probes wrap around the end of the table by masking
+ * rather than dividing.
+ *
+ * A map created with cuckoo set splits its tables into buckets of
+ * MAP_BUCKET_SIZE nodes instead, and a key lives in one of two buckets
+ * picked from its hash. A lookup compares the tags of those two buckets,
+ * two cache lines at most, and only reads the nodes they match, however
+ * full the table is. An insert into two full buckets searches breadth
+ * first for a path of at most MAP_CUCKOO_MAX_PATH entries, each of which
+ * can move to its other bucket, ending at a free node, and moves them
+ * along it.
+ */
+typedef struct map_table_t {
     map_node_t *nodes;
+    uint8_t *tags;                   // capacity + MAP_GROUP_SIZE - 1 bytes
+    uint64_t capacity;
+    uint64_t size;
+} map_table_t;
+
+/*
+ * An entry, or a whole table, waiting for the read sections that may still
+ * see it to end. A table that was cleared still holds its entries, which
+ * are swept once it is out of sight, see clear_map().
+ */
+typedef struct map_retired_t {
+    map_key_t key;
+    map_val_t val;
+    map_node_t *table;               // if set, a table to free, not an entry
+    uint64_t sweep;                  // slots of table left to sweep
+} map_retired_t;
+
+/*
+ * What the threads using one reader slot have retired. Each thread
+ * retires to its own slot's list, so writers to different segments share
+ * no lock, and no cache line, to do it.
+ */
+typedef struct map_retire_list_t {
+    pthread_mutex_t lock;
+    map_retired_t *items;
+    uint32_t num;
+    uint32_t cap;
+} __attribute__((aligned(64))) map_retire_list_t;
+
+/*
+ * One independently locked part of the map. A key always lives in the
+ * segment picked from its hash, so operations on keys in different
+ * segments never wait on each other.
+ *
+ * Writers take write_lock. Readers only announce themselves in their
+ * reader slot and check that writers is 0; a writer bumps writers before
+ * waiting for write_lock and for the slots to drain, so readers that come
+ * after it wait for it and it never waits for more than the readers that
+ * were already in. seq is odd while a writer holds the segment, which lets
+ * lock-free gets notice that the segment changed under them.
+ *
+ * The table only has room for the entries the segment holds now. Once it
+ * is more than the map's max_load_percent full it is replaced by one twice
+ * the size, or sooner if it is a cuckoo table that no path leads into, and
+ * by one half the size once it is less than MAP_MIN_LOAD_PERCENT full. The
+ * entries move over MAP_MIGRATE_STEP slots per write, so until migrated
+ * reaches old.capacity keys are looked up in both tables. Nothing is added
+ * to old meanwhile, and deleting from it leaves a tombstone, so no entry
+ * moves past the migration. No write moves more than that: a table that
+ * fills up again while old is still there simply gets fuller, and a full
+ * segment evicts from whichever table the victim is in. A cuckoo table
+ * with no room for an entry being moved grows on the spot, and one whose
+ * keys collide holds the migration up at that entry until a reseed, see
+ * migrate().
+ *
+ * With a keyed hash, the hash the map's seed gives a key only picks its
+ * segment. The segment's tables are hashed with seed, the map's own until
+ * a reseed, when the key only has to be hashed once. An insert that lands
+ * more than MAP_PROBE_LIMIT slots past its home, or into a cuckoo table
+ * where every bucket it could move entries to is full, counts as a long
+ * probe, which at the table's load only a flood of colliding keys makes
+ * likely, and sets reseed_pending. If the segment has taken at least as
+ * many inserts since its last reseed as it holds entries, which keeps the
+ * cost at O(1) per insert, the write then starts a migration to a table
+ * hashed with a new random seed, and until it ends old is looked up with
+ * old_seed. Only a migration that is already going on delays that, or if
+ * it is stalled by colliding keys, which only a new seed gets past, both
+ * tables are rebuilt into one at once.
+ */
+typedef struct map_segment_t {
+    uint64_t max_size;               // entries the segment may hold
+    size_t memory;                   // bytes its entries count, see map_memory()
+    size_t max_memory;               // 0 if only max_size limits the segment
+    uint64_t migrated;               // slots of old already moved to table
+    uint64_t inserts;                // since the segment was last reseeded
+    map_table_t table;
+    map_table_t old;                 // all zero unless migrating
+    uint64_t seed;                   // table's keys are hashed with
+    uint64_t old_seed;               // old's keys are hashed with
+    bool reseed_pending;
+    bool stalled;                    // migrate() is held up by a collision
+    int writers;                     // writers holding or waiting for write_lock
+    unsigned int seq;
+    pthread_mutex_t write_lock;
+#ifdef MAP_LOCK_STATS
+    uint64_t write_holds;            // see map_lock_stats()
+    uint64_t write_hold_ns;
+    uint64_t locked_at;
+#endif
+    map_reader_slot_t readers[MAP_READER_SLOTS];
+} __attribute__((aligned(64))) map_segment_t;
+
+/*
+ * Entries that are overwritten, or deleted and handed back with
+ * map_retire(), are only destroyed once every read section that was open
+ * when they left the map has ended, and tables that were migrated out of
+ * are only freed then. They wait on the retire list of the thread that let
+ * go of them. Once the lists hold MAP_RETIRE_BATCH of them between them,
+ * or one holds a table, which may be large, every list is taken and
+ * destroyed as one batch by the next writer to leave its segment.
+ *
+ * With a keyed hash, keys are hashed with seed, which is random and picks
+ * every key's segment for the life of the map. Each segment is reseeded on
+ * its own, see map_segment_t, and reseeds counts how often.
+ *
+ * clear_map() swaps every segment's tables for empty ones and retires the
+ * old ones whole, and waits out the read sections that can still see them
+ * right away so they go to sweeping at once. Every read or write of the
+ * map then destroys the entries of MAP_SWEEP_STEP of their slots, freeing
+ * each table once it is through. Until then the entries stay in unswept,
+ * which map_memory() and max_memory count, and a put that would go over
+ * its budget sweeps before it evicts anything.
+ *
+ * refs_function finds the pin count an entry carries, an int the owner of
+ * the entry keeps next to it and sets to 0 before putting it in. Every pin
+ * adds one; once the map lets go of an entry it takes one off instead of
+ * destroying it, and so does every unpin, and whichever of them takes the
+ * count below 0 destroys the entry.
+ */
+typedef struct hashmap_t {
+    uint64_t capacity;
+    uint32_t num_segments;           // a power of two
+    uint32_t segment_bits;           // log2 of num_segments
+    map_segment_t *segments;
     hash_func_f hash_function;
+    keyed_hash_func_f keyed_hash_function; // used with seed if set
     destructor_f destroy_function;
-    int num_readers;
-    pthread_mutex_t write_lock;
-    pthread_mutex_t fields_lock;
+    refs_func_f refs_function;       // NULL if entries cannot be pinned
+    size_t max_memory;
+    uint64_t seed;
+    uint32_t long_probes;
+    uint32_t reseeds;
+    bool lockfree_get;
+    bool cuckoo;                     // tables are cuckoo tables, see map_table_t
+    uint32_t max_load_percent;       // full a table gets before it grows
     bool invalid;
-} hashmap_t;
+    unsigned int epoch;
+    map_epoch_slot_t epoch_slots[MAP_READER_SLOTS];
+    pthread_mutex_t reclaim_lock;    // held while waiting out read sections
+    uint32_t num_retired;            // on every retire list together
+    bool table_retired;              // since the lists were last taken
+    map_retire_list_t retire_lists[MAP_READER_SLOTS];
+    pthread_mutex_t sweep_lock;
+    map_retired_t *sweeping;         // cleared tables, last one swept first
+    uint32_t num_sweeping;
+    uint32_t sweeping_cap;
+    size_t unswept;                  // bytes of cleared entries not yet swept
+} __attribute__((aligned(64))) hashmap_t;
+
+typedef struct map_config_t {
+    uint64_t capacity;
+    uint32_t num_segments;           // 0 lets the map pick from the capacity,
+                                     // rounded down to a power of two
+    hash_func_f hash_function;
+    destructor_f destroy_function;
+    bool lockfree_get;               // get() takes no lock at all
+    size_t max_memory;               // bytes entries may count, split across
+                                     // the segments like capacity, 0 for no limit.
+                                     // A segment takes an entry bigger than its
+                                     // share by holding only that one
+    keyed_hash_func_f keyed_hash_function; // if set, keys are hashed with it
+                                     // and a random seed, not hash_function
+    bool cuckoo;                     // use cuckoo tables, see map_table_t
+    uint32_t max_load_percent;       // up to 100, 0 for MAP_MAX_LOAD_PERCENT
+                                     // or MAP_CUCKOO_MAX_LOAD_PERCENT
+    refs_func_f refs_function;       // if set, entries can be pinned, see
+                                     // get_pinned()
+} map_config_t;
+
+// A key's hash along with the seed it was taken with, see map_hash()
+typedef struct map_hash_t {
+    uint32_t hash;
+    uint64_t seed;
+} map_hash_t;
+
+#define MAP_RETIRE_BATCH 64
+
+// What an entry costs on top of its key and value: its node and tag
+#define MAP_ENTRY_OVERHEAD (sizeof(map_node_t) + 1)
+
+// Upper bound on the number of segments create_map splits a map into
+#define MAP_SEGMENTS 64
+// create_map uses fewer segments rather than give one less than this
+#define MAP_SEGMENT_MIN_CAPACITY 64
+
+// Slots of a segment's table when it is created, and the fewest it shrinks
+// to. A power of two, as every table's capacity is
+#define MAP_TABLE_MIN_CAPACITY 16
+#define MAP_MAX_LOAD_PERCENT 85
+#define MAP_CUCKOO_MAX_LOAD_PERCENT 95
+#define MAP_MIN_LOAD_PERCENT 10
+// Slots of the old table moved to the new one by every write to a segment
+#define MAP_MIGRATE_STEP 16
+// Slots of cleared tables swept by every read and write, see hashmap_t
+#define MAP_SWEEP_STEP 64
+// Slots past its home an insert may land before its segment is reseeded
+#define MAP_PROBE_LIMIT 64
+// Entries an insert into a cuckoo table may move to make room
+#define MAP_CUCKOO_MAX_PATH 5
+// Buckets a cuckoo insert looks at while searching for a path
+#define MAP_CUCKOO_SEARCH 512
 
 /*
  * Create a new hash map.
@@ -52,14 +313,113 @@ typedef struct hashmap_t {
  *                         when the map is destroyed.
  * @return A pointer to the new hashmap_t instance.
  */
-hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f destroy_function);
+hashmap_t *create_map(uint64_t capacity, hash_func_f hash_function, destructor_f destroy_function);
+
+/*
+ * Create a new hash map split into a given number of segments. The capacity
+ * is shared evenly between the segments, and a segment that is full counts
+ * as a full map for the keys that hash to it.
+ *
+ * @param capacity The number of elements the map can hold.
+ * @param num_segments The number of segments, at most capacity. It is
+ *                     rounded down to a power of two.
+ * @param hash_function The function to be used to hash keys.
+ * @param destroy_function The function to be used to destroy elements
+ *                         when the map is destroyed.
+ * @return A pointer to the new hashmap_t instance.
+ */
+hashmap_t *create_map_segmented(uint64_t capacity, uint32_t num_segments,
+    hash_func_f hash_function, destructor_f destroy_function);
+
+/*
+ * Create a new hash map as described by a configuration.
+ *
+ * @param config The capacity, segment count, functions and options to use.
+ * @return A pointer to the new hashmap_t instance.
+ */
+hashmap_t *create_map_config(map_config_t *config);
+
+/*
+ * Open a read section. Nothing that leaves the map while a read section is
+ * open is destroyed before the section is closed, so a value returned by
+ * get() inside one stays valid until map_read_end(). Puts and deletes may
+ * be called inside a read section but then never destroy anything
+ * themselves.
+ *
+ * @param self The hash map to use
+ * @return A token to pass to map_read_end().
+ */
+int map_read_begin(hashmap_t *self);
+
+/*
+ * Close a read section.
+ *
+ * @param self The hash map to use
+ * @param token What map_read_begin() returned
+ */
+void map_read_end(hashmap_t *self, int token);
+
+/*
+ * Hand an entry returned by delete() back to the map, which destroys it with
+ * its destroy function once no open read section can still be using it,
+ * or leaves it to its last unpin if it is pinned.
+ *
+ * @param self The hash map to use
+ * @param key The key of the removed entry
+ * @param val The value of the removed entry
+ */
+void map_retire(hashmap_t *self, map_key_t key, map_val_t val);
+
+/*
+ * Pick a new random seed for every segment and start moving its entries to
+ * where it puts them, see map_segment_t. The map does this by itself for a
+ * segment that sees long probes. A segment that is still migrating is
+ * rebuilt under the new seed at once instead.
+ *
+ * @param self The hash map to reseed
+ * @return true if every segment was reseeded, false if the map has no
+ *         keyed hash or a new table could not be allocated.
+ */
+bool map_reseed(hashmap_t *self);
+
+/*
+ * Count the bytes the entries of the map take up: their keys and values,
+ * and MAP_ENTRY_OVERHEAD each for the map's own bookkeeping, including
+ * those of cleared entries not yet swept. This is what
+ * map_config_t.max_memory limits.
+ *
+ * @param self The hash map to use
+ * @return The bytes counted, 0 if the map is invalid.
+ */
+size_t map_memory(hashmap_t *self);
+
+#ifdef MAP_LOCK_STATS
+/*
+ * Report how often the map's write locks were taken and for how long, for
+ * benchmarks. Only built with MAP_LOCK_STATS, which times every write lock.
+ *
+ * @param self The hash map to use
+ * @param holds Set to the number of times a write lock was taken
+ * @param hold_ns Set to the nanoseconds they were held in all
+ */
+void map_lock_stats(hashmap_t *self, uint64_t *holds, uint64_t *hold_ns);
+#endif
+
+/*
+ * Count the entries in the map. The segments are not locked, so the count
+ * is only exact while nothing is being inserted or removed.
+ *
+ * @param self The hash map to use
+ * @return The number of entries.
+ */
+uint64_t map_size(hashmap_t *self);
 
 /*
  * Insert a new key/value pair into the map.
  * If the key already exists, the corresponding value is overwritten.
  * If the map is full and force is false, nothing is inserted.
- * If the map is full and force is true, the entry at the index computed by
- * get_index() is overwritten.
+ * If the map is full and force is true, the entry at the key's home index
+ * in its segment is overwritten.
  *
  * @param self The hash map to use
  * @param key The key to insert
@@ -70,7 +430,9 @@ hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f
 bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force);
 
 /*
- * Retrieve the value associated with a key.
+ * Retrieve the value associated with a key. With lockfree_get set this
+ * takes no lock: the lookup is simply retried if a writer changed the
+ * key's segment while it ran.
  *
  * @param self The hash map to use
  * @param key The key to search for
@@ -89,10 +451,138 @@ map_val_t get(hashmap_t *self, map_key_t key);
 map_node_t delete(hashmap_t *self, map_key_t key);
 
 /*
- * Clears and destroys all entries in the map.
+ * Hash a key the way the map does, so that it can be hashed once ahead of
+ * put_hashed(), get_hashed() or delete_hashed(), such as while the rest of
+ * a request is still being read. The hash only picks the key's segment,
+ * which no reseed changes, so it stays good for the life of the map.
+ *
+ * @param self The hash map to use
+ * @param key The key to hash
+ * @return The hash and the seed it was taken with, zeroed if the map or the
+ *         key is not valid.
+ */
+map_hash_t map_hash(hashmap_t *self, map_key_t key);
+
+/*
+ * put() for a key already hashed by map_hash() on this map.
+ *
+ * @param self The hash map to use
+ * @param key The key to insert
+ * @param val The value to insert
+ * @param hash What map_hash() returned for key
+ * @param force Whether or not entries should be overwritten if the map is full.
+ * @return true if the insertion was sucessful, false otherwise.
+ */
+bool put_hashed(hashmap_t *self, map_key_t key, map_val_t val,
+    map_hash_t hash, bool force);
+
+/*
+ * get() for a key already hashed by map_hash() on this map.
+ *
+ * @param self The hash map to use
+ * @param key The key to search for
+ * @param hash What map_hash() returned for key
+ * @return The corresponding value, or a map_val_t instance with a null
+ *         pointer and a value length of 0 if the key is not found.
+ */
+map_val_t get_hashed(hashmap_t *self, map_key_t key, map_hash_t hash);
+
+/*
+ * delete() for a key already hashed by map_hash() on this map.
+ *
+ * @param self The hash map to use
+ * @param key The key to remove.
+ * @param hash What map_hash() returned for key
+ * @return The removed map_node_t instance.
+ */
+map_node_t delete_hashed(hashmap_t *self, map_key_t key, map_hash_t hash);
+
+/*
+ * Insert several key/value pairs, each as put() would, taking the lock of
+ * every segment involved once.
+ *
+ * @param self The hash map to use
+ * @param keys The keys to insert
+ * @param vals The values to insert, vals[i] goes with keys[i]
+ * @param done Set to whether each pair was inserted
+ * @param n The number of pairs
+ * @param force Whether or not entries should be overwritten if the map is full.
+ * @return true if the segments could be locked, false otherwise.
+ */
+bool put_many(hashmap_t *self, map_key_t *keys, map_val_t *vals, bool *done,
+    size_t n, bool force);
+
+/*
+ * Retrieve the values associated with several keys, taking the lock of
+ * every segment involved once.
+ *
+ * @param self The hash map to use
+ * @param keys The keys to search for
+ * @param vals Set to what get() would return for each key
+ * @param n The number of keys
+ * @return true if the segments could be locked, false otherwise.
+ */
+bool get_many(hashmap_t *self, map_key_t *keys, map_val_t *vals, size_t n);
+
+/*
+ * get_hashed() that also pins the entry found, so that it is not destroyed
+ * before map_unpin() even if it is overwritten, evicted or deleted
+ * meanwhile. Unlike a read section, a pin does not hold back the
+ * destruction of anything else, so it may be kept for as long as it takes
+ * to send the value. Needs the map's refs_function.
+ *
+ * @param self The hash map to use
+ * @param key The key to search for
+ * @param hash What map_hash() returned for key
+ * @return The pinned entry, or a map_node_t instance with null pointers if
+ *         the key is not found.
+ */
+map_node_t get_pinned(hashmap_t *self, map_key_t key, map_hash_t hash);
+
+/*
+ * get_many() that pins every entry found, as get_pinned() does.
+ *
+ * @param self The hash map to use
+ * @param keys The keys to search for
+ * @param pins Set to what get_pinned() would return for each key
+ * @param n The number of keys
+ * @return true if the segments could be locked, false otherwise.
+ */
+bool get_many_pinned(hashmap_t *self, map_key_t *keys, map_node_t *pins,
+    size_t n);
+
+/*
+ * Release a pin taken by get_pinned() or get_many_pinned(), destroying the
+ * entry if the map already let go of it and this was its last pin. This may
+ * be called after the map was invalidated.
+ *
+ * @param self The hash map the entry was pinned in
+ * @param pin The pinned entry
+ */
+void map_unpin(hashmap_t *self, map_node_t pin);
+
+/*
+ * Remove the entries associated with several keys, taking the lock of
+ * every segment involved once.
+ *
+ * @param self The hash map to use
+ * @param keys The keys to remove
+ * @param removed Set to what delete() would return for each key
+ * @param n The number of keys
+ * @return true if the segments could be locked, false otherwise.
+ */
+bool delete_many(hashmap_t *self, map_key_t *keys, map_node_t *removed,
+    size_t n);
+
+/*
+ * Clears all entries in the map. Only as many empty tables as the map has
+ * segments are put in under the locks; the entries are destroyed later,
+ * a few at a time by the reads and writes that come after, and count in
+ * map_memory() until then, see hashmap_t.
  *
  * @param self The hash map to clear.
- * @return true if the operation was successful, false otherwise
+ * @return true if the operation was successful, false otherwise, with
+ *   errno set to ENOMEM if there was no memory for the empty tables.
  */
 bool clear_map(hashmap_t *self);
 
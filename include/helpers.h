@@ -4,6 +4,8 @@
 #include "cream.h"
 #include "utils.h"
 #include "queue.h"
+#include "conn.h"
+#include "slab.h"
 #include "stdlib.h"
 #include "stdio.h"
 #include "string.h"
@@ -14,33 +16,73 @@
 #include "unistd.h"
 #include "strings.h"
 #include "errno.h"
+#include "stdbool.h"
+#include "stddef.h"
 
 
-#define USAGE "./cream [-h] NUM_WORKERS PORT_NUMBER MAX_ENTRIES\n" \
+#define USAGE "./cream [-h] [-e] [-u] [-r] [-l] [-c] [-m MAX_MEMORY] [-H HASH] NUM_WORKERS PORT_NUMBER MAX_ENTRIES\n" \
 "-h                 Displays this help menu and returns EXIT_SUCCESS.\n" \
-"NUM_WORKERS        The number of worker threads used to service requests.\n" \
+"-e                 Serve connections from epoll event loops instead of one worker thread per connection.\n" \
+"-u                 Serve connections from io_uring event loops. Falls back to the mode picked without -u if the kernel lacks support.\n" \
+"-r                 Give every event loop, or without -e and -u every core's share of the workers, its own SO_REUSEPORT listener and accept loop.\n" \
+"-l                 Serve GETs without taking any lock. Replaced and evicted entries are freed once no GET can still be reading them.\n" \
+"-c, --cuckoo       Keep entries in cuckoo tables, where a GET looks at no more than two buckets of four entries however full the map is.\n" \
+"-m, --max-memory MAX_MEMORY\n" \
+"                   Bytes the entries may take up, counting keys, values and the map's own overhead, with an optional K, M or G suffix. Entries are evicted to stay under it.\n" \
+"-H, --hash HASH    Hash keys with jenkins, one byte at a time, word, 8 bytes at a time, or stripe, 64 bytes at a time with SSE2 or AVX2 for keys over 512 bytes (default jenkins).\n" \
+"NUM_WORKERS        The number of worker threads used to service requests, or the number of event loops with -e or -u.\n" \
 "PORT_NUMBER        Port number to listen on for incoming connections.\n" \
-"MAX_ENTRIES        The maximum number of entries that can be stored in `cream`'s underlying data store.\n" \
+"MAX_ENTRIES        The maximum number of entries that can be stored in `cream`'s underlying data store, with an optional K, M or G suffix.\n" \
+"Send SIGUSR1 to print how much of the memory held for entries is in use, per size class, and how often keys were rehashed with a new seed.\n" \
 
-typedef void (*resp_function)(int, int, int, hashmap_t*);
+// A request parsed in place in a connection's input buffer. key and val
+// point into that buffer and are only valid until the handler returns. For
+// a batch request key points at the payload. The key of a PUT, GET or EVICT
+// is hashed by serve_request, before the rest of the request is read
+typedef struct request_t {
+	request_header_t hdr;
+	void *key;
+	void *val;
+	map_hash_t hash;
+} request_t;
+
+typedef int (*resp_function)(conn_t*, request_t*, hashmap_t*);
 
 
 int parse_command_to_int(const char *arg);
+// Parses a count, of bytes or entries, with an optional K, M or G suffix.
+// Returns 0 if arg is not one, or if it does not fit in a size_t
+size_t parse_command_to_size(const char *arg);
+
+// Where the entries handed to g_map are allocated from
+extern slab_t *g_slab;
 
 
 void map_destroyer(map_key_t key, map_val_t val);
-int open_listenfd(int port);
+// Finds the pin count of an entry put in by put_response or mput_response
+int *map_refs(map_key_t key, map_val_t val);
+int open_listenfd(int port, bool reuseport);
 
 
 int Read(int fd, void *buf, int nbytes);
+int Write(int fd, void *buf, int nbytes);
+
+int request_frame_size(request_header_t hdr);
 
+// Handlers return 0 if the connection can carry another request and -1 if
+// it has to be closed
+int serve_request(conn_t *conn, hashmap_t *g_map);
+int serve_buffered(conn_t *conn, hashmap_t *g_map);
 resp_function get_response_function(request_header_t hdr);
-void put_response(int fd, int key_size, int val_size, hashmap_t *g_map);
-void get_response(int fd, int key_size, int val_size, hashmap_t *g_map);
-void clear_response(int fd, int key_size, int val_size, hashmap_t *g_map);
-void evict_response(int fd, int key_size, int val_size, hashmap_t *g_map);
-void invalid_request(int fd, int key_size, int val_size, hashmap_t *g_map);
-void bad_req_response(int fd);
+int put_response(conn_t *conn, request_t *req, hashmap_t *g_map);
+int get_response(conn_t *conn, request_t *req, hashmap_t *g_map);
+int clear_response(conn_t *conn, request_t *req, hashmap_t *g_map);
+int evict_response(conn_t *conn, request_t *req, hashmap_t *g_map);
+int mput_response(conn_t *conn, request_t *req, hashmap_t *g_map);
+int mget_response(conn_t *conn, request_t *req, hashmap_t *g_map);
+int mevict_response(conn_t *conn, request_t *req, hashmap_t *g_map);
+int invalid_request(conn_t *conn, request_t *req, hashmap_t *g_map);
+int bad_req_response(conn_t *conn);
 
 
 
@@ -0,0 +1,34 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "helpers.h"
+
+#define REACTOR_MAX_EVENTS 256
+
+/*
+ * One epoll event loop. Each loop accepts its own connections from its
+ * listening socket, which may be shared with other loops, and keeps them
+ * for their whole life, so a connection is only ever touched by one thread.
+ */
+typedef struct reactor_t {
+	int epoll_fd;
+	int listen_fd;
+	hashmap_t *map;
+	pthread_t thread;
+} reactor_t;
+
+/*
+ * Serves the listening sockets with num_loops epoll event loops. Sockets are
+ * non-blocking and only requests that are completely buffered are passed
+ * to the request handlers, so idle or slow clients never hold up a thread.
+ *
+ * @param listen_fds The listening sockets, loop i accepts from
+ *                   listen_fds[i % num_listeners]
+ * @param num_listeners The number of listening sockets
+ * @param num_loops The number of event loop threads to run
+ * @param map The map requests are served from
+ * @return Only returns, with -1, if the loops could not be started.
+ */
+int run_reactors(int *listen_fds, int num_listeners, int num_loops, hashmap_t *map);
+
+#endif
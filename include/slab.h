@@ -0,0 +1,148 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "cream.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Pages are aligned to their size, so an object's page is found by masking
+#define SLAB_PAGE_SIZE (64 * 1024)
+// Largest object served from a size class, anything bigger goes to malloc
+#define SLAB_MAX_SIZE (MAX_KEY_SIZE + MAX_VALUE_SIZE)
+#define SLAB_MIN_SIZE 16
+#define SLAB_CLASSES 32
+// Objects a thread keeps per class before it gives some back
+#define SLAB_MAGAZINE_SIZE 32
+// Empty pages kept for any class to reuse before they go back to malloc
+#define SLAB_EMPTY_PAGES 64
+
+/*
+ * The start of every page. A page belongs to one size class at a time and
+ * is on exactly one list: its class's partial or full list, or the pool of
+ * empty pages.
+ */
+typedef struct slab_page_t {
+    struct slab_page_t *next;
+    struct slab_page_t *prev;
+    void *free;                      // objects given back, linked through themselves
+    char *unused;                    // objects never handed out start here
+    uint32_t used;                   // objects out of the page
+    uint32_t size_class;
+} __attribute__((aligned(64))) slab_page_t;
+
+typedef struct slab_class_t {
+    pthread_mutex_t lock;
+    uint32_t size;                   // size of every object of the class
+    uint32_t per_page;
+    slab_page_t *partial;            // pages with objects left to hand out
+    slab_page_t *full;
+    uint64_t pages;
+    uint64_t used;                   // objects out of the pages, cached or live
+} __attribute__((aligned(64))) slab_class_t;
+
+typedef struct slab_magazine_t {
+    uint32_t count;
+    void *objects[SLAB_MAGAZINE_SIZE];
+} slab_magazine_t;
+
+struct slab_t;
+
+/*
+ * What one thread caches. live and requested count the objects the thread
+ * handed out minus those it took back, so they go negative for a thread
+ * that mostly frees what others allocated; only their sum means anything.
+ */
+typedef struct slab_cache_t {
+    struct slab_t *slab;
+    struct slab_cache_t *next;
+    slab_magazine_t magazines[SLAB_CLASSES];
+    int64_t live[SLAB_CLASSES];
+    int64_t requested[SLAB_CLASSES];
+} slab_cache_t;
+
+/*
+ * An allocator for objects of up to SLAB_MAX_SIZE bytes. Sizes are rounded
+ * up to one of num_classes size classes, each about a quarter bigger than
+ * the one before, and every class carves its objects out of
+ * SLAB_PAGE_SIZE pages. Threads allocate from and free to magazines of
+ * their own and only take the class lock to move half a magazine at a
+ * time. Pages whose objects have all been freed can be taken by any class.
+ */
+typedef struct slab_t {
+    slab_class_t classes[SLAB_CLASSES];
+    uint32_t num_classes;
+    uint8_t class_of[SLAB_MAX_SIZE / SLAB_MIN_SIZE + 1];
+    pthread_key_t cache_key;
+    pthread_mutex_t pages_lock;
+    slab_page_t *empty;
+    uint32_t num_empty;
+    pthread_mutex_t caches_lock;
+    slab_cache_t *caches;
+    int64_t live[SLAB_CLASSES];      // left behind by threads that exited
+    int64_t requested[SLAB_CLASSES];
+} slab_t;
+
+typedef struct slab_stats_t {
+    uint32_t size;                   // object size of the class
+    uint64_t pages;
+    uint64_t objects;                // objects the pages can hold
+    uint64_t used;                   // objects out of the pages
+    uint64_t live;                   // objects allocated and not freed
+    uint64_t requested;              // bytes asked for by the live objects
+} slab_stats_t;
+
+/*
+ * Create a slab allocator.
+ *
+ * @return A pointer to the new slab_t instance, or NULL on failure.
+ */
+slab_t *slab_create(void);
+
+/*
+ * Allocate size bytes.
+ *
+ * @param self The allocator to use
+ * @param size The number of bytes needed, at least 1
+ * @return The object, or NULL on failure.
+ */
+void *slab_alloc(slab_t *self, size_t size);
+
+/*
+ * Free an object returned by slab_alloc().
+ *
+ * @param self The allocator the object came from
+ * @param ptr The object, may be NULL
+ * @param size The size it was allocated with
+ */
+void slab_free(slab_t *self, void *ptr, size_t size);
+
+/*
+ * Get the utilisation of one size class.
+ *
+ * @param self The allocator to use
+ * @param size_class A class from 0 to self->num_classes - 1
+ * @param stats Where to put the numbers
+ * @return false if size_class does not exist.
+ */
+bool slab_stats(slab_t *self, uint32_t size_class, slab_stats_t *stats);
+
+/*
+ * Print the utilisation of every size class that has pages.
+ *
+ * @param self The allocator to use
+ * @param out Where to print to
+ */
+void slab_print_stats(slab_t *self, FILE *out);
+
+/*
+ * Free every page and thread cache. No other thread may use the allocator
+ * any more, and objects that were not freed are lost.
+ *
+ * @param self The allocator to destroy
+ */
+void slab_destroy(slab_t *self);
+
+#endif
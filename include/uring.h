@@ -0,0 +1,38 @@
+#ifndef URING_H
+#define URING_H
+
+#include "helpers.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#define URING_ENTRIES 256
+
+/*
+ * Checks that the running kernel supports io_uring and every operation
+ * the io_uring loops need.
+ *
+ * @return true if run_uring can be used.
+ */
+bool uring_supported(void);
+
+/*
+ * Serves the listening sockets with num_loops io_uring event loops. Each loop
+ * owns one ring: connections are accepted with a multishot accept, and the
+ * receives and sends of every connection that became ready during one pass
+ * are submitted together with a single io_uring_enter(), which also waits
+ * for the next completions.
+ *
+ * @param listen_fds The listening sockets, loop i accepts from
+ *                   listen_fds[i % num_listeners]
+ * @param num_listeners The number of listening sockets
+ * @param num_loops The number of loop threads to run
+ * @param map The map requests are served from
+ * @return Only returns, with -1, if the loops could not be started.
+ */
+int run_uring(int *listen_fds, int num_listeners, int num_loops, hashmap_t *map);
+
+#endif
@@ -0,0 +1,315 @@
+#include "helpers.h"
+#include "conn.h"
+#include "netinet/tcp.h"
+#include "sys/uio.h"
+
+// Pieces of output handed to one sendmsg()
+#define CONN_IOV_MAX 16
+
+int conn_init(conn_t *conn, int fd, conn_mode mode)
+{
+	int optval = 1;
+
+	// responses are only written once they are complete, so there is
+	// nothing for Nagle to coalesce and waiting on the peer's ack would
+	// only stall the next response of a pipeline
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(int));
+
+	conn->fd = fd;
+	conn->mode = mode;
+	conn->rcnt = 0;
+	conn->rcap = CONN_BUFSIZE;
+	if((conn->rbuf = malloc(CONN_BUFSIZE)) == NULL)
+		return -1;
+	conn->rbufptr = conn->rbuf;
+	conn->wcnt = 0;
+	conn->wcap = CONN_BUFSIZE;
+	if((conn->wbuf = malloc(CONN_BUFSIZE)) == NULL) {
+		free(conn->rbuf);
+		return -1;
+	}
+	conn->nvals = conn->vcap = 0;
+	conn->vals = NULL;
+	return 0;
+}
+
+void conn_destroy(conn_t *conn)
+{
+	free(conn->rbuf);
+	conn->rbuf = conn->rbufptr = NULL;
+	conn->rcap = 0;
+	conn->rcnt = 0;
+	free(conn->wbuf);
+	conn->wbuf = NULL;
+	conn->wcap = 0;
+	conn->wcnt = 0;
+	for(int i = 0; i < conn->nvals; i++)
+		conn->vals[i].release(conn->vals[i].ctx, conn->vals[i].arg);
+	free(conn->vals);
+	conn->vals = NULL;
+	conn->nvals = conn->vcap = 0;
+}
+
+int conn_compact(conn_t *conn)
+{
+	char *buf;
+
+	if(conn->rbufptr != conn->rbuf) {
+		memmove(conn->rbuf, conn->rbufptr, conn->rcnt);
+		conn->rbufptr = conn->rbuf;
+	}
+	// a frame that needed a bigger buffer is gone, give the memory back
+	if(conn->rcnt == 0 && conn->rcap > CONN_BUFSIZE &&
+		(buf = realloc(conn->rbuf, CONN_BUFSIZE)) != NULL) {
+		conn->rbuf = conn->rbufptr = buf;
+		conn->rcap = CONN_BUFSIZE;
+	}
+	return conn->rcap - conn->rcnt;
+}
+
+// Makes room for a frame of n bytes in rbuf
+static int conn_reserve_input(conn_t *conn, int n)
+{
+	int cap = conn->rcap;
+	char *buf;
+
+	conn_compact(conn);
+	while(cap < n)
+		cap *= 2;
+	if(cap == conn->rcap)
+		return 0;
+	if((buf = realloc(conn->rbuf, cap)) == NULL)
+		return -1;
+	conn->rbuf = conn->rbufptr = buf;
+	conn->rcap = cap;
+	return 0;
+}
+
+int conn_recv(conn_t *conn)
+{
+	int nbytes;
+
+	if(conn_compact(conn) == 0)
+		return -1;
+
+	if((nbytes = Read(conn->fd, conn->rbuf + conn->rcnt,
+		conn->rcap - conn->rcnt)) < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? -2 : -1;
+	conn->rcnt += nbytes;
+	return nbytes;
+}
+
+int conn_frame(conn_t *conn, int n)
+{
+	int nbytes;
+
+	if(n > conn->rcap && conn_reserve_input(conn, n) < 0)
+		return -1;
+
+	while(conn->rcnt < n && conn->mode == CONN_BLOCKING) {
+		// the client may be waiting on our responses before sending more
+		if(conn_flush(conn) < 0)
+			return -1;
+		if((nbytes = conn_recv(conn)) < 0)
+			return -1;
+		if(nbytes == 0) // EOF
+			break;
+	}
+	return conn->rcnt < n ? conn->rcnt : n;
+}
+
+void conn_consume(conn_t *conn, int n)
+{
+	conn->rbufptr += n;
+	conn->rcnt -= n;
+}
+
+// Writes all n bytes to a blocking fd, retrying on short writes
+static int writen(int fd, char *buf, int n)
+{
+	int nbytes;
+
+	while(n > 0) {
+		if((nbytes = Write(fd, buf, n)) <= 0)
+			return -1;
+		buf += nbytes;
+		n -= nbytes;
+	}
+	return 0;
+}
+
+// Makes room for n more bytes of output on an event loop's connection
+static int conn_reserve_output(conn_t *conn, int n)
+{
+	int cap = conn->wcap;
+	char *buf;
+
+	while(cap - conn->wcnt < n)
+		cap *= 2;
+	if(cap == conn->wcap)
+		return 0;
+	if((buf = realloc(conn->wbuf, cap)) == NULL)
+		return -1;
+	conn->wbuf = buf;
+	conn->wcap = cap;
+	return 0;
+}
+
+int conn_stage(conn_t *conn, void *buf, int n)
+{
+	if(conn_reserve_output(conn, n) < 0)
+		return -1;
+	memcpy(conn->wbuf + conn->wcnt, buf, n);
+	conn->wcnt += n;
+	return n;
+}
+
+int conn_write(conn_t *conn, void *buf, int n)
+{
+	if(conn->mode != CONN_BLOCKING)
+		return conn_stage(conn, buf, n);
+
+	if(conn->wcnt + n > conn->wcap) {
+		if(conn_flush(conn) < 0)
+			return -1;
+		// too big to be worth staging, send it as is
+		if(n > conn->wcap)
+			return writen(conn->fd, buf, n) < 0 ? -1 : n;
+	}
+	memcpy(conn->wbuf + conn->wcnt, buf, n);
+	conn->wcnt += n;
+	return n;
+}
+
+// Queues a value to go out after what wbuf holds now
+static int conn_queue_value(conn_t *conn, conn_value_t value)
+{
+	conn_value_t *vals;
+	int cap;
+
+	if(conn->nvals == conn->vcap) {
+		cap = conn->vcap ? conn->vcap * 2 : CONN_IOV_MAX;
+		if((vals = realloc(conn->vals, sizeof(conn_value_t) * cap)) == NULL)
+			return -1;
+		conn->vals = vals;
+		conn->vcap = cap;
+	}
+	value.at = conn->wcnt;
+	conn->vals[conn->nvals++] = value;
+	return 0;
+}
+
+// Sends as much of the output as the socket takes. Returns 0 once all of
+// it is out, 1 if the socket is full, -1 on error
+static int conn_send(conn_t *conn, int flags)
+{
+	struct iovec iov[CONN_IOV_MAX];
+	struct msghdr msg;
+	ssize_t nbytes;
+
+	while(conn_pending(conn)) {
+		bzero(&msg, sizeof(struct msghdr));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = conn_iov(conn, iov, CONN_IOV_MAX);
+		if((nbytes = sendmsg(conn->fd, &msg, flags | MSG_NOSIGNAL)) < 0) {
+			if(errno == EINTR)
+				continue;
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+		}
+		conn_drain(conn, nbytes);
+	}
+	return 0;
+}
+
+int conn_write_value(conn_t *conn, void *hdr, int hdr_len, void *val,
+	int val_len, conn_release_f release, void *ctx, void *arg)
+{
+	conn_value_t value = {0, val, val_len, release, ctx, arg};
+
+	if(val_len < CONN_DIRECT_MIN) {
+		if(conn_stage(conn, hdr, hdr_len) < 0 ||
+			conn_stage(conn, val, val_len) < 0) {
+			release(ctx, arg);
+			return -1;
+		}
+		release(ctx, arg);
+		return 0;
+	}
+
+	if(conn_stage(conn, hdr, hdr_len) < 0 || conn_queue_value(conn, value) < 0) {
+		release(ctx, arg);
+		return -1;
+	}
+	// even a blocking socket is only written to as far as it has room, so
+	// that the value is never waited on
+	if(conn->mode != CONN_ASYNC && conn_send(conn, MSG_DONTWAIT) < 0)
+		return -1;
+	return 0;
+}
+
+bool conn_pending(conn_t *conn)
+{
+	return conn->wcnt > 0 || conn->nvals > 0;
+}
+
+int conn_iov(conn_t *conn, struct iovec *iov, int max)
+{
+	int cnt = 0, off = 0, end;
+
+	for(int i = 0; i <= conn->nvals && cnt < max; i++) {
+		// the part of wbuf that goes out before value i
+		end = i < conn->nvals ? conn->vals[i].at : conn->wcnt;
+		if(end > off) {
+			iov[cnt].iov_base = conn->wbuf + off;
+			iov[cnt++].iov_len = end - off;
+			off = end;
+		}
+		if(i < conn->nvals && cnt < max) {
+			iov[cnt].iov_base = conn->vals[i].base;
+			iov[cnt++].iov_len = conn->vals[i].len;
+		}
+	}
+	return cnt;
+}
+
+void conn_drain(conn_t *conn, int n)
+{
+	conn_value_t *value;
+	int sent = 0, take, i;
+
+	// walk the output in order, releasing the values that are all out
+	for(i = 0; i < conn->nvals; i++) {
+		value = conn->vals+i;
+		take = n < value->at - sent ? n : value->at - sent;
+		sent += take;
+		n -= take;
+		if(sent < value->at)
+			break;
+		take = n < value->len ? n : value->len;
+		value->base += take;
+		value->len -= take;
+		n -= take;
+		if(value->len > 0)
+			break;
+		value->release(value->ctx, value->arg);
+	}
+	if(i == conn->nvals)
+		sent += n;
+
+	memmove(conn->wbuf, conn->wbuf + sent, conn->wcnt - sent);
+	conn->wcnt -= sent;
+	if(i > 0) {
+		memmove(conn->vals, conn->vals + i,
+			sizeof(conn_value_t) * (conn->nvals - i));
+		conn->nvals -= i;
+	}
+	for(i = 0; i < conn->nvals; i++)
+		conn->vals[i].at -= sent;
+}
+
+int conn_flush(conn_t *conn)
+{
+	// a blocking socket takes everything, a polled one as much as it has
+	// room for
+	return conn_send(conn, conn->mode == CONN_BLOCKING ? 0 : MSG_DONTWAIT);
+}
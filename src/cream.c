@@ -1,111 +1,253 @@
 #include "helpers.h"
 #include "signal.h"
+#include "reactor.h"
+#include "uring.h"
+#include "getopt.h"
+#include "hash.h"
 
 hashmap_t *g_map;
-queue_t *g_queue;
+
+// A listening socket together with the queue its accepted connections are
+// handed to. Without -r there is a single group
+typedef struct worker_group_t {
+	int listen_fd;
+	queue_t *queue;
+	pthread_t acceptor;
+} worker_group_t;
 
 
 
 void *worker_thread(void *arg)
 {
-	request_header_t req_header;
-	int *conn_fdp, nbytes;
+	queue_t *queue = arg;
+	conn_t *conn;
+	int *conn_fdp;
+
+	if((conn = malloc(sizeof(conn_t))) == NULL)
+		return NULL;
 	while(1) {
-		conn_fdp = dequeue(g_queue);
-		bzero(&req_header, sizeof(request_header_t));
-
-		// read request
-		if((nbytes = Read(*conn_fdp, &req_header, 
-			sizeof(request_header_t))) < sizeof(request_header_t)) {
-			if(nbytes >= 0) { 	
-				invalid_request(*conn_fdp, 0, 0, NULL);
-			}
-			else if(nbytes == -1) {
-				bad_req_response(*conn_fdp);
-			}
-		}
-		else {
-			(get_response_function(req_header))(*conn_fdp, 
-				req_header.key_size, req_header.value_size, g_map);
+		conn_fdp = dequeue(queue);
+		if(conn_init(conn, *conn_fdp, CONN_BLOCKING) < 0) {
+			close(*conn_fdp);
+			free(conn_fdp);
+			continue;
 		}
+
+		// keep serving the connection until the client hangs up or sends
+		// something we cannot frame
+		while(serve_request(conn, g_map) == 0)
+			;
+		conn_flush(conn);
+		conn_destroy(conn);
 		close(*conn_fdp);
 		free(conn_fdp);
 	}
 }
 
+// Prints the allocator's stats, and how often the map had to be reseeded,
+// every time SIGUSR1 comes in. The signal is blocked everywhere, so it is
+// only ever taken here
+void *stats_thread(void *arg)
+{
+	sigset_t *sigs = arg;
+	int sig;
+
+	while(1) {
+		if(sigwait(sigs, &sig) == 0) {
+			slab_print_stats(g_slab, stderr);
+			fprintf(stderr, "map: %u long probes, %u reseeds\n",
+				__atomic_load_n(&(g_map->long_probes), __ATOMIC_RELAXED),
+				__atomic_load_n(&(g_map->reseeds), __ATOMIC_RELAXED));
+		}
+	}
+}
+
+void *accept_thread(void *arg)
+{
+	worker_group_t *group = arg;
+	socklen_t client_len;
+	struct sockaddr_storage client_addr;
+	int *conn_fdp;
+
+	while(1) {
+		client_len = sizeof(struct sockaddr_storage);
+		if((conn_fdp = malloc(sizeof(int))) == NULL)
+			continue;
+		if((*conn_fdp = accept(group->listen_fd,
+			(struct sockaddr *)&client_addr, &client_len)) >= 0)
+			enqueue(group->queue, conn_fdp);
+		else
+			free(conn_fdp);
+	}
+}
+
 
 int main(int argc, char *argv[]) {
 
-	int num_workers, port_number, max_entries;
+	int num_workers, port_number, opt;
+	size_t max_entries;
+	bool event_mode = false, uring_mode = false, reuseport_mode = false;
+	bool lockfree_mode = false, cuckoo_mode = false;
+	size_t max_memory = 0;
+	const hash_entry_t *hash = hash_by_name("jenkins");
+	static struct option long_opts[] = {
+		{"max-memory", required_argument, NULL, 'm'},
+		{"hash", required_argument, NULL, 'H'},
+		{"cuckoo", no_argument, NULL, 'c'},
+		{NULL, 0, NULL, 0}
+	};
 	if(argc <= 1)
 		goto cream_invalid_cl;
 
-	if(!strcmp(argv[1], "-h")) {
-		printf(USAGE);
-		exit(0);
+	opterr = 0;
+	while((opt = getopt_long(argc, argv, "+heurlcm:H:", long_opts, NULL)) != -1) {
+		switch(opt) {
+			case 'h':
+				printf(USAGE);
+				exit(0);
+			case 'e':
+				event_mode = true;
+				break;
+			case 'u':
+				uring_mode = true;
+				break;
+			case 'r':
+				reuseport_mode = true;
+				break;
+			case 'l':
+				lockfree_mode = true;
+				break;
+			case 'c':
+				cuckoo_mode = true;
+				break;
+			case 'm':
+				if((max_memory = parse_command_to_size(optarg)) == 0)
+					goto cream_invalid_cl;
+				break;
+			case 'H':
+				if((hash = hash_by_name(optarg)) == NULL)
+					goto cream_invalid_cl;
+				break;
+			default:
+				goto cream_invalid_cl;
+		}
 	}
-	if(argc != 4)
+	if(argc - optind != 3)
 		goto cream_invalid_cl;
-	if((num_workers = parse_command_to_int(argv[1])) <= 0)
+	if((num_workers = parse_command_to_int(argv[optind])) <= 0)
 		goto cream_invalid_cl;
-	if((port_number = parse_command_to_int(argv[2])) <= 0)
+	if((port_number = parse_command_to_int(argv[optind+1])) <= 0)
 		goto cream_invalid_cl;
-	if((max_entries = parse_command_to_int(argv[3])) <= 0)
+	if((max_entries = parse_command_to_size(argv[optind+2])) == 0)
 		goto cream_invalid_cl;
 
-	if((g_map = create_map(max_entries, jenkins_one_at_a_time_hash, 
-		map_destroyer)) == NULL)
-		exit(3);
-	if((g_queue = create_queue()) == NULL)
-		goto cream_cleanup_err_3;
+	// block sigpipe before any thread is started so they all inherit it
+	sigset_t sig_pipe;
+	sigemptyset(&sig_pipe);
+	sigaddset(&sig_pipe, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sig_pipe, NULL);
 
-	pthread_t *threads;
-	if((threads = malloc(sizeof(pthread_t) * num_workers)) == NULL) {
-		goto cream_cleanup_err_2;
+	// and sigusr1, which stats_thread waits for
+	static sigset_t sig_stats;
+	sigemptyset(&sig_stats);
+	sigaddset(&sig_stats, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sig_stats, NULL);
+
+	if(uring_mode && !uring_supported()) {
+		fprintf(stderr, "io_uring is not supported, falling back to %s\n",
+			event_mode ? "epoll" : "worker threads");
+		uring_mode = false;
 	}
 
-	for(int i = 0; i < num_workers; i++) {
-		if(pthread_create(&threads[i], NULL, worker_thread, NULL) < 0 )
+	// with -r every event loop, or every core's share of the workers, gets
+	// its own SO_REUSEPORT listener and the kernel spreads connections
+	// across them
+	int num_groups = 1;
+	if(reuseport_mode) {
+		num_groups = num_workers;
+		if(!event_mode && !uring_mode &&
+			sysconf(_SC_NPROCESSORS_ONLN) < num_groups)
+			num_groups = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	if((g_slab = slab_create()) == NULL)
+		exit(3);
+	pthread_t stats;
+	if(pthread_create(&stats, NULL, stats_thread, &sig_stats))
+		exit(3);
+
+	// keys come from clients, so they are hashed with a seed they cannot
+	// know, see hashmap_t
+	map_config_t map_config = {max_entries, 0, hash->function,
+		map_destroyer, lockfree_mode, max_memory, hash->keyed_function,
+		cuckoo_mode, 0, map_refs};
+	if((g_map = create_map_config(&map_config)) == NULL)
+		exit(3);
+
+	worker_group_t *groups;
+	int *listen_fds;
+	if((groups = calloc(num_groups, sizeof(worker_group_t))) == NULL)
+		goto cream_cleanup_err_3;
+	if((listen_fds = malloc(sizeof(int) * num_groups)) == NULL)
+		goto cream_cleanup_err_2;
+	for(int i = 0; i < num_groups; i++) {
+		if((listen_fds[i] = groups[i].listen_fd =
+			open_listenfd(port_number, reuseport_mode)) < 0)
 			goto cream_cleanup_err_1;
 	}
 
-	// block sigpipe
-	sigset_t sig_pipe;
-	sigemptyset(&sig_pipe);
-	sigaddset(&sig_pipe, SIGPIPE);
-	sigprocmask(SIG_BLOCK, &sig_pipe, NULL);
+	// the event loops only return if they could not be started
+	if(uring_mode) {
+		run_uring(listen_fds, num_groups, num_workers, g_map);
+		goto cream_cleanup_err_1;
+	}
+	if(event_mode) {
+		run_reactors(listen_fds, num_groups, num_workers, g_map);
+		goto cream_cleanup_err_1;
+	}
 
-	int listen_fd, *conn_fdp;
-	socklen_t client_len;
-	struct sockaddr_storage client_addr;
+	for(int i = 0; i < num_groups; i++) {
+		if((groups[i].queue = create_queue()) == NULL)
+			goto cream_cleanup_err_1;
+	}
 
-	if((listen_fd = open_listenfd(port_number)) < 0)
+	pthread_t *threads;
+	if((threads = malloc(sizeof(pthread_t) * num_workers)) == NULL) {
 		goto cream_cleanup_err_1;
+	}
 
-	while(1) {
-		client_len = sizeof(struct sockaddr_storage);
-		conn_fdp = malloc(sizeof(int));
-		if((*conn_fdp = accept(listen_fd, (struct sockaddr *)&client_addr, 
-			&client_len)) >= 0) {
-			enqueue(g_queue, conn_fdp);
-		}
+	for(int i = 0; i < num_workers; i++) {
+		if(pthread_create(&threads[i], NULL, worker_thread,
+			groups[i % num_groups].queue))
+			goto cream_cleanup_err_0;
 	}
 
+	// the main thread accepts for the first group
+	for(int i = 1; i < num_groups; i++) {
+		if(pthread_create(&groups[i].acceptor, NULL, accept_thread,
+			&groups[i]))
+			goto cream_cleanup_err_0;
+	}
+	accept_thread(&groups[0]);
+
 
 	//cream_cleanup:
 	free(threads);
+	free(listen_fds);
+	free(groups);
 	free(g_map);
-	free(g_queue);
     exit(0);
 
     cream_invalid_cl:
     fprintf(stderr, USAGE);
     exit(1);
 
-    cream_cleanup_err_1:
+    cream_cleanup_err_0:
     free(threads);
+    cream_cleanup_err_1:
+    free(listen_fds);
     cream_cleanup_err_2:
-    free(g_queue);
+    free(groups);
     cream_cleanup_err_3:
     free(g_map);
     exit(2);
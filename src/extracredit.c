@@ -1,4 +1,5 @@
 #include "utils.h"
+#include "hash.h"
 #include "errno.h"
 #include "strings.h"
 #include "string.h"
@@ -19,8 +20,8 @@ bool is_expired(map_node_t *node)
 
 void add_to_ll(hashmap_t *self, map_node_t *node)
 {
-    if(self->front == NULL)
-        self->front = node;
+	if(self->front == NULL)
+		self->front = node;
 	map_node_t *rear = self->rear;
 	node->prev = rear;
 	node->next = NULL;
@@ -58,16 +59,25 @@ bool key_equals(map_key_t one, map_key_t two)
 	if(one.key_len != two.key_len)
 		return false;
 
-	if(strncmp(one.key_base, two.key_base, one.key_len))
+	// keys are bytes, not strings
+	if(memcmp(one.key_base, two.key_base, one.key_len))
 		return false;
 	return true;
 }
 
-hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f destroy_function) {
+hashmap_t *create_map(uint64_t capacity, hash_func_f hash_function, destructor_f destroy_function) {
+
+	map_config_t config = {capacity, 0, hash_function, destroy_function};
+	return create_map_config(&config);
+}
+
+hashmap_t *create_map_config(map_config_t *config) {
 	hashmap_t *hmap;
 
     // check args
-    if(capacity == 0 || hash_function == NULL || destroy_function == NULL) {
+    if(config == NULL || config->capacity == 0 ||
+    	(config->hash_function == NULL && config->keyed_hash_function == NULL) ||
+    	config->destroy_function == NULL) {
     	errno = EINVAL;
     	return NULL;
     }
@@ -76,10 +86,17 @@ hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f
     if((hmap = calloc(1, sizeof(hashmap_t))) == NULL)
     	return NULL;
 
-    hmap->capacity = capacity;
+    hmap->capacity = config->capacity;
     hmap->size = 0;
-    hmap->hash_function = hash_function;
-    hmap->destroy_function = destroy_function;
+    // probes wrap around by masking, see hashmap_t
+    for(hmap->slots = 1; hmap->slots < hmap->capacity; hmap->slots *= 2)
+    	;
+    hmap->hash_function = config->hash_function;
+    hmap->keyed_hash_function = config->keyed_hash_function;
+    hmap->seed = random_seed();
+    hmap->destroy_function = config->destroy_function;
+    hmap->refs_function = config->refs_function;
+    hmap->max_memory = config->max_memory;
     hmap->num_readers = 0;
     hmap->invalid = false;
 
@@ -89,7 +106,7 @@ hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f
     if(pthread_mutex_init(&(hmap->fields_lock), NULL))
     	goto hmap_after_alloc_error;
 
-    if((hmap->nodes = calloc(capacity, sizeof(map_node_t))) == NULL)
+    if((hmap->nodes = calloc(hmap->slots, sizeof(map_node_t))) == NULL)
     	goto hmap_after_alloc_error;
 
     return hmap;
@@ -98,227 +115,749 @@ hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f
     return NULL;
 }
 
-bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
+int map_read_begin(hashmap_t *self) {
+	return 0;
+}
 
-    // check args
-    if(self == NULL || key.key_base == NULL || key.key_len == 0 ||
-    	val.val_base == NULL || val.val_len == 0 || self->invalid) {
-    	errno = EINVAL;
-    	return false;
-    }
+void map_read_end(hashmap_t *self, int token) {
+}
 
-    // lock the map for writing
-    if(pthread_mutex_lock(&(self->write_lock)))
-    	return false;
+// Lets go of an entry that left the map. A pinned one is left to its last
+// unpin, see hashmap_t
+static void drop_entry(hashmap_t *self, map_key_t key, map_val_t val)
+{
+	if(self->refs_function != NULL &&
+		__atomic_fetch_sub(self->refs_function(key, val), 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	self->destroy_function(key, val);
+}
 
-    if(self->invalid) { // check that map hasnt been invalidated since last check
-    	pthread_mutex_unlock(&(self->write_lock));
-    	errno = EINVAL;
-    	return false;
-    }
+// An entry a write let go of, see retire()
+typedef struct retired_entry_t {
+	map_key_t key;
+	map_val_t val;
+} retired_entry_t;
+
+// The calling thread's retire list. It only ever holds entries of the map
+// the thread is writing to, and is emptied before the write returns. The
+// array is kept for the thread's next write
+static __thread retired_entry_t *retired;
+static __thread uint32_t num_retired;
+static __thread uint32_t retired_cap;
+
+// Queues an entry that left the map to be destroyed once the write lock is
+// released, so the allocator is not called under it. If the list cannot
+// grow the entry is let go of right away instead
+static void retire(hashmap_t *self, map_key_t key, map_val_t val)
+{
+	retired_entry_t *entries;
+	uint32_t cap;
+
+	if(num_retired == retired_cap) {
+		cap = retired_cap ? retired_cap * 2 : MAP_RETIRE_BATCH;
+		if((entries = realloc(retired, sizeof(retired_entry_t) * cap)) == NULL) {
+			drop_entry(self, key, val);
+			return;
+		}
+		retired = entries;
+		retired_cap = cap;
+	}
+	retired[num_retired].key = key;
+	retired[num_retired++].val = val;
+}
 
-    int index = get_index(self, key);
+// Lets go of everything the calling thread retired, with the lock released
+static void reclaim(hashmap_t *self)
+{
+	for(uint32_t i = 0; i < num_retired; i++)
+		drop_entry(self, retired[i].key, retired[i].val);
+	num_retired = 0;
+}
 
-    map_node_t *node;
-    for(int i = 0; i < self->capacity; i++) {
-    	node = self->nodes+((index+i) % self->capacity);
-    	if(node->tombstone || node->key.key_base == NULL) {
-    		self->size++;
-    		break;
-    	}
-        else if(key_equals(node->key, key) || is_expired(node)) {
-            self->destroy_function(node->key, node->val);
-            remove_from_ll(self, node);
-            break;
-        }
-    	else if(i == self->capacity - 1) {
-    		if(force) {
-    			node = self->front;
-    			self->destroy_function(node->key, node->val);
-                remove_from_ll(self, node);
-    		}
-    		else {
-    			pthread_mutex_unlock(&(self->write_lock));
-	    		errno = ENOMEM;
-	    		return false;
-    		}
-    	}
-    }
+void map_retire(hashmap_t *self, map_key_t key, map_val_t val) {
 
-    node->key = key;
-	node->val = val;
-	node->tombstone = false;
-	time(&(node->last_time));
-	add_to_ll(self, node);
-	pthread_mutex_unlock(&(self->write_lock));
-	return true;
+	if(self != NULL && key.key_base != NULL)
+		drop_entry(self, key, val);
 }
 
-map_val_t get(hashmap_t *self, map_key_t key) {
+size_t map_memory(hashmap_t *self) {
 
-	// check args
-	if(self == NULL || self->invalid ||
-		key.key_base == NULL || key.key_len == 0) {
-		errno = EINVAL;
-		return MAP_VAL(NULL, 0);
-	}
+	if(self == NULL || self->invalid)
+		return 0;
+	return self->memory;
+}
+
+#ifdef MAP_LOCK_STATS
+void map_lock_stats(hashmap_t *self, uint64_t *holds, uint64_t *hold_ns) {
+
+	*holds = self->write_holds;
+	*hold_ns = self->write_hold_ns;
+}
+#endif
+
+uint64_t map_size(hashmap_t *self) {
+
+	if(self == NULL || self->invalid)
+		return 0;
+	return self->size;
+}
+
+#ifdef MAP_LOCK_STATS
+static uint64_t lock_clock(void)
+{
+	struct timespec ts;
 
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+#endif
+
+static void unlock_write(hashmap_t *self)
+{
+#ifdef MAP_LOCK_STATS
+	self->write_hold_ns += lock_clock() - self->locked_at;
+	self->write_holds++;
+#endif
+	pthread_mutex_unlock(&(self->write_lock));
+}
+
+// Readers share the write lock: the first one in takes it for all of them
+// and the last one out releases it
+static bool lock_read(hashmap_t *self)
+{
 	// aquire feilds lock
 	if(pthread_mutex_lock(&(self->fields_lock)))
-		return MAP_VAL(NULL, 0);
+		return false;
 
 	if(self->num_readers == 0) {
 		// aquire write lock
 		if(pthread_mutex_lock(&(self->write_lock))){
 			pthread_mutex_unlock(&(self->fields_lock));
-			return MAP_VAL(NULL, 0);
+			return false;
 		}
 		// recheck validity
 		if(self->invalid) {
 			pthread_mutex_unlock(&(self->write_lock));
 			pthread_mutex_unlock(&(self->fields_lock));
-			return MAP_VAL(NULL, 0);
+			return false;
 		}
 	}
 	self->num_readers++;
 	pthread_mutex_unlock(&(self->fields_lock));
+	return true;
+}
 
-	int index = get_index(self, key);
-	map_val_t ret = MAP_VAL(NULL, 0);
+static void unlock_read(hashmap_t *self)
+{
+	// reaquire fields lock
+	pthread_mutex_lock(&(self->fields_lock));
+	self->num_readers--;
+
+	// release write lock if no other readers are running
+	if(self->num_readers == 0)
+		pthread_mutex_unlock(&(self->write_lock));
+
+	// release fields lock
+	pthread_mutex_unlock(&(self->fields_lock));
+}
+
+static bool lock_write(hashmap_t *self)
+{
+	// lock the map for writing
+	if(pthread_mutex_lock(&(self->write_lock)))
+		return false;
+#ifdef MAP_LOCK_STATS
+	self->locked_at = lock_clock();
+#endif
+
+	if(self->invalid) { // check that map hasnt been invalidated since last check
+		unlock_write(self);
+		errno = EINVAL;
+		return false;
+	}
+	return true;
+}
+
+static bool valid_key(map_key_t key)
+{
+	return key.key_base != NULL && key.key_len != 0;
+}
+
+// The following helpers expect the caller to hold the appropriate lock
+
+static size_t entry_memory(map_key_t key, map_val_t val)
+{
+	return key.key_len + val.val_len + MAP_ENTRY_OVERHEAD;
+}
+
+static uint32_t hash_key(hashmap_t *self, map_key_t key, uint64_t seed)
+{
+	if(self->keyed_hash_function != NULL)
+		return self->keyed_hash_function(key, seed);
+	return self->hash_function(key);
+}
+
+// The slot i slots past slot pos, wrapping around the end of the nodes
+static uint64_t slot_after(hashmap_t *self, uint64_t pos, uint64_t i)
+{
+	return (pos + i) & (self->slots - 1);
+}
+
+// The hash of a key hashed by map_hash(), or hashed again if the map was
+// reseeded since
+static uint32_t locked_hash(hashmap_t *self, map_key_t key, map_hash_t hash)
+{
+	if(hash.seed == self->seed)
+		return hash.hash;
+	return hash_key(self, key, self->seed);
+}
+
+// Whether the entry in a node went in before the map was last cleared
+static bool is_stale(hashmap_t *self, map_node_t *node)
+{
+	return node->generation != self->generation;
+}
+
+// Retires the entry of an earlier generation in a node, leaving a
+// tombstone. It was taken off the LRU list and out of size and memory
+// when the map was cleared
+static void sweep_node(hashmap_t *self, map_node_t *node)
+{
+	retire(self, node->key, node->val);
+	bzero(node, sizeof(map_node_t));
+	node->tombstone = true;
+	self->stale--;
+}
+
+// Sweeps the next n slots, or fewer once no stale entry is left
+static void sweep_locked(hashmap_t *self, uint64_t n)
+{
+	map_node_t *node;
+
+	for(; n > 0 && self->stale > 0; n--) {
+		node = self->nodes+self->swept;
+		self->swept = slot_after(self, self->swept, 1);
+		if(node->key.key_base != NULL && is_stale(self, node))
+			sweep_node(self, node);
+	}
+}
+
+// Sets *probed to the number of slots looked at. The stale entries it
+// passes are swept, so the slot put_locked() takes never holds one
+static map_node_t *find_locked(hashmap_t *self, uint32_t hash, map_key_t key,
+	uint64_t *probed)
+{
+	uint64_t index = slot_after(self, hash, 0);
 	map_node_t *node;
 
-	for(int i = 0; i < self->capacity; i++) {
-		node = self->nodes+((index+i) % self->capacity);
+	for(*probed = 0; *probed < self->slots; (*probed)++) {
+		node = self->nodes+slot_after(self, index, *probed);
 		if (node->key.key_len == 0) {
 			if(node->tombstone)
 				continue;
 			else
 				break;
 		}
-		else if(key_equals(node->key, key)) {
-			if(!is_expired(node)) {
-				ret = MAP_VAL(node->val.val_base, node->val.val_len);
-                pthread_mutex_lock(&(self->fields_lock));
-                send_to_rear(self, node);
-                pthread_mutex_unlock(&(self->fields_lock));
-                time(&(node->last_time));
-			}
-			break;
-		}
+		else if(is_stale(self, node))
+			sweep_node(self, node);
+		else if(node->hash == hash && key_equals(node->key, key))
+			return node;
 	}
+	return NULL;
+}
 
-	// reaquire fields lock
-	pthread_mutex_lock(&(self->fields_lock));
-	self->num_readers--;
+// Moves every entry to where a new seed puts it, leaving the tombstones
+// and stale entries behind. The map is left as it was if the new nodes
+// cannot be allocated
+static bool rehash(hashmap_t *self, uint64_t seed)
+{
+	map_node_t *nodes, *node, *next;
+	uint64_t index;
+	uint32_t hash;
 
-	// release write lock if no other readers are running
-	if(self->num_readers == 0)
-		pthread_mutex_unlock(&(self->write_lock));
+	if((nodes = calloc(self->slots, sizeof(map_node_t))) == NULL)
+		return false;
 
-	// release fields lock
-	pthread_mutex_unlock(&(self->fields_lock));
+	// every entry is on the LRU list, and walking it from the front keeps
+	// the order they were used in
+	node = self->front;
+	self->front = self->rear = NULL;
+	for(; node != NULL; node = next) {
+		next = node->next;
+		hash = hash_key(self, node->key, seed);
+		for(index = slot_after(self, hash, 0); nodes[index].key.key_base != NULL;
+			index = slot_after(self, index, 1))
+			;
+		nodes[index] = *node;
+		nodes[index].hash = hash;
+		add_to_ll(self, nodes+index);
+	}
+	sweep_locked(self, self->slots);
+	self->swept = 0;
 
-    return ret;
+	free(self->nodes);
+	self->nodes = nodes;
+	// map_hash() reads the seed without the lock
+	__atomic_store_n(&(self->seed), seed, __ATOMIC_RELAXED);
+	self->inserts = 0;
+	return true;
 }
 
-map_node_t delete(hashmap_t *self, map_key_t key) {
+static bool reseed_locked(hashmap_t *self)
+{
+	if(!rehash(self, random_seed()))
+		return false;
+	self->reseeds++;
+	return true;
+}
 
-	if(self == NULL || key.key_base == NULL ||
-		key.key_len == 0 || self->invalid) {
-		errno = EINVAL;
-		return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+// Destroys the least recently used entry and returns the node it was in
+static map_node_t *evict_lru(hashmap_t *self)
+{
+	map_node_t *node = self->front;
+
+	retire(self, node->key, node->val);
+	self->memory -= entry_memory(node->key, node->val);
+	remove_from_ll(self, node);
+	bzero(node, sizeof(map_node_t));
+	node->tombstone = true;
+	self->size--;
+	return node;
+}
+
+static bool put_locked(hashmap_t *self, map_key_t key, map_val_t val,
+	uint32_t hash, bool force)
+{
+    uint64_t probed, index = slot_after(self, hash, 0);
+    size_t cost = entry_memory(key, val), freed = 0;
+
+    map_node_t *node, *found;
+    if((found = find_locked(self, hash, key, &probed)) != NULL)
+    	freed = entry_memory(found->key, found->val);
+    if(self->max_memory != 0) {
+    	if(cost > self->max_memory) {
+    		errno = ENOMEM;
+    		return false;
+    	}
+    	// make room by evicting the least recently used entries, which may
+    	// include the one being replaced
+    	while(self->memory - freed + cost > self->max_memory) {
+    		if(!force) {
+    			errno = ENOMEM;
+    			return false;
+    		}
+    		if(evict_lru(self) == found) {
+    			found = NULL;
+    			freed = 0;
+    		}
+    	}
+    }
+
+    if(found != NULL) {
+    	node = found;
+    	retire(self, node->key, node->val);
+    	self->memory -= freed;
+    	remove_from_ll(self, node);
+    }
+    else for(uint64_t i = 0; i < self->slots; i++) {
+    	node = self->nodes+slot_after(self, index, i);
+    	if(node->tombstone || node->key.key_base == NULL) {
+    		// there are more slots than the map may hold entries
+    		if(self->size < self->capacity) {
+    			self->size++;
+    			break;
+    		}
+    	}
+        else if(is_expired(node)) {
+            retire(self, node->key, node->val);
+            self->memory -= entry_memory(node->key, node->val);
+            remove_from_ll(self, node);
+            break;
+        }
+    	if(i == self->slots - 1 || node->key.key_base == NULL) {
+    		if(!force) {
+	    		errno = ENOMEM;
+	    		return false;
+    		}
+    		// the entry takes the free node it found, or if every node
+    		// is taken, the one the least recently used entry leaves
+    		if(node->key.key_base == NULL)
+    			evict_lru(self);
+    		else
+    			node = evict_lru(self);
+    		self->size++;
+    		break;
+    	}
+    }
+
+    node->key = key;
+	node->val = val;
+	node->hash = hash;
+	node->tombstone = false;
+	node->generation = self->generation;
+	time(&(node->last_time));
+	add_to_ll(self, node);
+	self->memory += cost;
+	if(found != NULL)
+		return true;
+
+	self->inserts++;
+	if(probed > MAP_PROBE_LIMIT && self->size * 100 <
+		self->slots * MAP_PROBE_LOAD_PERCENT) {
+		self->long_probes++;
+		if(self->keyed_hash_function != NULL && self->inserts >= self->size)
+			reseed_locked(self);
 	}
+	return true;
+}
 
-	if(pthread_mutex_lock(&(self->write_lock)))
-		return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+// Looks up a key for a reader and marks it as the most recently used.
+// Returns its node, or NULL if the key is not there or has expired
+static map_node_t *get_locked(hashmap_t *self, map_key_t key, uint32_t hash)
+{
+	uint64_t index = slot_after(self, hash, 0);
+	map_node_t *ret = NULL, *node;
+
+	for(uint64_t i = 0; i < self->slots; i++) {
+		node = self->nodes+slot_after(self, index, i);
+		if (node->key.key_len == 0) {
+			if(node->tombstone)
+				continue;
+			else
+				break;
+		}
+		else if(is_stale(self, node))
+			continue;
+		else if(node->hash == hash && key_equals(node->key, key)) {
+			if(!is_expired(node)) {
+				ret = node;
+                pthread_mutex_lock(&(self->fields_lock));
+                send_to_rear(self, node);
+                pthread_mutex_unlock(&(self->fields_lock));
+                time(&(node->last_time));
+			}
+			break;
+		}
+	}
+	return ret;
+}
 
-	int index = get_index(self, key);
+static map_node_t delete_locked(hashmap_t *self, map_key_t key, uint32_t hash)
+{
+	uint64_t index = slot_after(self, hash, 0);
 	map_node_t *node, *to_remove;
 	to_remove = NULL;
 
-	for(int i = 0; i < self->capacity; i++) {
-		node = self->nodes+((index+i) % self->capacity);
+	for(uint64_t i = 0; i < self->slots; i++) {
+		node = self->nodes+slot_after(self, index, i);
 		if (node->key.key_len == 0) {
 			if(node->tombstone)
 				continue;
 			else
 				break;
 		}
-		else if(key_equals(node->key, key)) {
+		else if(is_stale(self, node))
+			sweep_node(self, node);
+		else if(node->hash == hash && key_equals(node->key, key)) {
 			to_remove = node;
 			break;
 		}
 	}
 
-	map_node_t ret;
+	map_node_t ret = MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
 
-	if(to_remove == NULL) {
-		ret = MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
-	}
-	else {
+	if(to_remove != NULL) {
 		if(!is_expired(node))
 			ret = *node;
+		self->memory -= entry_memory(node->key, node->val);
 		remove_from_ll(self, node);
 		bzero(node, sizeof(map_node_t));
 		node->tombstone = true;
 		self->size--;
 	}
+	return ret;
+}
 
-	pthread_mutex_unlock(&(self->write_lock));
+map_hash_t map_hash(hashmap_t *self, map_key_t key) {
+
+	map_hash_t ret = {0, 0};
+
+	if(self == NULL || self->invalid || !valid_key(key))
+		return ret;
+	ret.seed = __atomic_load_n(&(self->seed), __ATOMIC_RELAXED);
+	ret.hash = hash_key(self, key, ret.seed);
 	return ret;
 }
 
-bool clear_map(hashmap_t *self) {
+bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
 
-	if(self == NULL || self->invalid) {
+	return put_hashed(self, key, val, map_hash(self, key), force);
+}
+
+bool put_hashed(hashmap_t *self, map_key_t key, map_val_t val,
+	map_hash_t hash, bool force) {
+
+    // check args
+    if(self == NULL || !valid_key(key) ||
+    	val.val_base == NULL || val.val_len == 0 || self->invalid) {
+    	errno = EINVAL;
+    	return false;
+    }
+
+    if(!lock_write(self))
+    	return false;
+
+    bool ret = put_locked(self, key, val, locked_hash(self, key, hash), force);
+	sweep_locked(self, MAP_SWEEP_STEP);
+	unlock_write(self);
+	reclaim(self);
+	return ret;
+}
+
+bool put_many(hashmap_t *self, map_key_t *keys, map_val_t *vals, bool *done,
+	size_t n, bool force) {
+
+	if(self == NULL || keys == NULL || vals == NULL || done == NULL ||
+		self->invalid) {
 		errno = EINVAL;
 		return false;
 	}
 
-	if(pthread_mutex_lock(&(self->write_lock)))
+	if(!lock_write(self))
 		return false;
 
-	if(self->invalid) {
-		pthread_mutex_unlock(&(self->write_lock));
+	for(size_t i = 0; i < n; i++) {
+		if(!valid_key(keys[i]) || vals[i].val_base == NULL ||
+			vals[i].val_len == 0)
+			done[i] = false;
+		else
+			done[i] = put_locked(self, keys[i], vals[i],
+				hash_key(self, keys[i], self->seed), force);
+	}
+	sweep_locked(self, MAP_SWEEP_STEP);
+
+	unlock_write(self);
+	reclaim(self);
+	return true;
+}
+
+map_val_t get(hashmap_t *self, map_key_t key) {
+
+	return get_hashed(self, key, map_hash(self, key));
+}
+
+map_val_t get_hashed(hashmap_t *self, map_key_t key, map_hash_t hash) {
+
+	// check args
+	if(self == NULL || self->invalid || !valid_key(key)) {
+		errno = EINVAL;
+		return MAP_VAL(NULL, 0);
+	}
+
+	if(!lock_read(self))
+		return MAP_VAL(NULL, 0);
+
+	map_val_t ret = MAP_VAL(NULL, 0);
+	map_node_t *node = get_locked(self, key, locked_hash(self, key, hash));
+	if(node != NULL)
+		ret = MAP_VAL(node->val.val_base, node->val.val_len);
+	unlock_read(self);
+    return ret;
+}
+
+// Pins an entry while the map is locked, so it cannot be let go of meanwhile
+static map_node_t pin_entry(hashmap_t *self, map_node_t *node)
+{
+	__atomic_add_fetch(self->refs_function(node->key, node->val), 1,
+		__ATOMIC_RELAXED);
+	return MAP_NODE(node->key, node->val, false);
+}
+
+map_node_t get_pinned(hashmap_t *self, map_key_t key, map_hash_t hash) {
+
+	map_node_t ret = MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+
+	// check args
+	if(self == NULL || self->invalid || self->refs_function == NULL ||
+		!valid_key(key)) {
+		errno = EINVAL;
+		return ret;
+	}
+
+	if(!lock_read(self))
+		return ret;
+
+	map_node_t *node = get_locked(self, key, locked_hash(self, key, hash));
+	if(node != NULL)
+		ret = pin_entry(self, node);
+	unlock_read(self);
+	return ret;
+}
+
+bool get_many(hashmap_t *self, map_key_t *keys, map_val_t *vals, size_t n) {
+
+	if(self == NULL || keys == NULL || vals == NULL || self->invalid) {
 		errno = EINVAL;
 		return false;
 	}
 
-	bzero(self->nodes, sizeof(map_node_t) * self->capacity);
+	if(!lock_read(self))
+		return false;
 
-	self->size = 0;
+	map_node_t *node;
+	for(size_t i = 0; i < n; i++) {
+		vals[i] = MAP_VAL(NULL, 0);
+		if(valid_key(keys[i]) && (node = get_locked(self, keys[i],
+			hash_key(self, keys[i], self->seed))) != NULL)
+			vals[i] = MAP_VAL(node->val.val_base, node->val.val_len);
+	}
 
-	pthread_mutex_unlock(&(self->write_lock));
+	unlock_read(self);
 	return true;
 }
 
-bool invalidate_map(hashmap_t *self) {
+bool get_many_pinned(hashmap_t *self, map_key_t *keys, map_node_t *pins,
+	size_t n) {
 
-    if(self == NULL || self->invalid) {
+	if(self == NULL || keys == NULL || pins == NULL || self->invalid ||
+		self->refs_function == NULL) {
 		errno = EINVAL;
 		return false;
 	}
 
-	if(pthread_mutex_lock(&(self->write_lock)))
+	if(!lock_read(self))
 		return false;
 
-	if(self->invalid) {
-		pthread_mutex_unlock(&(self->write_lock));
+	map_node_t *node;
+	for(size_t i = 0; i < n; i++) {
+		pins[i] = MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+		if(valid_key(keys[i]) && (node = get_locked(self, keys[i],
+			hash_key(self, keys[i], self->seed))) != NULL)
+			pins[i] = pin_entry(self, node);
+	}
+
+	unlock_read(self);
+	return true;
+}
+
+void map_unpin(hashmap_t *self, map_node_t pin) {
+
+	if(self == NULL || self->refs_function == NULL || pin.key.key_base == NULL)
+		return;
+	if(__atomic_fetch_sub(self->refs_function(pin.key, pin.val), 1,
+		__ATOMIC_ACQ_REL) == 0)
+		self->destroy_function(pin.key, pin.val);
+}
+
+map_node_t delete(hashmap_t *self, map_key_t key) {
+
+	return delete_hashed(self, key, map_hash(self, key));
+}
+
+map_node_t delete_hashed(hashmap_t *self, map_key_t key, map_hash_t hash) {
+
+	if(self == NULL || !valid_key(key) || self->invalid) {
+		errno = EINVAL;
+		return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+	}
+
+	if(!lock_write(self))
+		return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+
+	map_node_t ret = delete_locked(self, key, locked_hash(self, key, hash));
+	unlock_write(self);
+	reclaim(self);
+	return ret;
+}
+
+bool delete_many(hashmap_t *self, map_key_t *keys, map_node_t *removed,
+	size_t n) {
+
+	if(self == NULL || keys == NULL || removed == NULL || self->invalid) {
+		errno = EINVAL;
+		return false;
+	}
+
+	if(!lock_write(self))
+		return false;
+
+	for(size_t i = 0; i < n; i++) {
+		if(valid_key(keys[i]))
+			removed[i] = delete_locked(self, keys[i],
+				hash_key(self, keys[i], self->seed));
+		else
+			removed[i] = MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+	}
+
+	unlock_write(self);
+	reclaim(self);
+	return true;
+}
+
+bool map_reseed(hashmap_t *self) {
+
+	if(self == NULL || self->invalid || self->keyed_hash_function == NULL) {
 		errno = EINVAL;
 		return false;
 	}
 
+	if(!lock_write(self))
+		return false;
+
+	bool ret = reseed_locked(self);
+	unlock_write(self);
+	reclaim(self);
+	return ret;
+}
+
+bool clear_map(hashmap_t *self) {
+
+	if(self == NULL || self->invalid) {
+		errno = EINVAL;
+		return false;
+	}
+
+	if(!lock_write(self))
+		return false;
+
+	// the nodes still hold the entries, which are retired as they are
+	// swept, see hashmap_t
+	if((uint16_t)(self->generation + 1) == 0)
+		sweep_locked(self, self->slots);
+	self->generation++;
+	self->stale += self->size;
+
+	self->size = 0;
+	self->memory = 0;
+	self->front = NULL;
+	self->rear = NULL;
+
+	unlock_write(self);
+	reclaim(self);
+	return true;
+}
+
+bool invalidate_map(hashmap_t *self) {
+
+    if(self == NULL || self->invalid) {
+		errno = EINVAL;
+		return false;
+	}
+
+	if(!lock_write(self))
+		return false;
+
 	map_node_t *node;
-	for(int i = 0; i < self->capacity; i++) {
+	for(uint64_t i = 0; i < self->slots; i++) {
 		node = self->nodes+i;
 		if(node->key.key_base != NULL)
-			(self->destroy_function)(node->key, node->val);
+			drop_entry(self, node->key, node->val);
 	}
 
 	free(self->nodes);
 	self->invalid = true;
 
-	pthread_mutex_unlock(&(self->write_lock));
+	unlock_write(self);
 	return true;
 
 }
@@ -0,0 +1,359 @@
+#include "hash.h"
+#include "string.h"
+#include "time.h"
+#include "sys/random.h"
+
+#ifdef __SSE2__
+#include "emmintrin.h"
+#endif
+#ifdef __x86_64__
+#include "immintrin.h"
+#endif
+
+const hash_entry_t hash_functions[] = {
+	{"jenkins", jenkins_one_at_a_time_hash, jenkins_keyed_hash},
+	{"word", word_hash, word_keyed_hash},
+	{"stripe", stripe_hash, stripe_keyed_hash},
+	{NULL, NULL, NULL}
+};
+
+const hash_entry_t *hash_by_name(const char *name)
+{
+	for(const hash_entry_t *entry = hash_functions; entry->name != NULL; entry++) {
+		if(strcmp(entry->name, name) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+uint64_t random_seed(void)
+{
+	uint64_t seed;
+	struct timespec ts;
+
+	if(getrandom(&seed, sizeof(seed), GRND_NONBLOCK) == sizeof(seed))
+		return seed;
+	// early in boot the kernel may not have the entropy yet
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) ^ (uintptr_t)&seed;
+}
+
+uint32_t jenkins_keyed_hash(map_key_t map_key, uint64_t seed)
+{
+	const uint8_t *key = map_key.key_base;
+	uint32_t hash = (uint32_t)seed;
+
+	for(size_t i = 0; i < map_key.key_len; i++) {
+		hash += key[i];
+		hash += hash << 10;
+		hash ^= hash >> 6;
+	}
+	// the high half of the seed goes in last, so it is mixed in once more
+	hash ^= (uint32_t)(seed >> 32);
+	hash += hash << 3;
+	hash ^= hash >> 11;
+	hash += hash << 15;
+	return hash;
+}
+
+#define WORD_P0 0xa0761d6478bd642fULL
+#define WORD_P1 0xe7037ed1a0b428dbULL
+#define WORD_P2 0x8ebc6af09c88c6e3ULL
+#define WORD_P3 0x589965cc75374cc3ULL
+
+// Keys are bytes at any alignment, memcpy compiles to a plain load
+static inline uint64_t read64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+// Multiplies a by b and folds the 128 bit product into 64 bits
+static inline uint64_t mum(uint64_t a, uint64_t b)
+{
+	__uint128_t r = (__uint128_t)a * b;
+
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint32_t fold32(uint64_t h)
+{
+	return (uint32_t)(h ^ (h >> 32));
+}
+
+// The constants every 16 bytes are keyed with, which a keyed hash derives
+// from its seed so that no input can cancel them out for every seed
+typedef struct word_keys_t {
+	uint64_t p1, p2, p3;
+} word_keys_t;
+
+static const word_keys_t word_keys = {WORD_P1, WORD_P2, WORD_P3};
+
+static uint64_t word_hash64(const uint8_t *p, size_t len, uint64_t seed,
+	const word_keys_t *keys)
+{
+	uint64_t a, b, s1, s2;
+	size_t i = len;
+
+	seed ^= mum(seed ^ WORD_P0, WORD_P1);
+	if(len <= 16) {
+		// overlapping reads cover every length without a loop
+		if(len >= 4) {
+			a = (read32(p) << 32) | read32(p + ((len >> 3) << 2));
+			b = (read32(p + len - 4) << 32) | read32(p + len - 4 - ((len >> 3) << 2));
+		}
+		else if(len > 0) {
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+			b = 0;
+		}
+		else
+			a = b = 0;
+	}
+	else {
+		if(i > 48) {
+			s1 = s2 = seed;
+			do {
+				seed = mum(read64(p) ^ keys->p1, read64(p + 8) ^ seed);
+				s1 = mum(read64(p + 16) ^ keys->p2, read64(p + 24) ^ s1);
+				s2 = mum(read64(p + 32) ^ keys->p3, read64(p + 40) ^ s2);
+				p += 48;
+				i -= 48;
+			} while(i > 48);
+			seed ^= s1 ^ s2;
+		}
+		while(i > 16) {
+			seed = mum(read64(p) ^ keys->p1, read64(p + 8) ^ seed);
+			p += 16;
+			i -= 16;
+		}
+		a = read64(p + i - 16);
+		b = read64(p + i - 8);
+	}
+	return mum(WORD_P1 ^ len, mum(a ^ keys->p1, b ^ seed));
+}
+
+uint32_t word_hash(map_key_t map_key)
+{
+	return fold32(word_hash64(map_key.key_base, map_key.key_len, 0, &word_keys));
+}
+
+uint32_t word_keyed_hash(map_key_t map_key, uint64_t seed)
+{
+	word_keys_t keys = {
+		WORD_P1 ^ mum(seed ^ WORD_P1, WORD_P0),
+		WORD_P2 ^ mum(seed ^ WORD_P2, WORD_P0),
+		WORD_P3 ^ mum(seed ^ WORD_P3, WORD_P0)
+	};
+
+	return fold32(word_hash64(map_key.key_base, map_key.key_len, seed, &keys));
+}
+
+#define STRIPE_LEN 64
+#define STRIPE_LANES 8
+#define STRIPE_SECRET 24
+// Every stripe of a block takes its keys one lane further into the secret
+#define STRIPES_PER_BLOCK (STRIPE_SECRET - STRIPE_LANES)
+#define STRIPE_PRIME32 0x9e3779b1U
+
+static const uint64_t stripe_secret[STRIPE_SECRET] = {
+	0x09f1fd9d03f0a9b4ULL, 0x553274161bbf8475ULL, 0x5d5bca4696b343b3ULL,
+	0x70d29b6c7d22528dULL, 0x0bf2b716f9915475ULL, 0x5eb7f92b95387ccaULL,
+	0x296cd0f2c21d7f90ULL, 0x1289a69805c125b1ULL, 0xdaa27fb8dacb9e73ULL,
+	0x3ed08d59cb3f4727ULL, 0x58a5f17b6c15c659ULL, 0x651ac042fa7b481aULL,
+	0x22af6aeaa88e8dccULL, 0x2d2bae64640abfb9ULL, 0xad0e83a710231b07ULL,
+	0x9d30ff2169d91f12ULL, 0xf5ff07c9523504ddULL, 0x1273c823ba66eec0ULL,
+	0x47e1dbe249cb520bULL, 0xbbea42bd69484adcULL, 0xc33e61bc6ef9e4c4ULL,
+	0x752cd583231b5114ULL, 0xe53dc6e1988622e5ULL, 0x928eb721ed361ba3ULL,
+};
+
+#ifdef __SSE2__
+typedef __m128i stripe_acc_t[STRIPE_LANES / 2];
+#else
+typedef uint64_t stripe_acc_t[STRIPE_LANES];
+#endif
+
+// Adds one stripe into the accumulators: every lane gets the product of the
+// halves of its keyed input, and its neighbour's input unkeyed, so no byte
+// can cancel out of the product alone
+static inline __attribute__((always_inline)) void accumulate(stripe_acc_t acc,
+	const uint8_t *in, const uint64_t *key)
+{
+#ifdef __SSE2__
+	__m128i data, keyed, product, swapped;
+
+	for(int i = 0; i < STRIPE_LANES / 2; i++) {
+		data = _mm_loadu_si128((const __m128i *)in + i);
+		keyed = _mm_xor_si128(data, _mm_loadu_si128((const __m128i *)key + i));
+		product = _mm_mul_epu32(keyed, _mm_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1)));
+		swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+		acc[i] = _mm_add_epi64(acc[i], _mm_add_epi64(product, swapped));
+	}
+#else
+	uint64_t data, keyed;
+
+	for(int i = 0; i < STRIPE_LANES; i++) {
+		data = read64(in + 8 * i);
+		keyed = data ^ key[i];
+		acc[i ^ 1] += data;
+		acc[i] += (keyed & 0xffffffff) * (keyed >> 32);
+	}
+#endif
+}
+
+// Mixes the high bits of every accumulator back into its low ones between
+// blocks, which the products alone would only ever push upwards
+static inline __attribute__((always_inline)) void scramble(stripe_acc_t acc,
+	const uint64_t *key)
+{
+#ifdef __SSE2__
+	__m128i a, prime = _mm_set1_epi32(STRIPE_PRIME32), lo, hi;
+
+	for(int i = 0; i < STRIPE_LANES / 2; i++) {
+		a = _mm_xor_si128(acc[i], _mm_srli_epi64(acc[i], 47));
+		a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i *)key + i));
+		lo = _mm_mul_epu32(a, prime);
+		hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+		acc[i] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+	}
+#else
+	for(int i = 0; i < STRIPE_LANES; i++) {
+		acc[i] ^= acc[i] >> 47;
+		acc[i] ^= key[i];
+		acc[i] *= STRIPE_PRIME32;
+	}
+#endif
+}
+
+static const uint64_t stripe_init[STRIPE_LANES] __attribute__((aligned(16))) = {
+	WORD_P0, WORD_P1, WORD_P2, WORD_P3,
+	STRIPE_PRIME32, WORD_P3 ^ WORD_P0, WORD_P2 ^ WORD_P1, STRIPE_PRIME32 + 1
+};
+
+// Runs every stripe of a key of more than STRIPE_LEN bytes through the
+// accumulators and leaves them in out
+static void stripe_loop(const uint8_t *p, size_t len, const uint64_t *secret,
+	uint64_t *out)
+{
+	size_t stripes = (len - 1) / STRIPE_LEN, i;
+	stripe_acc_t acc;
+
+	memcpy(acc, stripe_init, sizeof(acc));
+	// the last stripe is always a full one ending at the last byte, so the
+	// stripes before it stop short of it
+	for(i = 0; i + STRIPES_PER_BLOCK <= stripes; i += STRIPES_PER_BLOCK) {
+		for(int s = 0; s < STRIPES_PER_BLOCK; s++)
+			accumulate(acc, p + (i + s) * STRIPE_LEN, secret + s);
+		scramble(acc, secret + STRIPES_PER_BLOCK);
+	}
+	for(int s = 0; i < stripes; i++, s++)
+		accumulate(acc, p + i * STRIPE_LEN, secret + s);
+	accumulate(acc, p + len - STRIPE_LEN, secret + STRIPES_PER_BLOCK - 1);
+	memcpy(out, acc, sizeof(acc));
+}
+
+#ifdef __x86_64__
+// accumulate() and scramble() with a whole stripe in two AVX2 registers, for
+// CPUs that have it. They give the same accumulators
+#define AVX2_INLINE static inline __attribute__((target("avx2"), always_inline))
+
+AVX2_INLINE void accumulate_avx2(__m256i *acc, const uint8_t *in,
+	const uint64_t *key)
+{
+	__m256i data, keyed, product, swapped;
+
+	for(int i = 0; i < 2; i++) {
+		data = _mm256_loadu_si256((const __m256i *)in + i);
+		keyed = _mm256_xor_si256(data, _mm256_loadu_si256((const __m256i *)key + i));
+		product = _mm256_mul_epu32(keyed, _mm256_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1)));
+		swapped = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+		acc[i] = _mm256_add_epi64(acc[i], _mm256_add_epi64(product, swapped));
+	}
+}
+
+AVX2_INLINE void scramble_avx2(__m256i *acc, const uint64_t *key)
+{
+	__m256i a, prime = _mm256_set1_epi32(STRIPE_PRIME32), lo, hi;
+
+	for(int i = 0; i < 2; i++) {
+		a = _mm256_xor_si256(acc[i], _mm256_srli_epi64(acc[i], 47));
+		a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i *)key + i));
+		lo = _mm256_mul_epu32(a, prime);
+		hi = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime);
+		acc[i] = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+	}
+}
+
+__attribute__((target("avx2")))
+static void stripe_loop_avx2(const uint8_t *p, size_t len,
+	const uint64_t *secret, uint64_t *out)
+{
+	size_t stripes = (len - 1) / STRIPE_LEN, i;
+	__m256i acc[2];
+
+	for(int j = 0; j < 2; j++)
+		acc[j] = _mm256_loadu_si256((const __m256i *)stripe_init + j);
+	for(i = 0; i + STRIPES_PER_BLOCK <= stripes; i += STRIPES_PER_BLOCK) {
+		for(int s = 0; s < STRIPES_PER_BLOCK; s++)
+			accumulate_avx2(acc, p + (i + s) * STRIPE_LEN, secret + s);
+		scramble_avx2(acc, secret + STRIPES_PER_BLOCK);
+	}
+	for(int s = 0; i < stripes; i++, s++)
+		accumulate_avx2(acc, p + i * STRIPE_LEN, secret + s);
+	accumulate_avx2(acc, p + len - STRIPE_LEN, secret + STRIPES_PER_BLOCK - 1);
+	for(int j = 0; j < 2; j++)
+		_mm256_storeu_si256((__m256i *)out + j, acc[j]);
+}
+#endif
+
+static uint32_t stripe_hash_secret(map_key_t map_key, uint64_t seed,
+	const uint64_t *secret)
+{
+	uint64_t out[STRIPE_LANES], h;
+	size_t len = map_key.key_len;
+
+#ifdef __x86_64__
+	if(__builtin_cpu_supports("avx2"))
+		stripe_loop_avx2(map_key.key_base, len, secret, out);
+	else
+#endif
+		stripe_loop(map_key.key_base, len, secret, out);
+
+	h = len * WORD_P0 ^ seed;
+	for(int i = 0; i < STRIPE_LANES; i += 2)
+		h += mum(out[i] ^ secret[i], out[i + 1] ^ secret[i + 1]);
+	h ^= h >> 37;
+	h *= 0x165667919e3779f9ULL;
+	h ^= h >> 32;
+	return (uint32_t)h;
+}
+
+uint32_t stripe_hash(map_key_t map_key)
+{
+	if(map_key.key_len <= HASH_STRIPE_MIN)
+		return word_hash(map_key);
+	return stripe_hash_secret(map_key, 0, stripe_secret);
+}
+
+uint32_t stripe_keyed_hash(map_key_t map_key, uint64_t seed)
+{
+	uint64_t secret[STRIPE_SECRET];
+
+	if(map_key.key_len <= HASH_STRIPE_MIN)
+		return word_keyed_hash(map_key, seed);
+	// the products only see the input through the secret, so the seed has
+	// to go into the secret for stripes that collide for one seed not to
+	// collide for all of them
+	for(int i = 0; i < STRIPE_SECRET; i++)
+		secret[i] = stripe_secret[i] + (i & 1 ? -seed : seed);
+	return stripe_hash_secret(map_key, seed, secret);
+}
@@ -1,8 +1,14 @@
 #include "utils.h"
+#include "hash.h"
 #include "errno.h"
 #include "strings.h"
 #include "string.h"
 #include "debug.h"
+#include "sched.h"
+
+#ifdef __SSE2__
+#include "emmintrin.h"
+#endif
 
 #define MAP_KEY(base, len) (map_key_t) {.key_base = base, .key_len = len}
 #define MAP_VAL(base, len) (map_val_t) {.val_base = base, .val_len = len}
@@ -15,279 +21,1924 @@ bool key_equals(map_key_t one, map_key_t two)
 	if(one.key_len != two.key_len)
 		return false;
 
-	if(strncmp(one.key_base, two.key_base, one.key_len))
+	// keys are bytes, not strings
+	if(memcmp(one.key_base, two.key_base, one.key_len))
+		return false;
+	return true;
+}
+
+static size_t inline_len(size_t key_len)
+{
+	return key_len < MAP_INLINE_KEY_SIZE ? key_len : MAP_INLINE_KEY_SIZE;
+}
+
+// Compares a key with the key of a node, only looking at the key itself
+// for the bytes that did not fit in the node
+static bool node_key_equals(uint8_t *key_inline, map_key_t node_key,
+	map_key_t key)
+{
+	size_t n = inline_len(key.key_len);
+
+	if(node_key.key_len != key.key_len || memcmp(key_inline, key.key_base, n))
+		return false;
+	return key.key_len == n || !memcmp((char *)node_key.key_base + n,
+		(char *)key.key_base + n, key.key_len - n);
+}
+
+// Number of keys of a batch call that are sorted into segments at a time
+#define BATCH_CHUNK 256
+
+// What insert_node() returns if a cuckoo table has no room for the entry:
+// MAP_NO_ROOM if the table should grow, since the search for a path to a
+// free node was cut short or the table is small enough for it to reach
+// every bucket, and MAP_COLLIDED if every bucket it could reach was full
+// anyway, which only keys that collide on both of their buckets lead to
+#define MAP_NO_ROOM (UINT32_MAX - 1)
+#define MAP_COLLIDED UINT32_MAX
+
+hashmap_t *create_map(uint64_t capacity, hash_func_f hash_function, destructor_f destroy_function) {
+
+	map_config_t config = {capacity, 0, hash_function, destroy_function, false};
+	return create_map_config(&config);
+}
+
+hashmap_t *create_map_segmented(uint64_t capacity, uint32_t num_segments,
+	hash_func_f hash_function, destructor_f destroy_function) {
+
+	map_config_t config = {capacity, num_segments, hash_function,
+		destroy_function, false};
+
+	if(num_segments == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return create_map_config(&config);
+}
+
+// Allocates the nodes and tags of an empty table in one block, with every
+// node on a cache line of its own
+static bool alloc_table(map_table_t *table, uint64_t capacity)
+{
+	map_node_t *nodes;
+	size_t size = sizeof(map_node_t) * capacity + capacity + MAP_GROUP_SIZE - 1;
+
+	size = (size + 63) & ~(size_t)63;
+	if((nodes = aligned_alloc(64, size)) == NULL)
 		return false;
+	bzero(nodes, size);
+	table->nodes = nodes;
+	table->tags = (uint8_t *)(nodes + capacity);
+	table->capacity = capacity;
+	table->size = 0;
 	return true;
 }
 
-hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f destroy_function) {
+hashmap_t *create_map_config(map_config_t *config) {
 
 	hashmap_t *hmap;
+	map_segment_t *seg;
+	uint64_t capacity;
+	uint32_t i, num_segments;
 
     // check args
-    if(capacity == 0 || hash_function == NULL || destroy_function == NULL) {
+    if(config == NULL || config->capacity == 0 ||
+    	config->num_segments > config->capacity ||
+    	(config->hash_function == NULL && config->keyed_hash_function == NULL) ||
+    	config->destroy_function == NULL || config->max_load_percent > 100) {
     	errno = EINVAL;
     	return NULL;
     }
+    capacity = config->capacity;
+
+	// small maps are not worth splitting into tiny segments
+    if((num_segments = config->num_segments) == 0) {
+    	if(capacity / MAP_SEGMENT_MIN_CAPACITY > MAP_SEGMENTS)
+    		num_segments = MAP_SEGMENTS;
+    	else
+    		num_segments = capacity / MAP_SEGMENT_MIN_CAPACITY;
+    	if(num_segments == 0)
+    		num_segments = 1;
+    }
+    // the hash is masked, not divided, into a segment, see home_index()
+    while(num_segments & (num_segments - 1))
+    	num_segments &= num_segments - 1;
 
     // allocate space for the hashmpa
-    if((hmap = calloc(1, sizeof(hashmap_t))) == NULL)
+    if((hmap = aligned_alloc(64, sizeof(hashmap_t))) == NULL)
     	return NULL;
+    bzero(hmap, sizeof(hashmap_t));
 
     hmap->capacity = capacity;
-    hmap->size = 0;
-    hmap->hash_function = hash_function;
-    hmap->destroy_function = destroy_function;
-    hmap->num_readers = 0;
+    hmap->num_segments = num_segments;
+    hmap->segment_bits = __builtin_ctz(num_segments);
+    hmap->hash_function = config->hash_function;
+    hmap->keyed_hash_function = config->keyed_hash_function;
+    hmap->seed = random_seed();
+    hmap->destroy_function = config->destroy_function;
+    hmap->refs_function = config->refs_function;
+    hmap->max_memory = config->max_memory;
+    hmap->lockfree_get = config->lockfree_get;
+    hmap->cuckoo = config->cuckoo;
+    if((hmap->max_load_percent = config->max_load_percent) == 0)
+    	hmap->max_load_percent = config->cuckoo ? MAP_CUCKOO_MAX_LOAD_PERCENT :
+    		MAP_MAX_LOAD_PERCENT;
     hmap->invalid = false;
 
-    if(pthread_mutex_init(&(hmap->write_lock), NULL))
-    	goto hmap_after_alloc_error;
+    for(i = 0; i < MAP_READER_SLOTS; i++) {
+    	if(pthread_mutex_init(&(hmap->retire_lists[i].lock), NULL))
+    		goto hmap_after_alloc_error;
+    }
 
-    if(pthread_mutex_init(&(hmap->fields_lock), NULL))
+    if(pthread_mutex_init(&(hmap->reclaim_lock), NULL))
+    	goto hmap_after_alloc_error;
+    if(pthread_mutex_init(&(hmap->sweep_lock), NULL))
     	goto hmap_after_alloc_error;
 
-    if((hmap->nodes = calloc(capacity, sizeof(map_node_t))) == NULL)
+    // every segment gets its own cache lines
+    if((hmap->segments = aligned_alloc(64,
+    	sizeof(map_segment_t) * num_segments)) == NULL)
     	goto hmap_after_alloc_error;
+    bzero(hmap->segments, sizeof(map_segment_t) * num_segments);
+
+    for(i = 0; i < num_segments; i++) {
+    	seg = hmap->segments+i;
+    	seg->max_size = capacity / num_segments +
+    		(i < capacity % num_segments);
+    	seg->max_memory = config->max_memory / num_segments +
+    		(i < config->max_memory % num_segments);
+
+    	if(pthread_mutex_init(&(seg->write_lock), NULL))
+    		goto hmap_after_segments_error;
+
+    	// tables grow with the entries, see map_segment_t
+    	if(!alloc_table(&(seg->table), MAP_TABLE_MIN_CAPACITY))
+    		goto hmap_after_segments_error;
+    	seg->seed = seg->old_seed = hmap->seed;
+    }
 
     return hmap;
+    hmap_after_segments_error:
+    for(uint32_t j = 0; j <= i; j++)
+    	free(hmap->segments[j].table.nodes);
+    free(hmap->segments);
     hmap_after_alloc_error:
     free(hmap);
     return NULL;
 }
 
-bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
+#ifdef MAP_LOCK_STATS
+void map_lock_stats(hashmap_t *self, uint64_t *holds, uint64_t *hold_ns) {
 
-    // check args
-    if(self == NULL || key.key_base == NULL || key.key_len == 0 ||
-    	val.val_base == NULL || val.val_len == 0 || self->invalid) {
-    	errno = EINVAL;
-    	return false;
-    }
+	*holds = *hold_ns = 0;
+	for(uint32_t i = 0; i < self->num_segments; i++) {
+		*holds += self->segments[i].write_holds;
+		*hold_ns += self->segments[i].write_hold_ns;
+	}
+}
+#endif
 
-    // lock the map for writing
-    if(pthread_mutex_lock(&(self->write_lock)))
-    	return false;
+uint64_t map_size(hashmap_t *self) {
 
-    if(self->invalid) { // check that map hasnt been invalidated since last check
-    	pthread_mutex_unlock(&(self->write_lock));
-    	errno = EINVAL;
-    	return false;
-    }
+	uint64_t size = 0;
 
-    int index = get_index(self, key);
-
-    if(self->capacity == self->size) {
-    	if(!force) {
-	    	pthread_mutex_unlock(&(self->write_lock));
-	    	errno = ENOMEM;
-	    	return false;
-	    }
-	    self->destroy_function((self->nodes+index)->key, (self->nodes+index)->val);
-	    (self->nodes+index)->key = key;
-	    (self->nodes+index)->val = val;
-	    pthread_mutex_unlock(&(self->write_lock));
-	    return true;
-    }
+	if(self == NULL || self->invalid)
+		return 0;
 
-    // search for an open sopt or tombstone
-    while((self->nodes+index)->key.key_base != NULL &&
-    	!((self->nodes+index)->tombstone)) {
-    	if(key_equals((self->nodes+index)->key, key)) {
-    		self->destroy_function((self->nodes+index)->key, (self->nodes+index)->val);
-    		break;
-    	}
-		index = (index+1) % self->capacity;
-    }
+	for(uint32_t i = 0; i < self->num_segments; i++)
+		size += self->segments[i].table.size + self->segments[i].old.size;
+	return size;
+}
 
-    (self->nodes+index)->key = key;
-	(self->nodes+index)->val = val;
-	(self->nodes+index)->tombstone = false;
-	self->size++;
-	pthread_mutex_unlock(&(self->write_lock));
-	return true;
+size_t map_memory(hashmap_t *self) {
+
+	size_t memory = 0;
+
+	if(self == NULL || self->invalid)
+		return 0;
+
+	for(uint32_t i = 0; i < self->num_segments; i++)
+		memory += self->segments[i].memory;
+	return memory + __atomic_load_n(&(self->unswept), __ATOMIC_RELAXED);
 }
 
-map_val_t get(hashmap_t *self, map_key_t key) {
+static uint32_t hash_key(hashmap_t *self, map_key_t key, uint64_t seed)
+{
+	if(self->keyed_hash_function != NULL)
+		return self->keyed_hash_function(key, seed);
+	return self->hash_function(key);
+}
 
-	// check args
-	if(self == NULL || self->invalid ||
-		key.key_base == NULL || key.key_len == 0) {
-		errno = EINVAL;
-		return MAP_VAL(NULL, 0);
-	}
+// The hash a key has in a table hashed with seed, given the one that
+// picked its segment. Until the segment is reseeded they are the same
+static uint32_t seeded_hash(hashmap_t *self, map_key_t key, uint32_t hash,
+	uint64_t seed)
+{
+	return seed == self->seed ? hash : hash_key(self, key, seed);
+}
 
-	// aquire feilds lock
-	if(pthread_mutex_lock(&(self->fields_lock)))
-		return MAP_VAL(NULL, 0);
+static map_segment_t *segment_of(hashmap_t *self, uint32_t hash)
+{
+	return self->segments + (hash & (self->num_segments - 1));
+}
 
-	if(self->num_readers == 0) {
-		// aquire write lock
-		if(pthread_mutex_lock(&(self->write_lock))){
-			pthread_mutex_unlock(&(self->fields_lock));
-			return MAP_VAL(NULL, 0);
-		}
-		// recheck validity
-		if(self->invalid) {
-			pthread_mutex_unlock(&(self->write_lock));
-			pthread_mutex_unlock(&(self->fields_lock));
-			return MAP_VAL(NULL, 0);
-		}
-	}
-	self->num_readers++;
-	pthread_mutex_unlock(&(self->fields_lock));
+// The low bits of the hash pick the segment, the rest the slot in it. Both
+// counts are powers of two, so neither takes a division
+static uint64_t home_index(hashmap_t *self, map_table_t *table, uint32_t hash)
+{
+	return (hash >> self->segment_bits) & (table->capacity - 1);
+}
 
-	int index = get_index(self, key);
-	map_val_t ret = MAP_VAL(NULL, 0);
-	map_node_t *node;
+// The slot i slots past slot pos, wrapping around the end of the table
+static uint64_t slot_after(map_table_t *table, uint64_t pos, uint64_t i)
+{
+	return (pos + i) & (table->capacity - 1);
+}
 
-	for(int i = 0; i < self->capacity; i++) {
-		node = self->nodes+((index+i) % self->capacity);
-		if (node->key.key_len == 0) {
-			if(node->tombstone)
-				continue;
-			else
-				break;
-		}
-		else if(key_equals(node->key, key)) {
-			ret = MAP_VAL(node->val.val_base, node->val.val_len);
-			debug("found");
-			break;
-		}
-	}
+// A cuckoo table's key lives in its first bucket or in one other, picked
+// from a mix of the hash that the first bucket does not depend on. They
+// never are the same bucket
+static uint64_t first_bucket(hashmap_t *self, map_table_t *table,
+	uint32_t hash)
+{
+	return home_index(self, table, hash) / MAP_BUCKET_SIZE;
+}
 
-	// reaquire fields lock
-	pthread_mutex_lock(&(self->fields_lock));
-	self->num_readers--;
+static uint64_t second_bucket(hashmap_t *self, map_table_t *table,
+	uint32_t hash)
+{
+	uint64_t buckets = table->capacity / MAP_BUCKET_SIZE;
+	uint32_t mix = hash * 0x9e3779b1;
+
+	mix ^= mix >> 16;
+	// mix scaled down to below buckets - 1 by a multiplication
+	return (first_bucket(self, table, hash) + 1 +
+		(uint64_t)(((unsigned __int128)mix * (buckets - 1)) >> 32)) &
+		(buckets - 1);
+}
 
-	// release write lock if no other readers are running
-	if(self->num_readers == 0)
-		pthread_mutex_unlock(&(self->write_lock));
+// The bucket an entry of a cuckoo table can move to from bucket
+static uint64_t other_bucket(hashmap_t *self, map_table_t *table,
+	uint32_t hash, uint64_t bucket)
+{
+	uint64_t first = first_bucket(self, table, hash);
+	return bucket == first ? second_bucket(self, table, hash) : first;
+}
 
-	// release fields lock
-	pthread_mutex_unlock(&(self->fields_lock));
+#ifdef MAP_LOCK_STATS
+static uint64_t lock_clock(void)
+{
+	struct timespec ts;
 
-    return ret;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
+#endif
 
-map_node_t delete(hashmap_t *self, map_key_t key) {
+// Readers that were held back go as soon as writers drops to 0, which is
+// safe since everything the writer did is published by the decrement
+static void unlock_write(map_segment_t *seg)
+{
+#ifdef MAP_LOCK_STATS
+	seg->write_hold_ns += lock_clock() - seg->locked_at;
+	seg->write_holds++;
+#endif
+	__atomic_store_n(&(seg->seq), seg->seq + 1, __ATOMIC_RELEASE);
+	__atomic_sub_fetch(&(seg->writers), 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&(seg->write_lock));
+}
 
-	if(self == NULL || key.key_base == NULL ||
-		key.key_len == 0 || self->invalid) {
-		errno = EINVAL;
-		return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
-	}
+// Every thread reads through the same reader slot of every segment
+static int reader_slot(void)
+{
+	static int next_slot;
+	static __thread int slot = -1;
 
-	if(pthread_mutex_lock(&(self->write_lock)))
-		return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+	if(slot < 0)
+		slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) %
+			MAP_READER_SLOTS;
+	return slot;
+}
 
-	int index = get_index(self, key);
-	map_node_t *node, *to_remove;
-	to_remove = NULL;
+// Readers only write to their own slot. If a writer is in or waiting, the
+// reader steps back out and queues on write_lock behind it
+static bool lock_read(hashmap_t *self, map_segment_t *seg)
+{
+	int *count = &(seg->readers[reader_slot()].count);
 
-	for(int i = 0; i < self->capacity; i++) {
-		node = self->nodes+((index+i) % self->capacity);
-		if (node->key.key_len == 0) {
-			if(node->tombstone)
-				continue;
-			else
-				break;
-		}
-		else if(key_equals(node->key, key)) {
-			to_remove = node;
+	while(1) {
+		// pairs with the writer bumping writers before looking at the slots
+		__atomic_add_fetch(count, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&(seg->writers), __ATOMIC_SEQ_CST) == 0)
 			break;
-		}
-	}
-
-	map_node_t ret;
+		__atomic_sub_fetch(count, 1, __ATOMIC_RELEASE);
 
-	if(to_remove == NULL) {
-		debug("not found: %i", *(int *)key.key_base);
-		ret = MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+		if(pthread_mutex_lock(&(seg->write_lock)))
+			return false;
+		pthread_mutex_unlock(&(seg->write_lock));
 	}
-	else {
-		ret = *node;
-		bzero(node, sizeof(map_node_t));
-		node->tombstone = true;
-		self->size--;
+
+	// recheck validity
+	if(self->invalid) {
+		__atomic_sub_fetch(count, 1, __ATOMIC_RELEASE);
+		return false;
 	}
+	return true;
+}
 
-	pthread_mutex_unlock(&(self->write_lock));
-	return ret;
+static void unlock_read(map_segment_t *seg)
+{
+	__atomic_sub_fetch(&(seg->readers[reader_slot()].count), 1,
+		__ATOMIC_RELEASE);
 }
 
-bool clear_map(hashmap_t *self) {
+// Announcing the writer first keeps new readers out, so it only waits for
+// the readers that were already in
+static bool lock_write(hashmap_t *self, map_segment_t *seg)
+{
+	__atomic_add_fetch(&(seg->writers), 1, __ATOMIC_SEQ_CST);
 
-	if(self == NULL || self->invalid) {
-		errno = EINVAL;
+	// lock the segment for writing
+	if(pthread_mutex_lock(&(seg->write_lock))) {
+		__atomic_sub_fetch(&(seg->writers), 1, __ATOMIC_SEQ_CST);
 		return false;
 	}
 
-	if(pthread_mutex_lock(&(self->write_lock)))
-		return false;
+	for(int i = 0; i < MAP_READER_SLOTS; i++) {
+		while(__atomic_load_n(&(seg->readers[i].count), __ATOMIC_SEQ_CST))
+			sched_yield();
+	}
 
-	if(self->invalid) {
-		pthread_mutex_unlock(&(self->write_lock));
+	// lock-free gets that overlap with the changes below will retry
+	__atomic_store_n(&(seg->seq), seg->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+#ifdef MAP_LOCK_STATS
+	seg->locked_at = lock_clock();
+#endif
+
+	if(self->invalid) { // check that map hasnt been invalidated since last check
+		unlock_write(seg);
 		errno = EINVAL;
 		return false;
 	}
+	return true;
+}
 
-	bzero(self->nodes, sizeof(map_node_t) * self->capacity);
+// Locks every segment, always in the same order, for the operations that
+// work on the whole map
+static bool lock_all(hashmap_t *self)
+{
+	for(uint32_t i = 0; i < self->num_segments; i++) {
+		if(!lock_write(self, self->segments+i)) {
+			while(i-- > 0)
+				unlock_write(self->segments+i);
+			return false;
+		}
+	}
+	return true;
+}
 
-	self->size = 0;
+static void unlock_all(hashmap_t *self)
+{
+	for(uint32_t i = 0; i < self->num_segments; i++)
+		unlock_write(self->segments+i);
+}
 
-	pthread_mutex_unlock(&(self->write_lock));
-	return true;
+// Locks the segment of a key hashed by map_hash()
+static map_segment_t *lock_key(hashmap_t *self, map_hash_t hash, bool write)
+{
+	map_segment_t *seg = segment_of(self, hash.hash);
+
+	if(!(write ? lock_write(self, seg) : lock_read(self, seg)))
+		return NULL;
+	return seg;
 }
 
-bool invalidate_map(hashmap_t *self) {
+// Read sections the calling thread has open, on any map
+static __thread int read_depth;
 
-    if(self == NULL || self->invalid) {
-		errno = EINVAL;
-		return false;
-	}
+int map_read_begin(hashmap_t *self) {
 
-	if(pthread_mutex_lock(&(self->write_lock)))
-		return false;
+	int slot = reader_slot();
+	int parity = __atomic_load_n(&(self->epoch), __ATOMIC_RELAXED) & 1;
 
-	if(self->invalid) {
-		pthread_mutex_unlock(&(self->write_lock));
-		errno = EINVAL;
-		return false;
+	__atomic_add_fetch(&(self->epoch_slots[slot].readers[parity]), 1,
+		__ATOMIC_SEQ_CST);
+	// nothing is read from the map before the section is visible
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	read_depth++;
+	return slot * 2 + parity;
+}
+
+void map_read_end(hashmap_t *self, int token) {
+
+	read_depth--;
+	__atomic_sub_fetch(&(self->epoch_slots[token / 2].readers[token % 2]), 1,
+		__ATOMIC_RELEASE);
+}
+
+// Returns once every read section that was open when it was called has
+// ended. New sections go to the other epoch after each flip, so each
+// counter drains; waiting on both covers the readers that looked at the
+// epoch just before a flip. The caller holds reclaim_lock
+static void wait_for_readers(hashmap_t *self)
+{
+	unsigned int old;
+
+	for(int pass = 0; pass < 2; pass++) {
+		old = __atomic_fetch_add(&(self->epoch), 1, __ATOMIC_SEQ_CST);
+		for(int i = 0; i < MAP_READER_SLOTS; i++) {
+			while(__atomic_load_n(&(self->epoch_slots[i].readers[old & 1]),
+				__ATOMIC_SEQ_CST))
+				sched_yield();
+		}
+	}
+}
+
+// Queues an entry that left the map, or a table that was replaced, on the
+// calling thread's retire list, to be destroyed later. Called with a
+// segment locked, so it never waits for readers or frees anything itself.
+// If the list cannot grow the entry is leaked rather than destroyed under
+// a reader
+static void retire_item(hashmap_t *self, map_retired_t item)
+{
+	map_retire_list_t *list = self->retire_lists + reader_slot();
+	map_retired_t *items;
+	uint32_t cap;
+
+	pthread_mutex_lock(&(list->lock));
+	if(list->num == list->cap) {
+		cap = list->cap ? list->cap * 2 : MAP_RETIRE_BATCH;
+		if((items = realloc(list->items, sizeof(map_retired_t) * cap)) == NULL) {
+			pthread_mutex_unlock(&(list->lock));
+			return;
+		}
+		list->items = items;
+		list->cap = cap;
 	}
+	list->items[list->num++] = item;
+	pthread_mutex_unlock(&(list->lock));
+	__atomic_add_fetch(&(self->num_retired), 1, __ATOMIC_RELAXED);
+	if(item.table != NULL)
+		__atomic_store_n(&(self->table_retired), true, __ATOMIC_RELAXED);
+}
+
+static void retire(hashmap_t *self, map_key_t key, map_val_t val)
+{
+	retire_item(self, (map_retired_t) {key, val, NULL});
+}
+
+static void retire_table(hashmap_t *self, map_table_t *table)
+{
+	retire_item(self, (map_retired_t) {MAP_KEY(NULL, 0), MAP_VAL(NULL, 0),
+		table->nodes});
+}
+
+// Lets go of an entry that no read section can see any more. A pinned one
+// is left to its last unpin, see hashmap_t
+static void drop_entry(hashmap_t *self, map_key_t key, map_val_t val)
+{
+	if(self->refs_function != NULL &&
+		__atomic_fetch_sub(self->refs_function(key, val), 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	self->destroy_function(key, val);
+}
 
+// Pins an entry that a read section or the segment's lock keeps from being
+// let go of meanwhile, so the count is never raised from below 0
+static map_node_t pin_entry(hashmap_t *self, map_node_t *node)
+{
+	__atomic_add_fetch(self->refs_function(node->key, node->val), 1,
+		__ATOMIC_RELAXED);
+	return MAP_NODE(node->key, node->val, false);
+}
+
+static size_t entry_memory(map_key_t key, map_val_t val)
+{
+	return key.key_len + val.val_len + MAP_ENTRY_OVERHEAD;
+}
+
+// Destroys the entries left in up to n slots of a cleared table, from the
+// end, and frees it once none are left. Returns the slots it went through
+static uint64_t sweep_table(hashmap_t *self, map_retired_t *item, uint64_t n)
+{
 	map_node_t *node;
-	for(int i = 0; i < self->capacity; i++) {
-		node = self->nodes+i;
-		if(node->key.key_base != NULL)
-			(self->destroy_function)(node->key, node->val);
+
+	if(n > item->sweep)
+		n = item->sweep;
+	for(uint64_t i = 0; i < n; i++) {
+		node = item->table + --item->sweep;
+		if(node->key.key_base == NULL)
+			continue;
+		__atomic_sub_fetch(&(self->unswept), entry_memory(node->key, node->val),
+			__ATOMIC_RELAXED);
+		drop_entry(self, node->key, node->val);
 	}
+	if(item->sweep == 0)
+		free(item->table);
+	return n;
+}
 
-	free(self->nodes);
-	self->invalid = true;
+// Hands a cleared table that no read section can see any more to the
+// writers to sweep. If sweeping cannot grow, it is swept right away
+static void queue_sweep(hashmap_t *self, map_retired_t *item)
+{
+	map_retired_t *items;
+	uint32_t cap;
+
+	pthread_mutex_lock(&(self->sweep_lock));
+	if(self->num_sweeping == self->sweeping_cap) {
+		cap = self->sweeping_cap ? self->sweeping_cap * 2 : MAP_SEGMENTS;
+		if((items = realloc(self->sweeping, sizeof(map_retired_t) * cap)) == NULL) {
+			pthread_mutex_unlock(&(self->sweep_lock));
+			sweep_table(self, item, item->sweep);
+			return;
+		}
+		self->sweeping = items;
+		self->sweeping_cap = cap;
+	}
+	self->sweeping[self->num_sweeping] = *item;
+	__atomic_store_n(&(self->num_sweeping), self->num_sweeping + 1,
+		__ATOMIC_RELAXED);
+	pthread_mutex_unlock(&(self->sweep_lock));
+}
 
-	pthread_mutex_unlock(&(self->write_lock));
-	return true;
+// Sweeps up to n slots of the cleared tables and returns how many it went
+// through. A thread that finds another one sweeping leaves it to that one
+static uint64_t sweep(hashmap_t *self, uint64_t n)
+{
+	map_retired_t *item;
+	uint64_t swept = 0;
+
+	if(__atomic_load_n(&(self->num_sweeping), __ATOMIC_RELAXED) == 0 ||
+		pthread_mutex_trylock(&(self->sweep_lock)))
+		return 0;
+	while(swept < n && self->num_sweeping > 0) {
+		item = self->sweeping + self->num_sweeping - 1;
+		swept += sweep_table(self, item, n - swept);
+		if(item->sweep == 0)
+			__atomic_store_n(&(self->num_sweeping), self->num_sweeping - 1,
+				__ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&(self->sweep_lock));
+	return swept;
+}
+
+static void destroy_retired(hashmap_t *self, map_retired_t *item)
+{
+	if(item->table != NULL && item->sweep > 0)
+		queue_sweep(self, item);
+	else if(item->table != NULL)
+		free(item->table);
+	else
+		drop_entry(self, item->key, item->val);
+}
+
+// Destroys everything retired so far once no read section can still see
+// it. Every list is taken at once, so one wait covers them all. The caller
+// holds reclaim_lock and is in no read section, as it would wait for itself
+static void reclaim_lists(hashmap_t *self)
+{
+	map_retired_t *items[MAP_READER_SLOTS];
+	uint32_t num[MAP_READER_SLOTS], cap[MAP_READER_SLOTS];
+	map_retire_list_t *list;
+
+	// tables retired from here on are left to the next round
+	__atomic_store_n(&(self->table_retired), false, __ATOMIC_RELAXED);
+
+	for(int i = 0; i < MAP_READER_SLOTS; i++) {
+		list = self->retire_lists+i;
+		pthread_mutex_lock(&(list->lock));
+		items[i] = list->items;
+		num[i] = list->num;
+		cap[i] = list->cap;
+		list->items = NULL;
+		list->num = list->cap = 0;
+		pthread_mutex_unlock(&(list->lock));
+		__atomic_sub_fetch(&(self->num_retired), num[i], __ATOMIC_RELAXED);
+	}
+
+	wait_for_readers(self);
+	for(int i = 0; i < MAP_READER_SLOTS; i++) {
+		for(uint32_t j = 0; j < num[i]; j++)
+			destroy_retired(self, items[i]+j);
+
+		// hand the array back, so retiring does not allocate under a
+		// segment's lock again, unless the list already has a new one
+		list = self->retire_lists+i;
+		pthread_mutex_lock(&(list->lock));
+		if(list->items == NULL) {
+			list->items = items[i];
+			list->cap = cap[i];
+			items[i] = NULL;
+		}
+		pthread_mutex_unlock(&(list->lock));
+		free(items[i]);
+	}
+}
+
+// Sweeps a step of the cleared tables, then reclaims what was retired once
+// the lists have filled a batch between them or taken a table. Only one
+// thread reclaims at a time, the others leave their entries to it or to
+// the next round, and so does a thread inside a read section
+static void reclaim(hashmap_t *self)
+{
+	sweep(self, MAP_SWEEP_STEP);
+	if(read_depth > 0 || (__atomic_load_n(&(self->num_retired),
+		__ATOMIC_RELAXED) < MAP_RETIRE_BATCH &&
+		!__atomic_load_n(&(self->table_retired), __ATOMIC_RELAXED)))
+		return;
+	if(pthread_mutex_trylock(&(self->reclaim_lock)))
+		return;
+	reclaim_lists(self);
+	pthread_mutex_unlock(&(self->reclaim_lock));
+}
 
+void map_retire(hashmap_t *self, map_key_t key, map_val_t val) {
+
+	if(self == NULL || key.key_base == NULL)
+		return;
+	// nothing reads an invalidated map any more
+	if(self->invalid) {
+		drop_entry(self, key, val);
+		return;
+	}
+	retire(self, key, val);
+	reclaim(self);
+}
+
+static bool valid_key(map_key_t key)
+{
+	return key.key_base != NULL && key.key_len != 0;
+}
+
+static bool valid_val(map_val_t val)
+{
+	return val.val_base != NULL && val.val_len != 0;
 }
 
+// Tag of a full node in the table, never 0. The low bits of the hash
+// already picked the segment and the home slot, so the tag only takes the
+// bits above those: the top seven, or however many are left once the
+// segments' tables add up to more than 2^25 slots
+static uint8_t hash_tag(hashmap_t *self, map_table_t *table, uint32_t hash)
+{
+	uint32_t used = self->segment_bits + __builtin_ctzll(table->capacity);
+
+	return ((uint64_t)hash >> (used > 25 ? used : 25)) | 0x80;
+}
 
+// Bit i of *match is set if the tag of the i-th node of the group starting
+// at pos is tag, bit i of *empty if that node is empty. Only the first
+// limit nodes of the group are looked at
+static void match_group(uint8_t *tags, uint64_t pos, uint8_t tag,
+	uint64_t limit, uint32_t *match, uint32_t *empty)
+{
+	uint32_t mask = limit < MAP_GROUP_SIZE ? (1u << limit) - 1 : 0xffff;
+
+#ifdef __SSE2__
+	// racing writers only make a lock-free get see a stale group, which it
+	// throws away once it sees seq changed
+	__m128i group = _mm_loadu_si128((__m128i *)(tags + pos));
+	*match = _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+	*empty = _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_setzero_si128()));
+#else
+	uint8_t t;
+
+	*match = *empty = 0;
+	for(int i = 0; i < MAP_GROUP_SIZE; i++) {
+		t = __atomic_load_n(tags + pos + i, __ATOMIC_RELAXED);
+		*match |= (uint32_t)(t == tag) << i;
+		*empty |= (uint32_t)(t == 0) << i;
+	}
+#endif
+	*match &= mask;
+	*empty &= mask;
+	// the key cannot be past an empty node
+	if(*empty)
+		*match &= (*empty & -*empty) - 1;
+}
 
+// Copies what a lock-free lookup looks at out of a node, which a writer may
+// be changing meanwhile. Returns false if one did, which the copy may then
+// be torn by
+static bool snapshot_node(map_segment_t *seg, unsigned int seq,
+	map_node_t *node, size_t key_len, map_node_t *copy)
+{
+	copy->key.key_base = __atomic_load_n(&(node->key.key_base), __ATOMIC_RELAXED);
+	copy->key.key_len = __atomic_load_n(&(node->key.key_len), __ATOMIC_RELAXED);
+	copy->val.val_base = __atomic_load_n(&(node->val.val_base), __ATOMIC_RELAXED);
+	copy->val.val_len = __atomic_load_n(&(node->val.val_len), __ATOMIC_RELAXED);
+	copy->dist = __atomic_load_n(&(node->dist), __ATOMIC_RELAXED);
+	copy->hash = __atomic_load_n(&(node->hash), __ATOMIC_RELAXED);
+	memcpy(copy->key_inline, node->key_inline, inline_len(key_len));
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&(seg->seq), __ATOMIC_RELAXED) == seq;
+}
 
+// Looks a key up in one table of a segment, without any lock if the table is
+// a snapshot validated against seq, which is the number the segment's seq
+// had when it was taken. Returns 1 and copies the entry to *found if the key
+// is there, 0 if it is not, and -1 if a writer got in and the lookup has to
+// start over
+static int probe_lockfree(hashmap_t *self, map_segment_t *seg, unsigned int seq,
+	map_table_t *table, uint32_t hash, map_key_t key, map_node_t *found)
+{
+	uint64_t capacity = table->capacity, pos;
+	uint64_t index = home_index(self, table, hash);
+	uint32_t match, empty, i;
+	uint8_t tag = hash_tag(self, table, hash);
+	map_node_t copy;
+
+	for(uint64_t probed = 0; probed < capacity; probed += MAP_GROUP_SIZE) {
+		pos = slot_after(table, index, probed);
+		match_group(table->tags, pos, tag, capacity - probed, &match, &empty);
+		for(; match; match &= match - 1) {
+			i = __builtin_ctz(match);
+			if(!snapshot_node(seg, seq, table->nodes+slot_after(table, pos, i),
+				key.key_len, &copy))
+				return -1;
+
+			if(copy.dist < probed + i)
+				return 0;
+			if(copy.hash == hash && node_key_equals(copy.key_inline, copy.key, key)) {
+				*found = copy;
+				return 1;
+			}
+		}
 
+		// an empty tag only ends the probe if it was not just being written
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&(seg->seq), __ATOMIC_RELAXED) != seq)
+			return -1;
+		if(empty)
+			break;
+	}
+	return 0;
+}
 
+// probe_lockfree() for a cuckoo table, which only has to look at two buckets
+static int probe_cuckoo_lockfree(hashmap_t *self, map_segment_t *seg,
+	unsigned int seq, map_table_t *table, uint32_t hash, map_key_t key,
+	map_node_t *found)
+{
+	uint64_t buckets[2] = {first_bucket(self, table, hash),
+		second_bucket(self, table, hash)}, slot;
+	uint8_t tag = hash_tag(self, table, hash);
+	map_node_t copy;
+
+	for(int b = 0; b < 2; b++) {
+		for(int i = 0; i < MAP_BUCKET_SIZE; i++) {
+			slot = buckets[b] * MAP_BUCKET_SIZE + i;
+			if(__atomic_load_n(table->tags + slot, __ATOMIC_RELAXED) != tag)
+				continue;
+			if(!snapshot_node(seg, seq, table->nodes+slot, key.key_len, &copy))
+				return -1;
+			if(copy.hash == hash && node_key_equals(copy.key_inline, copy.key, key)) {
+				*found = copy;
+				return 1;
+			}
+		}
+	}
 
+	// a key moving to its other bucket may have been missed
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&(seg->seq), __ATOMIC_RELAXED) != seq)
+		return -1;
+	return 0;
+}
 
+// Looks a key up without taking any lock, starting over whenever a writer
+// changed the segment meanwhile. Tags and nodes are only trusted once the
+// segment is known to be unchanged since they were read. Called inside a
+// read section, which keeps every key seen in the segment, and the tables
+// themselves, from being freed. Returns a copy of the entry, with null
+// pointers if the key is not there
+static map_node_t find_lockfree(hashmap_t *self, map_segment_t *seg,
+	uint32_t hash, map_key_t key)
+{
+	unsigned int seq, spins = 0;
+	uint64_t seed, old_seed;
+	uint32_t table_hash, old_hash;
+	map_table_t table, old;
+	map_node_t node = MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+	int found;
+
+	retry:
+	// a writer is in, let it finish
+	while((seq = __atomic_load_n(&(seg->seq), __ATOMIC_ACQUIRE)) & 1) {
+		if(++spins % 64 == 0)
+			sched_yield();
+	}
+	table.nodes = __atomic_load_n(&(seg->table.nodes), __ATOMIC_RELAXED);
+	table.tags = __atomic_load_n(&(seg->table.tags), __ATOMIC_RELAXED);
+	table.capacity = __atomic_load_n(&(seg->table.capacity), __ATOMIC_RELAXED);
+	old.nodes = __atomic_load_n(&(seg->old.nodes), __ATOMIC_RELAXED);
+	old.tags = __atomic_load_n(&(seg->old.tags), __ATOMIC_RELAXED);
+	old.capacity = __atomic_load_n(&(seg->old.capacity), __ATOMIC_RELAXED);
+	seed = __atomic_load_n(&(seg->seed), __ATOMIC_RELAXED);
+	old_seed = __atomic_load_n(&(seg->old_seed), __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&(seg->seq), __ATOMIC_RELAXED) != seq)
+		goto retry;
+
+	table_hash = seeded_hash(self, key, hash, seed);
+	if(self->cuckoo)
+		found = probe_cuckoo_lockfree(self, seg, seq, &table, table_hash, key,
+			&node);
+	else
+		found = probe_lockfree(self, seg, seq, &table, table_hash, key, &node);
+	if(found == 0 && old.nodes != NULL) {
+		old_hash = old_seed == seed ? table_hash :
+			seeded_hash(self, key, hash, old_seed);
+		if(self->cuckoo)
+			found = probe_cuckoo_lockfree(self, seg, seq, &old, old_hash, key,
+				&node);
+		else
+			found = probe_lockfree(self, seg, seq, &old, old_hash, key, &node);
+	}
+	if(found < 0)
+		goto retry;
+	return node;
+}
 
+// find_lockfree() for a key hashed by map_hash()
+static map_node_t get_lockfree(hashmap_t *self, map_key_t key, map_hash_t hash)
+{
+	return find_lockfree(self, segment_of(self, hash.hash), hash.hash, key);
+}
 
+// The following helpers expect the caller to hold the segment's lock
 
+static void set_tag(map_table_t *table, uint64_t i, uint8_t tag)
+{
+	// the copies past the end, a small table has more than one
+	for(uint64_t j = i; j < table->capacity + MAP_GROUP_SIZE - 1; j += table->capacity)
+		__atomic_store_n(table->tags + j, tag, __ATOMIC_RELAXED);
+}
 
+static map_node_t *bucket_find(hashmap_t *self, map_table_t *table,
+	uint64_t bucket, uint32_t hash, map_key_t key)
+{
+	uint8_t tag = hash_tag(self, table, hash);
+	map_node_t *node;
 
+	for(uint64_t i = bucket * MAP_BUCKET_SIZE;
+		i < (bucket + 1) * MAP_BUCKET_SIZE; i++) {
+		node = table->nodes+i;
+		if(table->tags[i] == tag && node->hash == hash &&
+			node_key_equals(node->key_inline, node->key, key))
+			return node;
+	}
+	return NULL;
+}
 
+// A key at distance i from its home cannot be behind an empty node or a
+// node closer to its own home than i, so the probe stops at the first one
+static map_node_t *table_find(hashmap_t *self, map_table_t *table,
+	uint32_t hash, map_key_t key)
+{
+	uint64_t index = home_index(self, table, hash), pos;
+	uint32_t match, empty, i;
+	uint8_t tag = hash_tag(self, table, hash);
+	map_node_t *node;
 
+	if(self->cuckoo) {
+		if((node = bucket_find(self, table, first_bucket(self, table, hash), hash,
+			key)) == NULL)
+			node = bucket_find(self, table, second_bucket(self, table, hash), hash,
+				key);
+		return node;
+	}
 
+	for(uint64_t probed = 0; probed < table->capacity; probed += MAP_GROUP_SIZE) {
+		pos = slot_after(table, index, probed);
+		match_group(table->tags, pos, tag, table->capacity - probed, &match, &empty);
+		for(; match; match &= match - 1) {
+			i = __builtin_ctz(match);
+			node = table->nodes+slot_after(table, pos, i);
+			if(node->dist < probed + i)
+				return NULL;
+			if(node->hash == hash &&
+				node_key_equals(node->key_inline, node->key, key)) {
+				debug("found");
+				return node;
+			}
+		}
+		if(empty)
+			break;
+	}
+	return NULL;
+}
 
+// Finds a key in either table of the segment. hash is the one that picked
+// the segment, table_hash the one under the segment's seed
+static map_node_t *find_node(hashmap_t *self, map_segment_t *seg,
+	uint32_t hash, uint32_t table_hash, map_key_t key)
+{
+	map_node_t *node = table_find(self, &(seg->table), table_hash, key);
 
+	if(node == NULL && seg->old.nodes != NULL)
+		node = table_find(self, &(seg->old), seg->old_seed == seg->seed ?
+			table_hash : seeded_hash(self, key, hash, seg->old_seed), key);
+	return node;
+}
 
+// A bucket reached by a cuckoo insert's search, by moving the entry in slot
+// of the bucket of step parent to it, or one of the key's own buckets if
+// parent is -1
+typedef struct cuckoo_step_t {
+	uint64_t bucket;
+	int parent;
+	uint32_t slot;
+	uint32_t depth;
+} cuckoo_step_t;
+
+// Whether a step's bucket is already on the path that leads to it, which
+// would move one entry twice
+static bool on_path(cuckoo_step_t *steps, int step, uint64_t bucket)
+{
+	for(; step >= 0; step = steps[step].parent) {
+		if(steps[step].bucket == bucket)
+			return true;
+	}
+	return false;
+}
 
+// Whether every entry of a full bucket has the given hash
+static bool same_hash(map_table_t *table, uint64_t bucket, uint32_t hash)
+{
+	for(int i = 0; i < MAP_BUCKET_SIZE; i++) {
+		if(table->nodes[bucket * MAP_BUCKET_SIZE + i].hash != hash)
+			return false;
+	}
+	return true;
+}
 
+// Searches breadth first from the entry's buckets for the shortest path to
+// a free node and moves the entries on it one step along, back to front,
+// which frees a node of one of the entry's buckets. Returns the number of
+// entries moved, or MAP_NO_ROOM or MAP_COLLIDED if there is no such path
+static uint32_t cuckoo_insert(hashmap_t *self, map_table_t *table,
+	map_node_t entry)
+{
+	cuckoo_step_t steps[MAP_CUCKOO_SEARCH];
+	uint64_t bucket, slot, from;
+	int head, tail = 0, step, i;
+	bool cut = false;
+
+	entry.dist = 0;
+	steps[tail++] = (cuckoo_step_t) {first_bucket(self, table, entry.hash), -1, 0, 0};
+	steps[tail++] = (cuckoo_step_t) {second_bucket(self, table, entry.hash), -1, 0, 0};
+	for(head = 0; head < tail; head++) {
+		bucket = steps[head].bucket;
+		for(i = 0; i < MAP_BUCKET_SIZE; i++) {
+			if(table->nodes[bucket * MAP_BUCKET_SIZE + i].key.key_base == NULL)
+				goto cuckoo_insert_found;
+		}
+		if(steps[head].depth == MAP_CUCKOO_MAX_PATH) {
+			cut = true;
+			continue;
+		}
+		for(i = 0; i < MAP_BUCKET_SIZE; i++) {
+			slot = other_bucket(self, table,
+				table->nodes[bucket * MAP_BUCKET_SIZE + i].hash, bucket);
+			if(on_path(steps, head, slot))
+				continue;
+			if(tail == MAP_CUCKOO_SEARCH)
+				cut = true;
+			else
+				steps[tail++] = (cuckoo_step_t) {slot, head, i,
+					steps[head].depth + 1};
+		}
+	}
+	// in a table the search can cover, keys fill every bucket they reach
+	// long before the table is full, which a bigger one spreads them out
+	// of. Keys of the same hash stay together in any table
+	if(cut || (table->capacity / MAP_BUCKET_SIZE <= MAP_CUCKOO_SEARCH &&
+		!same_hash(table, steps[0].bucket, entry.hash)))
+		return MAP_NO_ROOM;
+	return MAP_COLLIDED;
+
+	cuckoo_insert_found:
+	slot = bucket * MAP_BUCKET_SIZE + i;
+	for(step = head; steps[step].parent >= 0; step = steps[step].parent) {
+		from = steps[steps[step].parent].bucket * MAP_BUCKET_SIZE +
+			steps[step].slot;
+		table->nodes[slot] = table->nodes[from];
+		set_tag(table, slot, hash_tag(self, table, table->nodes[slot].hash));
+		slot = from;
+	}
+	table->nodes[slot] = entry;
+	set_tag(table, slot, hash_tag(self, table, entry.hash));
+	table->size++;
+	return steps[head].depth;
+}
+
+// Walks from the entry's home, handing each slot to the entry that is
+// further from its own home and carrying on with the one it displaced. The
+// table must have an empty node. Returns the longest distance from home
+// any of the entries was placed at, or for a cuckoo table what
+// cuckoo_insert() returns
+static uint32_t insert_node(hashmap_t *self, map_table_t *table,
+	map_node_t entry)
+{
+	map_node_t *node, tmp;
+	uint32_t longest = 0;
+
+	if(self->cuckoo)
+		return cuckoo_insert(self, table, entry);
+
+	entry.dist = 0;
+	for(uint64_t i = home_index(self, table, entry.hash); ;
+		i = slot_after(table, i, 1), entry.dist++) {
+		node = table->nodes+i;
+		if(node->key.key_base == NULL) {
+			*node = entry;
+			set_tag(table, i, hash_tag(self, table, entry.hash));
+			break;
+		}
+		if(node->dist < entry.dist) {
+			if(entry.dist > longest)
+				longest = entry.dist;
+			tmp = *node;
+			*node = entry;
+			set_tag(table, i, hash_tag(self, table, entry.hash));
+			entry = tmp;
+		}
+	}
+	table->size++;
+	return entry.dist > longest ? entry.dist : longest;
+}
+
+// Takes the entry out of node i and shifts the entries after it, up to the
+// next empty node or entry already in its home slot, one slot back. Nothing
+// moves in a cuckoo table
+static map_node_t remove_node(hashmap_t *self, map_table_t *table, uint64_t i)
+{
+	map_node_t ret = table->nodes[i], *next;
+	uint64_t j;
+
+	ret.dist = 0;
+	while(!self->cuckoo) {
+		j = slot_after(table, i, 1);
+		next = table->nodes+j;
+		if(next->key.key_base == NULL || next->dist == 0)
+			break;
+		table->nodes[i] = *next;
+		table->nodes[i].dist--;
+		set_tag(table, i, hash_tag(self, table, next->hash));
+		i = j;
+	}
+	bzero(table->nodes+i, sizeof(map_node_t));
+	set_tag(table, i, 0);
+	table->size--;
+	return ret;
+}
+
+// Takes the entry out of a table that is being migrated out of, leaving a
+// tombstone so that no entry moves
+static map_node_t remove_old_node(map_table_t *table, uint64_t i)
+{
+	map_node_t ret = table->nodes[i];
+
+	bzero(table->nodes+i, sizeof(map_node_t));
+	table->nodes[i].tombstone = true;
+	set_tag(table, i, MAP_TAG_DELETED);
+	table->size--;
+	ret.dist = 0;
+	return ret;
+}
+
+// Fills an empty table with n entries, starting over in one twice the size
+// if a cuckoo table has no room for one of them. Keys that collide in it
+// would collide in any size, so then it gives up
+static bool fill_table(hashmap_t *self, map_table_t *table, map_node_t *entries,
+	uint64_t n)
+{
+	uint64_t capacity = table->capacity;
+	uint32_t dist;
+
+	for(uint64_t i = 0; i < n; ) {
+		if((dist = insert_node(self, table, entries[i])) < MAP_NO_ROOM) {
+			i++;
+			continue;
+		}
+		free(table->nodes);
+		table->nodes = NULL;
+		if(dist == MAP_COLLIDED || !alloc_table(table, capacity *= 2))
+			return false;
+		i = 0;
+	}
+	return true;
+}
+
+// Moves the entries of a cuckoo table that a migration is going into, and
+// so cannot start one of its own, to a table twice the size at once
+static bool grow_table(hashmap_t *self, map_segment_t *seg)
+{
+	map_table_t table;
+	map_node_t *entries;
+	uint64_t n = 0;
+
+	if((entries = malloc(sizeof(map_node_t) * (seg->table.size + 1))) == NULL)
+		return false;
+	for(uint64_t i = 0; i < seg->table.capacity; i++) {
+		if(seg->table.nodes[i].key.key_base != NULL)
+			entries[n++] = seg->table.nodes[i];
+	}
+	if(!alloc_table(&table, seg->table.capacity * 2) ||
+		!fill_table(self, &table, entries, n)) {
+		free(entries);
+		return false;
+	}
+	free(entries);
+	retire_table(self, &(seg->table));
+	seg->table = table;
+	return true;
+}
+
+// Moves up to n slots of the old table over, and retires it once it has
+// been moved completely. Entries of a reseed are hashed again on the way.
+// The new table grows if it is a cuckoo table with no room for an entry.
+// One that keys collide in, which only a flood makes happen, leaves the
+// entry where it is and stalls the migration there until a reseed spreads
+// them out, see reseed_segment()
+static void migrate(hashmap_t *self, map_segment_t *seg, uint64_t n)
+{
+	map_node_t *node, entry;
+	uint32_t dist;
+
+	for(; n > 0 && seg->old.nodes != NULL; n--) {
+		node = seg->old.nodes + seg->migrated;
+		if(node->key.key_base != NULL) {
+			entry = *node;
+			if(seg->old_seed != seg->seed)
+				entry.hash = hash_key(self, entry.key, seg->seed);
+			while((dist = insert_node(self, &(seg->table), entry)) == MAP_NO_ROOM &&
+				grow_table(self, seg))
+				;
+			if(dist >= MAP_NO_ROOM) {
+				if(self->keyed_hash_function != NULL)
+					seg->reseed_pending = true;
+				seg->stalled = true;
+				return;
+			}
+			seg->stalled = false;
+			remove_old_node(&(seg->old), seg->migrated);
+		}
+
+		if(++seg->migrated == seg->old.capacity) {
+			retire_table(self, &(seg->old));
+			bzero(&(seg->old), sizeof(map_table_t));
+			seg->migrated = 0;
+		}
+	}
+}
+
+// Starts moving the segment to a table of the given size. The old table is
+// kept if the new one cannot be allocated, and so is the current one while
+// a migration is still going on, which only ever moves MAP_MIGRATE_STEP
+// slots per write
+static bool resize(hashmap_t *self, map_segment_t *seg, uint64_t capacity)
+{
+	map_table_t table;
+
+	if(seg->old.nodes != NULL || !alloc_table(&table, capacity))
+		return false;
+	seg->old = seg->table;
+	seg->old_seed = seg->seed;
+	seg->table = table;
+	seg->migrated = 0;
+	return true;
+}
+
+static uint64_t segment_size(map_segment_t *seg)
+{
+	return seg->table.size + seg->old.size;
+}
+
+// Whether the table has to grow before it takes one more entry
+static bool too_full(hashmap_t *self, map_segment_t *seg)
+{
+	return (uint64_t)(segment_size(seg) + 1) * 100 >
+		(uint64_t)seg->table.capacity * self->max_load_percent;
+}
+
+// Takes a node found by find_node out of whichever table it is in
+static map_node_t take_node(hashmap_t *self, map_segment_t *seg,
+	map_node_t *node)
+{
+	map_node_t ret;
+
+	if(node >= seg->table.nodes && node < seg->table.nodes + seg->table.capacity)
+		ret = remove_node(self, &(seg->table), node - seg->table.nodes);
+	else
+		ret = remove_old_node(&(seg->old), node - seg->old.nodes);
+	seg->memory -= entry_memory(ret.key, ret.val);
+	return ret;
+}
+
+// Evicts the first entry from the key's home slot on. While a migration is
+// going on that is in the old table, whose entries not moved yet all lie
+// at or after migrated and are packed closer than those of the new one.
+// The segment must not be empty
+static void evict(hashmap_t *self, map_segment_t *seg, uint32_t hash)
+{
+	map_table_t *table = &(seg->table);
+	uint64_t index, from = 0;
+	map_node_t evicted;
+
+	if(seg->old.size > 0) {
+		table = &(seg->old);
+		from = seg->migrated;
+	}
+	if((index = home_index(self, table, hash)) < from)
+		index = from;
+	while(table->nodes[index].key.key_base == NULL)
+		index = index + 1 == table->capacity ? from : index + 1;
+	evicted = take_node(self, seg, table->nodes+index);
+	retire(self, evicted.key, evicted.val);
+}
+
+// Whether the segment would be over one of its limits if an entry of cost
+// bytes came in for one of freed bytes, or for none if freed is 0, with
+// unswept bytes of cleared entries counted against its budget as well
+static bool over_limit(map_segment_t *seg, size_t cost, size_t freed,
+	size_t unswept)
+{
+	// an entry bigger than the segment's share of the budget only goes
+	// in once it would be the segment's only one
+	size_t limit = cost > seg->max_memory ? cost : seg->max_memory;
+
+	return (freed == 0 && segment_size(seg) >= seg->max_size) ||
+		(seg->max_memory != 0 && seg->memory + unswept - freed + cost > limit);
+}
+
+// The segment's part of the bytes cleared entries count until they are
+// swept, split evenly like the budget
+static size_t unswept_share(hashmap_t *self)
+{
+	return __atomic_load_n(&(self->unswept), __ATOMIC_RELAXED) /
+		self->num_segments;
+}
+
+// Whether a long probe asked for a reseed of the segment and enough has
+// been inserted into it since the last one to pay for it
+static bool reseed_due(map_segment_t *seg)
+{
+	return seg->reseed_pending && seg->inserts >= segment_size(seg);
+}
+
+// Moves the entries of both tables to a table hashed with a new seed at
+// once, for a migration that cannot go on, or that a forced reseed cannot
+// wait for. Only this one segment is held up meanwhile
+static bool rebuild_segment(hashmap_t *self, map_segment_t *seg, uint64_t seed)
+{
+	uint64_t n = 0, capacity = MAP_TABLE_MIN_CAPACITY;
+	map_table_t *tables[2] = {&(seg->table), &(seg->old)};
+	map_node_t *entries;
+	map_table_t table;
+
+	if((entries = malloc(sizeof(map_node_t) * (segment_size(seg) + 1))) == NULL)
+		return false;
+	for(int t = 0; t < 2; t++) {
+		for(uint64_t i = 0; i < tables[t]->capacity; i++) {
+			if(tables[t]->nodes[i].key.key_base == NULL)
+				continue;
+			entries[n] = tables[t]->nodes[i];
+			entries[n].hash = hash_key(self, entries[n].key, seed);
+			n++;
+		}
+	}
+
+	// as big as too_full() lets the entries be
+	while((n + 1) * 100 > capacity * self->max_load_percent)
+		capacity *= 2;
+	if(!alloc_table(&table, capacity) || !fill_table(self, &table, entries, n)) {
+		free(entries);
+		return false;
+	}
+	free(entries);
+
+	// lock-free gets still reading the old tables see seq change
+	retire_table(self, &(seg->table));
+	retire_table(self, &(seg->old));
+	bzero(&(seg->old), sizeof(map_table_t));
+	seg->table = table;
+	seg->migrated = 0;
+	seg->stalled = false;
+	seg->seed = seg->old_seed = seed;
+	return true;
+}
+
+// Moves the segment to a new seed, unless forced only if reseed_due().
+// The current table becomes the old one of a migration to a table hashed
+// with the new seed, which moves MAP_MIGRATE_STEP slots per write like
+// any other. One still going on is waited for, or if it has stalled, or
+// the reseed is forced, the segment is rebuilt at once
+static bool reseed_segment(hashmap_t *self, map_segment_t *seg, bool force)
+{
+	uint64_t seed;
+
+	if(!force && !reseed_due(seg))
+		return false;
+	do
+		seed = random_seed();
+	while(seed == self->seed);
+
+	if(seg->old.nodes != NULL) {
+		if(!(force || seg->stalled) || !rebuild_segment(self, seg, seed))
+			return false;
+	}
+	else {
+		if(!resize(self, seg, too_full(self, seg) ? seg->table.capacity * 2 :
+			seg->table.capacity))
+			return false;
+		seg->seed = seed;
+	}
+	seg->inserts = 0;
+	seg->reseed_pending = false;
+	__atomic_add_fetch(&(self->reseeds), 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+// Places an entry that no path led into the cuckoo table. On MAP_NO_ROOM
+// the table grows, and the new one holds nothing else yet, unless the
+// table is being migrated into, see grow_table(). A bigger table
+// does not help keys that collide, so then the segment is reseeded if one
+// is due, and otherwise the entry in the key's first node is evicted if
+// forced
+static bool cuckoo_make_room(hashmap_t *self, map_segment_t *seg,
+	map_node_t entry, uint32_t dist, bool force)
+{
+	map_node_t removed;
+
+	if(dist == MAP_NO_ROOM && (seg->old.nodes != NULL ? grow_table(self, seg) :
+		resize(self, seg, seg->table.capacity * 2)))
+		return insert_node(self, &(seg->table), entry) < MAP_NO_ROOM;
+	if(reseed_segment(self, seg, false)) {
+		entry.hash = hash_key(self, entry.key, seg->seed);
+		return insert_node(self, &(seg->table), entry) < MAP_NO_ROOM;
+	}
+	if(!force)
+		return false;
+	removed = take_node(self, seg, seg->table.nodes +
+		first_bucket(self, &(seg->table), entry.hash) * MAP_BUCKET_SIZE);
+	retire(self, removed.key, removed.val);
+	return insert_node(self, &(seg->table), entry) < MAP_NO_ROOM;
+}
+
+static bool put_locked(hashmap_t *self, map_segment_t *seg, uint32_t hash,
+	map_key_t key, map_val_t val, bool force)
+{
+	size_t cost = entry_memory(key, val), freed = 0;
+	map_node_t *node, entry, removed;
+	uint32_t dist, table_hash;
+
+	migrate(self, seg, MAP_MIGRATE_STEP);
+	if(self->max_memory != 0 && cost > self->max_memory) {
+		errno = ENOMEM;
+		return false;
+	}
+
+	table_hash = seeded_hash(self, key, hash, seg->seed);
+	if((node = find_node(self, seg, hash, table_hash, key)) != NULL)
+		freed = entry_memory(node->key, node->val);
+	// cleared entries are swept to make room before any entry is evicted,
+	// even though that destroys them under the segment's lock
+	while(over_limit(seg, cost, freed, unswept_share(self)) &&
+		sweep(self, MAP_SWEEP_STEP) > 0)
+		;
+	if(over_limit(seg, cost, freed, unswept_share(self))) {
+		if(!force) {
+			errno = ENOMEM;
+			return false;
+		}
+		// the entry being replaced goes first, then the map's usual victims
+		if(node != NULL) {
+			removed = take_node(self, seg, node);
+			retire(self, removed.key, removed.val);
+			node = NULL;
+		}
+		// the segment's own entries are all it can evict, so if another
+		// thread is still sweeping, the map stays over until it is done
+		while(over_limit(seg, cost, 0, 0))
+			evict(self, seg, table_hash);
+	}
+
+	if(node != NULL) {
+		retire(self, node->key, node->val);
+		node->key = key;
+		node->val = val;
+		seg->memory += cost - freed;
+		return true;
+	}
+
+	// without a bigger table the entry still fits as long as one node is
+	// empty, just with longer probes
+	if(too_full(self, seg) && !resize(self, seg, seg->table.capacity * 2) &&
+		seg->table.size == seg->table.capacity) {
+		errno = ENOMEM;
+		return false;
+	}
+
+	entry = MAP_NODE(key, val, false);
+	entry.hash = table_hash;
+	memcpy(entry.key_inline, key.key_base, inline_len(key.key_len));
+	// a full cuckoo table is no sign of a flood
+	if((dist = insert_node(self, &(seg->table), entry)) > MAP_PROBE_LIMIT &&
+		dist != MAP_NO_ROOM) {
+		__atomic_add_fetch(&(self->long_probes), 1, __ATOMIC_RELAXED);
+		if(self->keyed_hash_function != NULL)
+			seg->reseed_pending = true;
+	}
+	if(dist >= MAP_NO_ROOM && !cuckoo_make_room(self, seg, entry, dist, force)) {
+		errno = ENOMEM;
+		return false;
+	}
+	seg->memory += cost;
+	seg->inserts++;
+	// a long probe asks for a reseed that is not due yet only once
+	if(seg->reseed_pending && !reseed_segment(self, seg, false) &&
+		!reseed_due(seg))
+		seg->reseed_pending = false;
+	return true;
+}
+
+static map_node_t delete_locked(hashmap_t *self, map_segment_t *seg,
+	uint32_t hash, map_key_t key)
+{
+	map_node_t *node, ret;
+
+	migrate(self, seg, MAP_MIGRATE_STEP);
+	if((node = find_node(self, seg, hash, seeded_hash(self, key, hash, seg->seed),
+		key)) == NULL) {
+		debug("not found: %i", *(int *)key.key_base);
+		return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+	}
+	ret = take_node(self, seg, node);
+
+	// give the memory back once the segment has emptied out
+	if(seg->old.nodes == NULL && seg->table.capacity > MAP_TABLE_MIN_CAPACITY &&
+		(uint64_t)seg->table.size * 100 <
+		(uint64_t)seg->table.capacity * MAP_MIN_LOAD_PERCENT)
+		resize(self, seg, seg->table.capacity / 2);
+	return ret;
+}
+
+bool map_reseed(hashmap_t *self) {
+	bool ret = true;
+
+	if(self == NULL || self->invalid || self->keyed_hash_function == NULL) {
+		errno = EINVAL;
+		return false;
+	}
+
+	// one segment at a time, the others go on meanwhile
+	for(uint32_t i = 0; i < self->num_segments; i++) {
+		if(!lock_write(self, self->segments+i))
+			return false;
+		ret = reseed_segment(self, self->segments+i, true) && ret;
+		unlock_write(self->segments+i);
+	}
+	reclaim(self);
+	return ret;
+}
+
+// What a batch call does to each of its keys
+typedef enum batch_op_t { BATCH_PUT, BATCH_GET, BATCH_PIN, BATCH_DELETE } batch_op_t;
+
+typedef struct batch_t {
+	batch_op_t op;
+	map_key_t *keys;
+	map_val_t *vals;
+	bool *done;
+	map_node_t *nodes;               // entries removed or pinned
+	bool force;
+} batch_t;
+
+static bool reads_only(batch_t *batch)
+{
+	return batch->op == BATCH_GET || batch->op == BATCH_PIN;
+}
+
+static bool batch_valid(batch_t *batch, size_t i)
+{
+	return valid_key(batch->keys[i]) &&
+		(batch->op != BATCH_PUT || valid_val(batch->vals[i]));
+}
+
+static void batch_apply(hashmap_t *self, map_segment_t *seg, batch_t *batch,
+	size_t i, uint32_t hash)
+{
+	map_node_t *node;
+
+	switch(batch->op) {
+		case BATCH_PUT:
+			batch->done[i] = put_locked(self, seg, hash, batch->keys[i],
+				batch->vals[i], batch->force);
+			break;
+		case BATCH_GET:
+			if((node = find_node(self, seg, hash, seeded_hash(self, batch->keys[i],
+				hash, seg->seed), batch->keys[i])) != NULL)
+				batch->vals[i] = MAP_VAL(node->val.val_base, node->val.val_len);
+			break;
+		case BATCH_PIN:
+			if((node = find_node(self, seg, hash, seeded_hash(self, batch->keys[i],
+				hash, seg->seed), batch->keys[i])) != NULL)
+				batch->nodes[i] = pin_entry(self, node);
+			break;
+		case BATCH_DELETE:
+			batch->nodes[i] = delete_locked(self, seg, hash, batch->keys[i]);
+			break;
+	}
+}
+
+// Runs a batch one segment at a time, so every segment holding some of the
+// keys is locked once per BATCH_CHUNK keys. Keys that share a segment are
+// handled in the order they were given, which keeps repeated keys right
+static bool run_batch(hashmap_t *self, batch_t *batch, size_t n)
+{
+	uint32_t hashes[BATCH_CHUNK];
+	bool pending[BATCH_CHUNK];
+	map_segment_t *seg;
+	size_t len;
+	bool locked;
+
+	// results for keys that are never reached
+	for(size_t i = 0; i < n; i++) {
+		if(batch->op == BATCH_PUT)
+			batch->done[i] = false;
+		else if(batch->op == BATCH_GET)
+			batch->vals[i] = MAP_VAL(NULL, 0);
+		else
+			batch->nodes[i] = MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+	}
+
+	for(size_t base = 0; base < n; base += BATCH_CHUNK) {
+		len = n - base < BATCH_CHUNK ? n - base : BATCH_CHUNK;
+		for(size_t i = 0; i < len; i++) {
+			if((pending[i] = batch_valid(batch, base+i)))
+				hashes[i] = hash_key(self, batch->keys[base+i], self->seed);
+		}
+
+		for(size_t i = 0; i < len; i++) {
+			if(!pending[i])
+				continue;
+			seg = segment_of(self, hashes[i]);
+			locked = reads_only(batch) ? lock_read(self, seg) :
+				lock_write(self, seg);
+			if(!locked)
+				return false;
+
+			for(size_t j = i; j < len; j++) {
+				if(pending[j] && segment_of(self, hashes[j]) == seg) {
+					batch_apply(self, seg, batch, base+j, hashes[j]);
+					pending[j] = false;
+				}
+			}
+
+			if(reads_only(batch))
+				unlock_read(seg);
+			else
+				unlock_write(seg);
+		}
+	}
+	return true;
+}
+
+map_hash_t map_hash(hashmap_t *self, map_key_t key) {
+
+	map_hash_t ret = {0, 0};
+
+	if(self == NULL || self->invalid || !valid_key(key))
+		return ret;
+	ret.seed = self->seed;
+	ret.hash = hash_key(self, key, ret.seed);
+	return ret;
+}
+
+bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
+
+	return put_hashed(self, key, val, map_hash(self, key), force);
+}
+
+bool put_hashed(hashmap_t *self, map_key_t key, map_val_t val,
+	map_hash_t hash, bool force) {
+
+    // check args
+    if(self == NULL || !valid_key(key) || !valid_val(val) || self->invalid) {
+    	errno = EINVAL;
+    	return false;
+    }
+
+    map_segment_t *seg;
+    bool ret;
+
+	if((seg = lock_key(self, hash, true)) == NULL)
+		return false;
+	ret = put_locked(self, seg, hash.hash, key, val, force);
+	unlock_write(seg);
+	reclaim(self);
+	return ret;
+}
+
+bool put_many(hashmap_t *self, map_key_t *keys, map_val_t *vals, bool *done,
+	size_t n, bool force) {
+
+	if(self == NULL || keys == NULL || vals == NULL || done == NULL ||
+		self->invalid) {
+		errno = EINVAL;
+		return false;
+	}
+
+	batch_t batch = {BATCH_PUT, keys, vals, done, NULL, force};
+	bool ret = run_batch(self, &batch, n);
+	reclaim(self);
+	return ret;
+}
+
+// get_hashed(), returning the whole entry and pinning it if pin is set
+static map_node_t lookup(hashmap_t *self, map_key_t key, map_hash_t hash,
+	bool pin)
+{
+	map_node_t ret = MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+	map_segment_t *seg;
+	map_node_t *node;
+
+	if(self->lockfree_get) {
+		int token = map_read_begin(self);
+		// recheck validity
+		if(!self->invalid)
+			ret = get_lockfree(self, key, hash);
+		if(pin && ret.key.key_base != NULL)
+			ret = pin_entry(self, &ret);
+		map_read_end(self, token);
+	}
+	else if((seg = lock_key(self, hash, false)) != NULL) {
+		if((node = find_node(self, seg, hash.hash,
+			seeded_hash(self, key, hash.hash, seg->seed), key)) != NULL)
+			ret = pin ? pin_entry(self, node) : MAP_NODE(node->key, node->val, false);
+		unlock_read(seg);
+	}
+	// reads sweep too, or a map only read from after a clear would keep
+	// the cleared entries
+	sweep(self, MAP_SWEEP_STEP);
+	return ret;
+}
+
+map_val_t get(hashmap_t *self, map_key_t key) {
+
+	return get_hashed(self, key, map_hash(self, key));
+}
+
+map_val_t get_hashed(hashmap_t *self, map_key_t key, map_hash_t hash) {
+
+	// check args
+	if(self == NULL || self->invalid || !valid_key(key)) {
+		errno = EINVAL;
+		return MAP_VAL(NULL, 0);
+	}
+
+	return lookup(self, key, hash, false).val;
+}
+
+map_node_t get_pinned(hashmap_t *self, map_key_t key, map_hash_t hash) {
+
+	// check args
+	if(self == NULL || self->invalid || self->refs_function == NULL ||
+		!valid_key(key)) {
+		errno = EINVAL;
+		return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+	}
+
+	return lookup(self, key, hash, true);
+}
+
+bool get_many(hashmap_t *self, map_key_t *keys, map_val_t *vals, size_t n) {
+
+	if(self == NULL || keys == NULL || vals == NULL || self->invalid) {
+		errno = EINVAL;
+		return false;
+	}
+
+	if(self->lockfree_get) {
+		int token = map_read_begin(self);
+		bool valid = !self->invalid;
+
+		for(size_t i = 0; i < n; i++) {
+			vals[i] = MAP_VAL(NULL, 0);
+			if(valid && valid_key(keys[i]))
+				vals[i] = get_lockfree(self, keys[i], map_hash(self, keys[i])).val;
+		}
+		map_read_end(self, token);
+		sweep(self, MAP_SWEEP_STEP);
+		return valid;
+	}
+
+	batch_t batch = {BATCH_GET, keys, vals, NULL, NULL, false};
+	bool ret = run_batch(self, &batch, n);
+	sweep(self, MAP_SWEEP_STEP);
+	return ret;
+}
+
+bool get_many_pinned(hashmap_t *self, map_key_t *keys, map_node_t *pins,
+	size_t n) {
+
+	if(self == NULL || keys == NULL || pins == NULL || self->invalid ||
+		self->refs_function == NULL) {
+		errno = EINVAL;
+		return false;
+	}
+
+	if(self->lockfree_get) {
+		int token = map_read_begin(self);
+		bool valid = !self->invalid;
+
+		for(size_t i = 0; i < n; i++) {
+			pins[i] = MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+			if(valid && valid_key(keys[i]))
+				pins[i] = get_lockfree(self, keys[i], map_hash(self, keys[i]));
+			if(pins[i].key.key_base != NULL)
+				pins[i] = pin_entry(self, pins+i);
+		}
+		map_read_end(self, token);
+		sweep(self, MAP_SWEEP_STEP);
+		return valid;
+	}
+
+	batch_t batch = {BATCH_PIN, keys, NULL, NULL, pins, false};
+	bool ret = run_batch(self, &batch, n);
+	sweep(self, MAP_SWEEP_STEP);
+	return ret;
+}
+
+void map_unpin(hashmap_t *self, map_node_t pin) {
+
+	if(self == NULL || self->refs_function == NULL || pin.key.key_base == NULL)
+		return;
+	if(__atomic_fetch_sub(self->refs_function(pin.key, pin.val), 1,
+		__ATOMIC_ACQ_REL) == 0)
+		self->destroy_function(pin.key, pin.val);
+}
+
+map_node_t delete(hashmap_t *self, map_key_t key) {
+
+	return delete_hashed(self, key, map_hash(self, key));
+}
+
+map_node_t delete_hashed(hashmap_t *self, map_key_t key, map_hash_t hash) {
+
+	if(self == NULL || !valid_key(key) || self->invalid) {
+		errno = EINVAL;
+		return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+	}
+
+	map_segment_t *seg;
+
+	if((seg = lock_key(self, hash, true)) == NULL)
+		return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+
+	map_node_t ret = delete_locked(self, seg, hash.hash, key);
+	unlock_write(seg);
+	// a delete may have finished a migration and retired the old table
+	reclaim(self);
+	return ret;
+}
+
+bool delete_many(hashmap_t *self, map_key_t *keys, map_node_t *removed,
+	size_t n) {
+
+	if(self == NULL || keys == NULL || removed == NULL || self->invalid) {
+		errno = EINVAL;
+		return false;
+	}
+
+	batch_t batch = {BATCH_DELETE, keys, NULL, NULL, removed, false};
+	bool ret = run_batch(self, &batch, n);
+	reclaim(self);
+	return ret;
+}
+
+// Retires a table along with the entries it still holds
+static void retire_cleared(hashmap_t *self, map_table_t *table)
+{
+	if(table->nodes == NULL)
+		return;
+	retire_item(self, (map_retired_t) {MAP_KEY(NULL, 0), MAP_VAL(NULL, 0),
+		table->nodes, table->size > 0 ? table->capacity : 0});
+	bzero(table, sizeof(map_table_t));
+}
+
+bool clear_map(hashmap_t *self) {
+
+	map_table_t *tables;
+	uint32_t i;
+
+	if(self == NULL || self->invalid) {
+		errno = EINVAL;
+		return false;
+	}
+
+	// the empty tables are ready before any segment is locked
+	if((tables = calloc(self->num_segments, sizeof(map_table_t))) == NULL)
+		return false;
+	for(i = 0; i < self->num_segments; i++) {
+		if(!alloc_table(tables+i, MAP_TABLE_MIN_CAPACITY))
+			goto clear_alloc_error;
+	}
+
+	if(!lock_all(self))
+		goto clear_alloc_error;
+
+	map_segment_t *seg;
+	for(i = 0; i < self->num_segments; i++) {
+		seg = self->segments+i;
+		retire_cleared(self, &(seg->old));
+		retire_cleared(self, &(seg->table));
+		seg->table = tables[i];
+		seg->migrated = 0;
+		seg->stalled = false;
+		// still counted until swept, see map_memory()
+		__atomic_add_fetch(&(self->unswept), seg->memory, __ATOMIC_RELAXED);
+		seg->memory = 0;
+	}
+
+	unlock_all(self);
+	free(tables);
+	// the old tables go to sweeping now, not once a batch is retired
+	if(read_depth == 0) {
+		pthread_mutex_lock(&(self->reclaim_lock));
+		reclaim_lists(self);
+		pthread_mutex_unlock(&(self->reclaim_lock));
+	}
+	reclaim(self);
+	return true;
+	clear_alloc_error:
+	for(i = 0; i < self->num_segments; i++)
+		free(tables[i].nodes);
+	free(tables);
+	return false;
+}
+
+// Destroys every entry of a table and frees it
+static void destroy_table(hashmap_t *self, map_table_t *table)
+{
+	map_node_t *node;
+
+	for(uint64_t i = 0; i < table->capacity; i++) {
+		node = table->nodes+i;
+		if(node->key.key_base != NULL)
+			drop_entry(self, node->key, node->val);
+	}
+	free(table->nodes);
+	bzero(table, sizeof(map_table_t));
+}
+
+bool invalidate_map(hashmap_t *self) {
+
+    if(self == NULL || self->invalid) {
+		errno = EINVAL;
+		return false;
+	}
+
+	if(!lock_all(self))
+		return false;
+	self->invalid = true;
+	unlock_all(self);
+
+	// writers and locked readers now fail, but lock-free readers and read
+	// sections may still be looking at the nodes
+	pthread_mutex_lock(&(self->reclaim_lock));
+	wait_for_readers(self);
+
+	for(uint32_t i = 0; i < self->num_segments; i++) {
+		destroy_table(self, &(self->segments[i].table));
+		destroy_table(self, &(self->segments[i].old));
+	}
+
+	for(int i = 0; i < MAP_READER_SLOTS; i++) {
+		map_retire_list_t *list = self->retire_lists+i;
+		pthread_mutex_lock(&(list->lock));
+		for(uint32_t j = 0; j < list->num; j++)
+			destroy_retired(self, list->items+j);
+		free(list->items);
+		list->items = NULL;
+		list->num = list->cap = 0;
+		pthread_mutex_unlock(&(list->lock));
+	}
+	self->num_retired = 0;
+	self->table_retired = false;
+
+	// what the lists held may have gone to sweeping too
+	while(self->num_sweeping > 0)
+		sweep(self, UINT64_MAX);
+	free(self->sweeping);
+	self->sweeping = NULL;
+	self->sweeping_cap = 0;
+
+	pthread_mutex_unlock(&(self->reclaim_lock));
+	return true;
+
+}
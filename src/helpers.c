@@ -10,14 +10,91 @@ int parse_command_to_int(const char *arg)
 	return -1;
 }
 
+size_t parse_command_to_size(const char *arg)
+{
+	char *end;
+	unsigned long long result;
+	int shift = 0;
+
+	if(*arg < '0' || *arg > '9')
+		return 0;
+	errno = 0;
+	result = strtoull(arg, &end, 10);
+	if(errno == ERANGE)
+		return 0;
+	switch(*end) {
+		case 'G': case 'g': shift += 10; // fall through
+		case 'M': case 'm': shift += 10; // fall through
+		case 'K': case 'k': shift += 10; end++; break;
+	}
+	// too big for a size_t once the suffix is applied
+	if(*end != 0 || result > SIZE_MAX >> shift)
+		return 0;
+	return result << shift;
+}
+
+
+// put_response stores the value in the same allocation as the key
+slab_t *g_slab;
+
+/*
+ * What goes in front of the key and value of an entry, in the same slab
+ * object. refs is the entry's pin count, see map_refs, and the sizes let a
+ * pin be released from the entry alone once its value has been sent.
+ */
+typedef struct entry_t {
+	int refs;
+	uint32_t key_size;
+	uint32_t val_size;
+	char data[];            // the key, then the value
+} entry_t;
+
+static entry_t *entry_of(map_key_t key)
+{
+	return (entry_t *)((char *)key.key_base - offsetof(entry_t, data));
+}
+
+// Copies a key and the value that follows it into a new entry. Returns
+// the copy of the key, or NULL if there is no memory for it
+static void *alloc_entry(void *key, uint32_t key_size, uint32_t val_size)
+{
+	entry_t *entry;
+
+	if((entry = slab_alloc(g_slab, sizeof(entry_t) + key_size + val_size)) == NULL)
+		return NULL;
+	entry->refs = 0;
+	entry->key_size = key_size;
+	entry->val_size = val_size;
+	// the value directly follows the key on the wire
+	memcpy(entry->data, key, key_size + val_size);
+	return entry->data;
+}
 
+// The header, key and value of an entry share one slab object, see
+// alloc_entry
 void map_destroyer(map_key_t key, map_val_t val)
 {
-	free(key.key_base);
-	free(val.val_base);
+	slab_free(g_slab, entry_of(key),
+		sizeof(entry_t) + key.key_len + val.val_len);
 }
 
-int open_listenfd(int port)
+int *map_refs(map_key_t key, map_val_t val)
+{
+	return &(entry_of(key)->refs);
+}
+
+// Releases the pin on an entry whose value conn has sent
+static void unpin_entry(void *map, void *arg)
+{
+	entry_t *entry = arg;
+
+	map_unpin(map, MAP_NODE(MAP_KEY(entry->data, entry->key_size),
+		MAP_VAL(entry->data + entry->key_size, entry->val_size), false));
+}
+
+// Opens a listening socket on port. With reuseport set, several sockets can
+// listen on the same port and the kernel balances connections across them
+int open_listenfd(int port, bool reuseport)
 {
 	int listenfd, optval=1;
     struct sockaddr_in serveraddr;
@@ -28,7 +105,11 @@ int open_listenfd(int port)
  
     if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, 
 		   (const void *)&optval , sizeof(int)) < 0)
-		return -1;
+		goto open_listenfd_err;
+
+    if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, 
+		   (const void *)&optval , sizeof(int)) < 0)
+		goto open_listenfd_err;
 
     bzero((char *) &serveraddr, sizeof(serveraddr));
     serveraddr.sin_family = AF_INET; 
@@ -36,14 +117,19 @@ int open_listenfd(int port)
     serveraddr.sin_port = htons((unsigned short)port); 
     if (bind(listenfd, (const struct sockaddr *)&serveraddr, 
     	sizeof(serveraddr)) < 0)
-		return -1;
+		goto open_listenfd_err;
 
     if (listen(listenfd, 1024) < 0)
-		return -1;
+		goto open_listenfd_err;
     return listenfd;
+
+    open_listenfd_err:
+    close(listenfd);
+    return -1;
 }
 
-// Wrapper for read. Will attempt to reread if EINTR is returned
+// Wrapper for read. Will attempt to reread if EINTR is returned. errno is
+// only left changed if the read failed
 int Read(int fd, void *buf, int nbytes)
 {
 	int ret;
@@ -55,12 +141,14 @@ int Read(int fd, void *buf, int nbytes)
 		errno = 0;
 		goto reread;
 	}
-	errno = olderrno;
+	if(ret >= 0)
+		errno = olderrno;
 	return ret;
 }
 
 // Wrapper for write. Will attempt to rewrite if EINTR is returned and will
-// return -2 if EPIPE is recieved
+// return -2 if EPIPE is recieved. errno is only left changed if the write
+// failed
 int Write(int fd, void *buf, int nbytes)
 {
 	int ret;
@@ -72,12 +160,114 @@ int Write(int fd, void *buf, int nbytes)
 		errno = 0;
 		goto rewrite;
 	}
-	if(errno == EPIPE)
+	if(ret >= 0)
+		errno = olderrno;
+	else if(errno == EPIPE)
 		ret = -2;
-	errno = olderrno;
 	return ret;
 }
 
+// Number of bytes a request occupies on the wire, header included, or -1 if
+// its sizes are out of range and it cannot be framed
+int request_frame_size(request_header_t hdr)
+{
+	int size = sizeof(request_header_t);
+
+	switch(hdr.request_code) {
+		case PUT:
+			if(hdr.value_size < MIN_VALUE_SIZE ||
+				hdr.value_size > MAX_VALUE_SIZE)
+				return -1;
+			size += hdr.value_size;
+			// fall through
+		case GET:
+		case EVICT:
+			if(hdr.key_size < MIN_KEY_SIZE || hdr.key_size > MAX_KEY_SIZE)
+				return -1;
+			return size + hdr.key_size;
+		case MPUT:
+		case MGET:
+		case MEVICT:
+			// the entries are checked by the handler, since the frame
+			// can be skipped once its size is known
+			if(hdr.key_size < 1 || hdr.key_size > MAX_BATCH_KEYS ||
+				hdr.value_size > MAX_BATCH_SIZE)
+				return -1;
+			return size + hdr.value_size;
+		default:
+			return size;
+	}
+}
+
+// Parses one request where it lies in the connection's input buffer and
+// answers it
+int serve_request(conn_t *conn, hashmap_t *g_map)
+{
+	request_t req;
+	int nbytes, size, key_end, ret;
+
+	if((nbytes = conn_frame(conn, sizeof(request_header_t))) <
+		(int)sizeof(request_header_t)) {
+		if(nbytes > 0)
+			invalid_request(conn, NULL, NULL);
+		else if(nbytes == -1)
+			bad_req_response(conn);
+		// nbytes == 0 is the client hanging up between requests
+		return -1;
+	}
+	memcpy(&req.hdr, conn->rbufptr, sizeof(request_header_t));
+
+	// sizes out of range leave nothing we could skip to
+	if((size = request_frame_size(req.hdr)) < 0) {
+		bad_req_response(conn);
+		return -1;
+	}
+
+	// a single key is hashed as soon as it is in, while a large value may
+	// still be on its way, and the handler passes the hash on to the map
+	if(req.hdr.request_code == PUT || req.hdr.request_code == GET ||
+		req.hdr.request_code == EVICT) {
+		key_end = sizeof(request_header_t) + req.hdr.key_size;
+		if(conn_frame(conn, key_end) < key_end) {
+			bad_req_response(conn);
+			return -1;
+		}
+		req.hash = map_hash(g_map, MAP_KEY(conn->rbufptr +
+			sizeof(request_header_t), req.hdr.key_size));
+	}
+	if(conn_frame(conn, size) < size) {
+		bad_req_response(conn);
+		return -1;
+	}
+	req.key = conn->rbufptr + sizeof(request_header_t);
+	req.val = req.key + req.hdr.key_size;
+
+	ret = (get_response_function(req.hdr))(conn, &req, g_map);
+	conn_consume(conn, size);
+	return ret;
+}
+
+// Answers every request that is completely buffered on a connection owned
+// by an event loop
+int serve_buffered(conn_t *conn, hashmap_t *g_map)
+{
+	request_header_t hdr;
+	int size;
+
+	while(conn->rcnt >= (int)sizeof(request_header_t)) {
+		memcpy(&hdr, conn->rbufptr, sizeof(request_header_t));
+		if((size = request_frame_size(hdr)) > conn->rcnt) {
+			// grows the input buffer if the frame would not fit
+			if(conn_frame(conn, size) < 0)
+				return -1;
+			break;
+		}
+		if(serve_request(conn, g_map) < 0)
+			return -1;
+	}
+	return 0;
+}
+
 resp_function get_response_function(request_header_t hdr) 
 {
 	switch(hdr.request_code) {
@@ -89,173 +279,254 @@ resp_function get_response_function(request_header_t hdr)
 			return evict_response;
 		case CLEAR:
 			return clear_response;
+		case MPUT:
+			return mput_response;
+		case MGET:
+			return mget_response;
+		case MEVICT:
+			return mevict_response;
 		default:
 			return invalid_request;
 	}
 }
 
-void put_response(int fd, int key_size, int val_size, hashmap_t *g_map) 
+// The key and value are copied out of the input buffer into one slab
+// object, which map_destroyer frees through the key
+int put_response(conn_t *conn, request_t *req, hashmap_t *g_map) 
 {
-	// check validity of key/value size
-	if(key_size < MIN_KEY_SIZE || key_size > MAX_KEY_SIZE || 
-		val_size < MIN_VALUE_SIZE || val_size > MAX_VALUE_SIZE) {
-		bad_req_response(fd);
-		return;
-	}
+	int key_size = req->hdr.key_size, val_size = req->hdr.value_size;
+	void *entry;
 
-	//malloc space for key/value
-	void *key, *value;
-	if((key = malloc(key_size)) == NULL) {
-		bad_req_response(fd);
-		return;
-	}
-	if((value = malloc(val_size)) == NULL) {
-		free(key);
-		bad_req_response(fd);
-		return;
-	}
-	int nbytes;
-
-	if((nbytes = Read(fd, key, key_size)) < key_size) 
-		goto put_response_err;
-	if((nbytes = Read(fd, value, val_size)) < val_size) 
-		goto put_response_err;
+	if((entry = alloc_entry(req->key, key_size, val_size)) == NULL)
+		return bad_req_response(conn);
 
-	map_key_t map_key = {key, key_size};
-	map_val_t map_val = {value, val_size};
+	map_key_t map_key = {entry, key_size};
+	map_val_t map_val = {entry + key_size, val_size};
 
-	if(!put(g_map, map_key, map_val, true))
-		goto put_response_err;
+	if(!put_hashed(g_map, map_key, map_val, req->hash, true)) {
+		map_destroyer(map_key, map_val);
+		return bad_req_response(conn);
+	}
 
 	response_header_t resp = {OK, 0};
-
-	Write(fd, &resp, sizeof(response_header_t)); // not sure if this needs to be err checked
-	return;
-
-	put_response_err:
-	free(key);
-	free(value);
-	bad_req_response(fd);
-	return;
+	if(conn_write(conn, &resp, sizeof(response_header_t)) < 0)
+		return -1;
+	return 0;
 }
 
-void get_response(int fd, int key_size, int val_size, hashmap_t *g_map)
+// The pin keeps the entry alive until its value has been sent or copied,
+// even if it is overwritten or evicted meanwhile, and unlike a read section
+// it holds nothing else back, so the value can wait on a slow client
+int get_response(conn_t *conn, request_t *req, hashmap_t *g_map)
 {
-	if(key_size < MIN_KEY_SIZE || key_size > MAX_KEY_SIZE) {
-		bad_req_response(fd);
-		return;
-	}
-	void *key, *buf;
-	if((key = malloc(key_size)) == NULL) {
-		bad_req_response(fd);
-		return;
-	}
-	int nbytes;
+	map_key_t map_key = {req->key, req->hdr.key_size};
+	map_node_t pin = get_pinned(g_map, map_key, req->hash);
 
-	if((nbytes = Read(fd, key, key_size)) < key_size)
-		goto get_response_err;
-
-	map_key_t map_key = {key, key_size};
-	map_val_t map_val = get(g_map, map_key);
-	if(map_val.val_base == NULL) {
+	if(pin.key.key_base == NULL) {
 		response_header_t resp = {NOT_FOUND, 0};
-		Write(fd, &resp, sizeof(response_header_t));
-		free(key);
-		return;
+		if(conn_stage(conn, &resp, sizeof(response_header_t)) < 0)
+			return -1;
+		return 0;
 	}
 
-	if((buf = malloc(map_val.val_len + sizeof(response_header_t))) == NULL)
-		goto get_response_err;
+	// the value goes out from map memory, without a staging copy
+	response_header_t resp = {OK, pin.val.val_len};
+	return conn_write_value(conn, &resp, sizeof(response_header_t),
+		pin.val.val_base, pin.val.val_len, unpin_entry, g_map,
+		entry_of(pin.key));
+}
 
-	(*(response_header_t *)buf).response_code = OK; 
-	(*(response_header_t *)buf).value_size = map_val.val_len;
-	memcpy(buf+sizeof(response_header_t), map_val.val_base, 
-		map_val.val_len);
+int clear_response(conn_t *conn, request_t *req, hashmap_t *g_map)
+{
+	if(!clear_map(g_map))
+		return bad_req_response(conn);
 
-	Write(fd, buf, map_val.val_len + sizeof(response_header_t));
-	free(key);
-	free(buf);
-	return;
+	response_header_t resp = {OK, 0};
+	if(conn_write(conn, &resp, sizeof(response_header_t)) < 0)
+		return -1;
+	return 0;
+}
 
-	get_response_err:
-	free(key);
-	bad_req_response(fd);
-	return;
+int evict_response(conn_t *conn, request_t *req, hashmap_t *g_map)
+{
+	map_key_t map_key = {req->key, req->hdr.key_size};
+	map_node_t removed = delete_hashed(g_map, map_key, req->hash);
+
+	// the removed entry is ours to free, once no GET is still sending it
+	if(removed.key.key_base != NULL)
+		map_retire(g_map, removed.key, removed.val);
+
+	response_header_t resp = {OK, 0};
+	if(conn_write(conn, &resp, sizeof(response_header_t)) < 0)
+		return -1;
+	return 0;
 }
 
-void clear_response(int fd, int key_size, int val_size, hashmap_t *g_map)
+// Splits the payload of a batch request into its keys and values, which
+// stay where they are in the input buffer. Returns the number of entries,
+// or -1 if they are out of range or do not add up to the payload
+static int batch_entries(request_t *req, map_key_t *keys, map_val_t *vals)
 {
-	if(!clear_map(g_map)) {
-		bad_req_response(fd);
+	char *pos = req->key, *end = pos + req->hdr.value_size;
+	int n = req->hdr.key_size;
+	batch_entry_t entry;
+
+	for(int i = 0; i < n; i++) {
+		if(end - pos < (long)sizeof(batch_entry_t))
+			return -1;
+		memcpy(&entry, pos, sizeof(batch_entry_t));
+		pos += sizeof(batch_entry_t);
+
+		if(entry.key_size < MIN_KEY_SIZE || entry.key_size > MAX_KEY_SIZE)
+			return -1;
+		if(req->hdr.request_code != MPUT && entry.value_size != 0)
+			return -1;
+		if(req->hdr.request_code == MPUT &&
+			(entry.value_size < MIN_VALUE_SIZE ||
+			entry.value_size > MAX_VALUE_SIZE))
+			return -1;
+		if(end - pos < (long)entry.key_size + entry.value_size)
+			return -1;
+
+		keys[i] = MAP_KEY(pos, entry.key_size);
+		vals[i] = MAP_VAL(pos + entry.key_size, entry.value_size);
+		pos += entry.key_size + entry.value_size;
 	}
-	else {
-		response_header_t resp = {OK, 0};
-		Write(fd, &resp, sizeof(response_header_t));
-	}
-	return;
+	return pos == end ? n : -1;
 }
 
-void evict_response(int fd, int key_size, int val_size, hashmap_t *g_map)
+// Every pair is copied into its own allocation like put_response does, and
+// all of them are inserted under one lock
+int mput_response(conn_t *conn, request_t *req, hashmap_t *g_map)
 {
-	if(key_size < MIN_KEY_SIZE || key_size > MAX_KEY_SIZE) {
-		bad_req_response(fd);
-		return;
+	map_key_t keys[MAX_BATCH_KEYS];
+	map_val_t vals[MAX_BATCH_KEYS];
+	bool done[MAX_BATCH_KEYS];
+	void *entry;
+	int n, i;
+
+	if((n = batch_entries(req, keys, vals)) < 0)
+		return bad_req_response(conn);
+
+	for(i = 0; i < n; i++) {
+		if((entry = alloc_entry(keys[i].key_base, keys[i].key_len,
+			vals[i].val_len)) == NULL)
+			goto mput_response_err;
+		keys[i].key_base = entry;
+		vals[i].val_base = entry + keys[i].key_len;
 	}
-	void *key;
-	if((key = malloc(key_size)) == NULL) {
-		bad_req_response(fd);
-		return;
+
+	// whatever was inserted belongs to the map, even if put_many failed
+	// partway through
+	bool ok = put_many(g_map, keys, vals, done, n, true);
+	for(i = 0; i < n; i++) {
+		if(!done[i])
+			map_destroyer(keys[i], vals[i]);
 	}
-	int nbytes;
+	if(!ok)
+		return bad_req_response(conn);
 
-	if((nbytes = Read(fd, key, key_size)) < key_size) {
-		free(key);
-		bad_req_response(fd);
-		return;
+	response_header_t resp = {OK, n * sizeof(response_header_t)};
+	if(conn_write(conn, &resp, sizeof(response_header_t)) < 0)
+		return -1;
+	for(i = 0; i < n; i++) {
+		resp.response_code = done[i] ? OK : BAD_REQUEST;
+		resp.value_size = 0;
+		if(conn_write(conn, &resp, sizeof(response_header_t)) < 0)
+			return -1;
 	}
+	return 0;
 
-	map_key_t map_key = {key, key_size};
-	delete(g_map, map_key);
+	mput_response_err:
+	while(--i >= 0)
+		map_destroyer(keys[i], vals[i]);
+	return bad_req_response(conn);
+}
 
-	response_header_t resp = {OK, 0};
-	Write(fd, &resp, sizeof(response_header_t));
+// All keys are looked up and pinned under one lock, then the values go out
+// from map memory like they do for GET
+int mget_response(conn_t *conn, request_t *req, hashmap_t *g_map)
+{
+	map_key_t keys[MAX_BATCH_KEYS];
+	map_val_t vals[MAX_BATCH_KEYS];
+	map_node_t pins[MAX_BATCH_KEYS];
+	uint32_t size = 0;
+	int n, i, ret;
+
+	if((n = batch_entries(req, keys, vals)) < 0)
+		return bad_req_response(conn);
+
+	if(!get_many_pinned(g_map, keys, pins, n))
+		return bad_req_response(conn);
+
+	for(i = 0; i < n; i++)
+		size += sizeof(response_header_t) + pins[i].val.val_len;
+	response_header_t resp = {OK, size};
+	ret = conn_stage(conn, &resp, sizeof(response_header_t)) < 0 ? -1 : 0;
+
+	for(i = 0; i < n && ret == 0; i++) {
+		if(pins[i].key.key_base == NULL) {
+			resp.response_code = NOT_FOUND;
+			resp.value_size = 0;
+			if(conn_stage(conn, &resp, sizeof(response_header_t)) < 0)
+				ret = -1;
+			continue;
+		}
+		resp.response_code = OK;
+		resp.value_size = pins[i].val.val_len;
+		ret = conn_write_value(conn, &resp, sizeof(response_header_t),
+			pins[i].val.val_base, pins[i].val.val_len, unpin_entry, g_map,
+			entry_of(pins[i].key));
+	}
+	// the values that were never handed to conn
+	for(; i < n; i++)
+		map_unpin(g_map, pins[i]);
+	return ret;
+}
 
-	free(key);
-	return;
+int mevict_response(conn_t *conn, request_t *req, hashmap_t *g_map)
+{
+	map_key_t keys[MAX_BATCH_KEYS];
+	map_val_t vals[MAX_BATCH_KEYS];
+	map_node_t removed[MAX_BATCH_KEYS];
+	int n;
+
+	if((n = batch_entries(req, keys, vals)) < 0 ||
+		!delete_many(g_map, keys, removed, n))
+		return bad_req_response(conn);
+
+	// the removed entries are ours to free, once no GET is still sending them
+	for(int i = 0; i < n; i++) {
+		if(removed[i].key.key_base != NULL)
+			map_retire(g_map, removed[i].key, removed[i].val);
+	}
+
+	response_header_t resp = {OK, n * sizeof(response_header_t)};
+	if(conn_write(conn, &resp, sizeof(response_header_t)) < 0)
+		return -1;
+	resp.value_size = 0;
+	for(int i = 0; i < n; i++) {
+		if(conn_write(conn, &resp, sizeof(response_header_t)) < 0)
+			return -1;
+	}
+	return 0;
 }
 
-void invalid_request(int fd, int key_size, int val_size, hashmap_t *g_map)
+// The key and value of an unknown request cannot be skipped reliably, so
+// the connection is dropped after answering
+int invalid_request(conn_t *conn, request_t *req, hashmap_t *g_map)
 {
 	response_header_t resp = {UNSUPPORTED, 0};
-	Write(fd, &resp, sizeof(response_header_t));
-	return;
+	conn_write(conn, &resp, sizeof(response_header_t));
+	return -1;
 }
 
-void bad_req_response(int fd)
+// Answers BAD_REQUEST. The connection stays usable if the response could
+// be queued
+int bad_req_response(conn_t *conn)
 {
 	response_header_t resp = {BAD_REQUEST, 0};
-	Write(fd, &resp, sizeof(response_header_t));
-	return;
+	if(conn_write(conn, &resp, sizeof(response_header_t)) < 0)
+		return -1;
+	return 0;
 }
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+#include "reactor.h"
+#include "fcntl.h"
+#include "sys/epoll.h"
+
+static int set_nonblocking(int fd)
+{
+	int flags;
+
+	if((flags = fcntl(fd, F_GETFL, 0)) < 0)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void close_conn(conn_t *conn)
+{
+	close(conn->fd); // also drops it from the epoll set
+	conn_destroy(conn);
+	free(conn);
+}
+
+// Sends pending output and picks the events to wait for next. A connection
+// with unsent responses is not read from until they are out, so a client
+// that never reads cannot make us buffer without bound
+static int update_conn(reactor_t *reactor, conn_t *conn)
+{
+	struct epoll_event ev;
+	int pending;
+
+	if((pending = conn_flush(conn)) < 0)
+		return -1;
+	ev.events = pending ? EPOLLOUT : EPOLLIN;
+	if(ev.events == conn->events)
+		return 0;
+	ev.data.ptr = conn;
+	conn->events = ev.events;
+	return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+static void accept_conns(reactor_t *reactor)
+{
+	struct epoll_event ev;
+	conn_t *conn;
+	int conn_fd;
+
+	while((conn_fd = accept4(reactor->listen_fd, NULL, NULL,
+		SOCK_NONBLOCK)) >= 0) {
+		if((conn = malloc(sizeof(conn_t))) == NULL) {
+			close(conn_fd);
+			continue;
+		}
+		if(conn_init(conn, conn_fd, CONN_POLLED) < 0) {
+			free(conn);
+			close(conn_fd);
+			continue;
+		}
+		conn->events = ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+		if(epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, conn_fd, &ev) < 0)
+			close_conn(conn);
+	}
+}
+
+static void *reactor_loop(void *arg)
+{
+	reactor_t *reactor = arg;
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	conn_t *conn;
+	int nevents, nbytes;
+
+	while(1) {
+		if((nevents = epoll_wait(reactor->epoll_fd, events,
+			REACTOR_MAX_EVENTS, -1)) < 0) {
+			if(errno == EINTR)
+				continue;
+			return NULL;
+		}
+
+		for(int i = 0; i < nevents; i++) {
+			if((conn = events[i].data.ptr) == NULL) {
+				accept_conns(reactor);
+				continue;
+			}
+
+			if(events[i].events & EPOLLIN) {
+				nbytes = conn_recv(conn);
+				if(nbytes == -1 || serve_buffered(conn, reactor->map) < 0) {
+					conn_flush(conn); // best effort, for the error response
+					close_conn(conn);
+					continue;
+				}
+				if(nbytes == 0) { // EOF, answer what was sent and hang up
+					conn_flush(conn);
+					close_conn(conn);
+					continue;
+				}
+			}
+			else if(events[i].events & (EPOLLERR | EPOLLHUP)) {
+				close_conn(conn);
+				continue;
+			}
+
+			if(update_conn(reactor, conn) < 0)
+				close_conn(conn);
+		}
+	}
+}
+
+int run_reactors(int *listen_fds, int num_listeners, int num_loops,
+	hashmap_t *map)
+{
+	reactor_t *reactors;
+	struct epoll_event ev;
+
+	for(int i = 0; i < num_listeners; i++) {
+		if(set_nonblocking(listen_fds[i]) < 0)
+			return -1;
+	}
+	if((reactors = calloc(num_loops, sizeof(reactor_t))) == NULL)
+		return -1;
+
+	for(int i = 0; i < num_loops; i++) {
+		reactors[i].listen_fd = listen_fds[i % num_listeners];
+		reactors[i].map = map;
+		if((reactors[i].epoll_fd = epoll_create1(0)) < 0)
+			return -1;
+
+		// wake only one loop per incoming connection on a shared listener
+		ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+		ev.data.ptr = NULL;
+		if(epoll_ctl(reactors[i].epoll_fd, EPOLL_CTL_ADD,
+			reactors[i].listen_fd, &ev) < 0)
+			return -1;
+		if(pthread_create(&reactors[i].thread, NULL, reactor_loop,
+			&reactors[i]))
+			return -1;
+	}
+
+	// the loops never exit unless epoll itself breaks
+	for(int i = 0; i < num_loops; i++)
+		pthread_join(reactors[i].thread, NULL);
+	free(reactors);
+	return -1;
+}
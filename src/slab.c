@@ -0,0 +1,403 @@
+#include "slab.h"
+#include "errno.h"
+#include "string.h"
+#include "strings.h"
+
+#define PAGE_OF(ptr) ((slab_page_t *)((uintptr_t)(ptr) & \
+	~(uintptr_t)(SLAB_PAGE_SIZE - 1)))
+
+static void cache_exit(void *arg);
+
+slab_t *slab_create(void) {
+
+	slab_t *slab;
+	slab_class_t *cls;
+	uint32_t size = SLAB_MIN_SIZE, c = 0;
+
+	if((slab = aligned_alloc(64, sizeof(slab_t))) == NULL)
+		return NULL;
+	bzero(slab, sizeof(slab_t));
+
+	// every class about a quarter bigger than the one before, in steps of
+	// SLAB_MIN_SIZE so that objects stay aligned
+	while(1) {
+		cls = slab->classes+c;
+		cls->size = size;
+		cls->per_page = (SLAB_PAGE_SIZE - sizeof(slab_page_t)) / size;
+		if(pthread_mutex_init(&(cls->lock), NULL))
+			goto slab_create_error;
+		c++;
+		if(size == SLAB_MAX_SIZE || c == SLAB_CLASSES)
+			break;
+		size = (size + size / 4 + SLAB_MIN_SIZE - 1) / SLAB_MIN_SIZE *
+			SLAB_MIN_SIZE;
+		if(size > SLAB_MAX_SIZE || c == SLAB_CLASSES - 1)
+			size = SLAB_MAX_SIZE;
+	}
+	slab->num_classes = c;
+
+	c = 0;
+	for(uint32_t i = 0; i <= SLAB_MAX_SIZE / SLAB_MIN_SIZE; i++) {
+		while(slab->classes[c].size < i * SLAB_MIN_SIZE)
+			c++;
+		slab->class_of[i] = c;
+	}
+
+	if(pthread_mutex_init(&(slab->pages_lock), NULL) ||
+		pthread_mutex_init(&(slab->caches_lock), NULL) ||
+		pthread_key_create(&(slab->cache_key), cache_exit))
+		goto slab_create_error;
+	return slab;
+
+	slab_create_error:
+	free(slab);
+	return NULL;
+}
+
+static uint32_t class_index(slab_t *self, size_t size)
+{
+	return self->class_of[(size + SLAB_MIN_SIZE - 1) / SLAB_MIN_SIZE];
+}
+
+static void list_push(slab_page_t **list, slab_page_t *page)
+{
+	page->prev = NULL;
+	page->next = *list;
+	if(*list != NULL)
+		(*list)->prev = page;
+	*list = page;
+}
+
+static void list_remove(slab_page_t **list, slab_page_t *page)
+{
+	if(page->prev != NULL)
+		page->prev->next = page->next;
+	else
+		*list = page->next;
+	if(page->next != NULL)
+		page->next->prev = page->prev;
+}
+
+// The following helpers expect the caller to hold the class's lock
+
+// Gives the class an empty page, preferably one another class let go of
+static slab_page_t *new_page(slab_t *self, uint32_t c)
+{
+	slab_class_t *cls = self->classes+c;
+	slab_page_t *page;
+
+	pthread_mutex_lock(&(self->pages_lock));
+	if((page = self->empty) != NULL) {
+		list_remove(&(self->empty), page);
+		self->num_empty--;
+	}
+	pthread_mutex_unlock(&(self->pages_lock));
+
+	if(page == NULL &&
+		(page = aligned_alloc(SLAB_PAGE_SIZE, SLAB_PAGE_SIZE)) == NULL)
+		return NULL;
+
+	page->free = NULL;
+	page->unused = (char *)page + sizeof(slab_page_t);
+	page->used = 0;
+	page->size_class = c;
+	list_push(&(cls->partial), page);
+	cls->pages++;
+	return page;
+}
+
+static void release_page(slab_t *self, slab_page_t *page)
+{
+	pthread_mutex_lock(&(self->pages_lock));
+	if(self->num_empty < SLAB_EMPTY_PAGES) {
+		list_push(&(self->empty), page);
+		self->num_empty++;
+		page = NULL;
+	}
+	pthread_mutex_unlock(&(self->pages_lock));
+	free(page);
+}
+
+// Hands out an object of a page on the class's partial list
+static void *take(slab_class_t *cls, slab_page_t *page)
+{
+	void *obj;
+
+	if((obj = page->free) != NULL)
+		page->free = *(void **)obj;
+	else {
+		obj = page->unused;
+		page->unused += cls->size;
+	}
+
+	page->used++;
+	cls->used++;
+	if(page->used == cls->per_page) {
+		list_remove(&(cls->partial), page);
+		list_push(&(cls->full), page);
+	}
+	return obj;
+}
+
+static void give_back(slab_t *self, slab_class_t *cls, void *obj)
+{
+	slab_page_t *page = PAGE_OF(obj);
+
+	*(void **)obj = page->free;
+	page->free = obj;
+
+	if(page->used == cls->per_page) {
+		list_remove(&(cls->full), page);
+		list_push(&(cls->partial), page);
+	}
+	page->used--;
+	cls->used--;
+	if(page->used == 0) {
+		list_remove(&(cls->partial), page);
+		cls->pages--;
+		release_page(self, page);
+	}
+}
+
+// Fills half of an empty magazine from the class's pages
+static uint32_t refill(slab_t *self, uint32_t c, slab_magazine_t *mag)
+{
+	slab_class_t *cls = self->classes+c;
+	slab_page_t *page;
+
+	pthread_mutex_lock(&(cls->lock));
+	while(mag->count < SLAB_MAGAZINE_SIZE / 2) {
+		if((page = cls->partial) == NULL && (page = new_page(self, c)) == NULL)
+			break;
+		mag->objects[mag->count++] = take(cls, page);
+	}
+	pthread_mutex_unlock(&(cls->lock));
+	return mag->count;
+}
+
+// Gives the n objects that have been in the magazine longest back to their
+// pages, keeping the recently freed ones that are likely still cached
+static void flush(slab_t *self, uint32_t c, slab_magazine_t *mag, uint32_t n)
+{
+	slab_class_t *cls = self->classes+c;
+
+	if(n > mag->count)
+		n = mag->count;
+	pthread_mutex_lock(&(cls->lock));
+	for(uint32_t i = 0; i < n; i++)
+		give_back(self, cls, mag->objects[i]);
+	pthread_mutex_unlock(&(cls->lock));
+
+	mag->count -= n;
+	memmove(mag->objects, mag->objects + n, sizeof(void *) * mag->count);
+}
+
+static slab_cache_t *thread_cache(slab_t *self)
+{
+	slab_cache_t *cache;
+
+	if((cache = pthread_getspecific(self->cache_key)) != NULL)
+		return cache;
+
+	if((cache = calloc(1, sizeof(slab_cache_t))) == NULL)
+		return NULL;
+	cache->slab = self;
+	if(pthread_setspecific(self->cache_key, cache)) {
+		free(cache);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&(self->caches_lock));
+	cache->next = self->caches;
+	self->caches = cache;
+	pthread_mutex_unlock(&(self->caches_lock));
+	return cache;
+}
+
+// Only the owning thread writes its counters, slab_stats reads them
+static void count_live(slab_cache_t *cache, uint32_t c, int64_t n, size_t size)
+{
+	__atomic_store_n(cache->live+c, cache->live[c] + n, __ATOMIC_RELAXED);
+	__atomic_store_n(cache->requested+c, cache->requested[c] + n * (int64_t)size,
+		__ATOMIC_RELAXED);
+}
+
+// A thread that exits gives its magazines back and leaves its counters to
+// the allocator
+static void cache_exit(void *arg)
+{
+	slab_cache_t *cache = arg, **prev;
+	slab_t *self = cache->slab;
+
+	for(uint32_t c = 0; c < self->num_classes; c++)
+		flush(self, c, cache->magazines+c, SLAB_MAGAZINE_SIZE);
+
+	pthread_mutex_lock(&(self->caches_lock));
+	for(uint32_t c = 0; c < self->num_classes; c++) {
+		self->live[c] += cache->live[c];
+		self->requested[c] += cache->requested[c];
+	}
+	for(prev = &(self->caches); *prev != cache; prev = &((*prev)->next))
+		;
+	*prev = cache->next;
+	pthread_mutex_unlock(&(self->caches_lock));
+	free(cache);
+}
+
+void *slab_alloc(slab_t *self, size_t size) {
+
+	slab_cache_t *cache;
+	slab_magazine_t *mag;
+	uint32_t c;
+
+	if(self == NULL || size == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if(size > SLAB_MAX_SIZE)
+		return malloc(size);
+
+	c = class_index(self, size);
+	if((cache = thread_cache(self)) == NULL)
+		return NULL;
+	mag = cache->magazines+c;
+	if(mag->count == 0 && refill(self, c, mag) == 0) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	count_live(cache, c, 1, size);
+	return mag->objects[--mag->count];
+}
+
+void slab_free(slab_t *self, void *ptr, size_t size) {
+
+	slab_cache_t *cache;
+	slab_magazine_t *mag;
+	uint32_t c;
+
+	if(self == NULL || ptr == NULL)
+		return;
+	if(size > SLAB_MAX_SIZE) {
+		free(ptr);
+		return;
+	}
+
+	c = class_index(self, size);
+	// without a cache of its own the thread goes straight to the page
+	if((cache = thread_cache(self)) == NULL) {
+		pthread_mutex_lock(&(self->classes[c].lock));
+		give_back(self, self->classes+c, ptr);
+		pthread_mutex_unlock(&(self->classes[c].lock));
+
+		pthread_mutex_lock(&(self->caches_lock));
+		self->live[c]--;
+		self->requested[c] -= size;
+		pthread_mutex_unlock(&(self->caches_lock));
+		return;
+	}
+
+	mag = cache->magazines+c;
+	if(mag->count == SLAB_MAGAZINE_SIZE)
+		flush(self, c, mag, SLAB_MAGAZINE_SIZE / 2);
+	mag->objects[mag->count++] = ptr;
+	count_live(cache, c, -1, size);
+}
+
+bool slab_stats(slab_t *self, uint32_t size_class, slab_stats_t *stats) {
+
+	slab_class_t *cls;
+	slab_cache_t *cache;
+	int64_t live, requested;
+
+	if(self == NULL || stats == NULL || size_class >= self->num_classes) {
+		errno = EINVAL;
+		return false;
+	}
+	cls = self->classes+size_class;
+
+	pthread_mutex_lock(&(cls->lock));
+	stats->size = cls->size;
+	stats->pages = cls->pages;
+	stats->objects = cls->pages * cls->per_page;
+	stats->used = cls->used;
+	pthread_mutex_unlock(&(cls->lock));
+
+	pthread_mutex_lock(&(self->caches_lock));
+	live = self->live[size_class];
+	requested = self->requested[size_class];
+	for(cache = self->caches; cache != NULL; cache = cache->next) {
+		live += __atomic_load_n(cache->live+size_class, __ATOMIC_RELAXED);
+		requested += __atomic_load_n(cache->requested+size_class,
+			__ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&(self->caches_lock));
+
+	// the threads' counters are read one after the other, so an object
+	// that moved between them meanwhile can make the sums a little off
+	stats->live = live > 0 ? live : 0;
+	stats->requested = requested > 0 ? requested : 0;
+	return true;
+}
+
+void slab_print_stats(slab_t *self, FILE *out) {
+
+	slab_stats_t stats;
+	uint64_t pages = 0, requested = 0;
+
+	fprintf(out, "%8s %8s %10s %10s %10s %14s %6s\n", "size", "pages",
+		"objects", "used", "live", "requested", "util");
+	for(uint32_t c = 0; c < self->num_classes; c++) {
+		if(!slab_stats(self, c, &stats) || stats.pages == 0)
+			continue;
+		// how much of the memory the class holds was asked for
+		fprintf(out, "%8u %8lu %10lu %10lu %10lu %14lu %5.1f%%\n", stats.size,
+			stats.pages, stats.objects, stats.used, stats.live,
+			stats.requested,
+			stats.requested * 100.0 / (stats.pages * SLAB_PAGE_SIZE));
+		pages += stats.pages;
+		requested += stats.requested;
+	}
+
+	pthread_mutex_lock(&(self->pages_lock));
+	fprintf(out, "%8s %8lu %10s %10s %10s %14lu %5.1f%%   %u empty pages\n",
+		"total", pages, "", "", "", requested,
+		pages ? requested * 100.0 / (pages * SLAB_PAGE_SIZE) : 0.0,
+		self->num_empty);
+	pthread_mutex_unlock(&(self->pages_lock));
+}
+
+static void free_pages(slab_page_t *page)
+{
+	slab_page_t *next;
+
+	for(; page != NULL; page = next) {
+		next = page->next;
+		free(page);
+	}
+}
+
+void slab_destroy(slab_t *self) {
+
+	slab_cache_t *cache, *next;
+
+	if(self == NULL)
+		return;
+
+	// the key may be handed out again, without this thread's stale cache
+	pthread_setspecific(self->cache_key, NULL);
+	pthread_key_delete(self->cache_key);
+	for(cache = self->caches; cache != NULL; cache = next) {
+		next = cache->next;
+		free(cache);
+	}
+	for(uint32_t c = 0; c < self->num_classes; c++) {
+		free_pages(self->classes[c].partial);
+		free_pages(self->classes[c].full);
+		pthread_mutex_destroy(&(self->classes[c].lock));
+	}
+	free_pages(self->empty);
+	pthread_mutex_destroy(&(self->pages_lock));
+	pthread_mutex_destroy(&(self->caches_lock));
+	free(self);
+}
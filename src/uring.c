@@ -0,0 +1,381 @@
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include "linux/io_uring.h"
+#include "sys/mman.h"
+#include "sys/syscall.h"
+
+// What a completion belongs to, kept in the low bits of its user_data. The
+// rest is the connection, which is at least 8 byte aligned
+#define URING_ACCEPT 0
+#define URING_RECV 1
+#define URING_SEND 2
+#define URING_OP_MASK 3
+
+// Pieces of output, from wbuf and values in the map, handed to one send
+#define URING_SEND_IOV 16
+
+typedef struct uring_t {
+	int ring_fd;
+	unsigned sq_entries;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sqe_tail;      // next sqe to hand out, published on submit
+	unsigned to_submit;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	bool multishot_accept;
+	int listen_fd;
+	hashmap_t *map;
+	pthread_t thread;
+} uring_t;
+
+// A connection has at most one receive or send in flight, which keeps its
+// buffers, and msg and iov, still while the kernel uses them
+typedef struct uring_conn_t {
+	conn_t conn;
+	bool closing;           // close once the pending output is sent
+	struct msghdr msg;
+	struct iovec iov[URING_SEND_IOV];
+} uring_conn_t;
+
+static int uring_setup(uring_t *ring, unsigned entries)
+{
+	struct io_uring_params params;
+	size_t sq_size, cq_size;
+	void *sq_ptr = MAP_FAILED, *cq_ptr = MAP_FAILED;
+
+	bzero(&params, sizeof(params));
+	if((ring->ring_fd = syscall(__NR_io_uring_setup, entries, &params)) < 0)
+		return -1;
+
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		if(cq_size > sq_size)
+			sq_size = cq_size;
+		cq_size = sq_size;
+	}
+
+	if((sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+		IORING_OFF_SQ_RING)) == MAP_FAILED)
+		goto uring_setup_err;
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+		cq_ptr = sq_ptr;
+	else if((cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+		IORING_OFF_CQ_RING)) == MAP_FAILED)
+		goto uring_setup_err;
+	if((ring->sqes = mmap(NULL,
+		params.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+		IORING_OFF_SQES)) == MAP_FAILED)
+		goto uring_setup_err;
+
+	ring->sq_entries = params.sq_entries;
+	ring->sq_head = sq_ptr + params.sq_off.head;
+	ring->sq_tail = sq_ptr + params.sq_off.tail;
+	ring->sq_mask = sq_ptr + params.sq_off.ring_mask;
+	ring->sq_array = sq_ptr + params.sq_off.array;
+	ring->sqe_tail = *ring->sq_tail;
+	ring->to_submit = 0;
+	ring->cq_head = cq_ptr + params.cq_off.head;
+	ring->cq_tail = cq_ptr + params.cq_off.tail;
+	ring->cq_mask = cq_ptr + params.cq_off.ring_mask;
+	ring->cqes = cq_ptr + params.cq_off.cqes;
+	ring->multishot_accept = true;
+	return 0;
+
+	uring_setup_err:
+	if(cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+		munmap(cq_ptr, cq_size);
+	if(sq_ptr != MAP_FAILED)
+		munmap(sq_ptr, sq_size);
+	close(ring->ring_fd);
+	return -1;
+}
+
+// Submits everything queued so far and, if wait_nr is set, waits for that
+// many completions in the same system call
+static int uring_enter(uring_t *ring, unsigned wait_nr)
+{
+	int ret;
+
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	if((ret = syscall(__NR_io_uring_enter, ring->ring_fd, ring->to_submit,
+		wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) < 0)
+		return -1;
+	ring->to_submit -= ret;
+	return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(uring_t *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned index;
+
+	if(ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+		ring->sq_entries) {
+		// full, hand what we have to the kernel without waiting
+		if(uring_enter(ring, 0) < 0 || ring->sqe_tail -
+			__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+			ring->sq_entries)
+			return NULL;
+	}
+
+	index = ring->sqe_tail & *ring->sq_mask;
+	ring->sq_array[index] = index;
+	sqe = ring->sqes + index;
+	bzero(sqe, sizeof(struct io_uring_sqe));
+	ring->sqe_tail++;
+	ring->to_submit++;
+	return sqe;
+}
+
+static int prep_accept(uring_t *ring)
+{
+	struct io_uring_sqe *sqe;
+
+	if((sqe = uring_get_sqe(ring)) == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = ring->listen_fd;
+	if(ring->multishot_accept)
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = URING_ACCEPT;
+	return 0;
+}
+
+static int prep_recv(uring_t *ring, uring_conn_t *uconn)
+{
+	struct io_uring_sqe *sqe;
+	int space;
+
+	if((space = conn_compact(&uconn->conn)) == 0 ||
+		(sqe = uring_get_sqe(ring)) == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = uconn->conn.fd;
+	sqe->addr = (uintptr_t)(uconn->conn.rbuf + uconn->conn.rcnt);
+	sqe->len = space;
+	sqe->user_data = (uintptr_t)uconn | URING_RECV;
+	return 0;
+}
+
+static int prep_send(uring_t *ring, uring_conn_t *uconn)
+{
+	struct io_uring_sqe *sqe;
+
+	if((sqe = uring_get_sqe(ring)) == NULL)
+		return -1;
+	bzero(&uconn->msg, sizeof(struct msghdr));
+	uconn->msg.msg_iov = uconn->iov;
+	uconn->msg.msg_iovlen = conn_iov(&uconn->conn, uconn->iov, URING_SEND_IOV);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = uconn->conn.fd;
+	sqe->addr = (uintptr_t)&uconn->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (uintptr_t)uconn | URING_SEND;
+	return 0;
+}
+
+static void close_uconn(uring_conn_t *uconn)
+{
+	close(uconn->conn.fd);
+	conn_destroy(&uconn->conn);
+	free(uconn);
+}
+
+// Queues the next operation of an idle connection: responses go out first,
+// then the connection is either closed or waits for more requests
+static void uconn_next(uring_t *ring, uring_conn_t *uconn)
+{
+	int ret;
+
+	if(conn_pending(&uconn->conn))
+		ret = prep_send(ring, uconn);
+	else if(uconn->closing)
+		ret = -1;
+	else
+		ret = prep_recv(ring, uconn);
+
+	if(ret < 0)
+		close_uconn(uconn);
+}
+
+static void handle_accept(uring_t *ring, int res, unsigned flags)
+{
+	uring_conn_t *uconn;
+
+	// kernels before 5.19 reject multishot accept, fall back to one
+	// accept per connection
+	if(res == -EINVAL && ring->multishot_accept) {
+		ring->multishot_accept = false;
+		prep_accept(ring);
+		return;
+	}
+
+	if(res >= 0) {
+		if((uconn = calloc(1, sizeof(uring_conn_t))) == NULL)
+			close(res);
+		else if(conn_init(&uconn->conn, res, CONN_ASYNC) < 0) {
+			free(uconn);
+			close(res);
+		}
+		else
+			uconn_next(ring, uconn);
+	}
+
+	if(!(flags & IORING_CQE_F_MORE))
+		prep_accept(ring);
+}
+
+static void handle_recv(uring_t *ring, uring_conn_t *uconn, int res)
+{
+	if(res <= 0) // EOF or error
+		uconn->closing = true;
+	else {
+		uconn->conn.rcnt += res;
+		if(serve_buffered(&uconn->conn, ring->map) < 0)
+			uconn->closing = true;
+	}
+	uconn_next(ring, uconn);
+}
+
+static void handle_send(uring_t *ring, uring_conn_t *uconn, int res)
+{
+	if(res < 0) {
+		close_uconn(uconn);
+		return;
+	}
+	conn_drain(&uconn->conn, res);
+	uconn_next(ring, uconn);
+}
+
+static void *uring_loop(void *arg)
+{
+	uring_t *ring = arg;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail, flags;
+	uint64_t user_data;
+	int res;
+
+	if(prep_accept(ring) < 0)
+		return NULL;
+
+	while(1) {
+		if(uring_enter(ring, 1) < 0 && errno != EINTR)
+			return NULL;
+
+		head = *ring->cq_head;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		for(; head != tail; head++) {
+			cqe = ring->cqes + (head & *ring->cq_mask);
+			user_data = cqe->user_data;
+			res = cqe->res;
+			flags = cqe->flags;
+			// hand the slot back before the handlers queue more work
+			__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+			switch(user_data & URING_OP_MASK) {
+				case URING_ACCEPT:
+					handle_accept(ring, res, flags);
+					break;
+				case URING_RECV:
+					handle_recv(ring, (uring_conn_t *)(uintptr_t)
+						(user_data & ~(uint64_t)URING_OP_MASK), res);
+					break;
+				case URING_SEND:
+					handle_send(ring, (uring_conn_t *)(uintptr_t)
+						(user_data & ~(uint64_t)URING_OP_MASK), res);
+					break;
+			}
+		}
+	}
+}
+
+bool uring_supported(void)
+{
+	struct io_uring_probe *probe;
+	size_t probe_size;
+	uring_t ring;
+	bool ret = false;
+
+	if(uring_setup(&ring, 2) < 0)
+		return false;
+
+	probe_size = sizeof(struct io_uring_probe) +
+		256 * sizeof(struct io_uring_probe_op);
+	if((probe = calloc(1, probe_size)) == NULL)
+		goto uring_supported_done;
+	if(syscall(__NR_io_uring_register, ring.ring_fd, IORING_REGISTER_PROBE,
+		probe, 256) < 0)
+		goto uring_supported_done;
+
+	ret = probe->last_op >= IORING_OP_RECV &&
+		(probe->ops[IORING_OP_ACCEPT].flags & IO_URING_OP_SUPPORTED) &&
+		(probe->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED) &&
+		(probe->ops[IORING_OP_SENDMSG].flags & IO_URING_OP_SUPPORTED);
+
+	uring_supported_done:
+	free(probe);
+	close(ring.ring_fd);
+	return ret;
+}
+
+int run_uring(int *listen_fds, int num_listeners, int num_loops,
+	hashmap_t *map)
+{
+	uring_t *rings;
+
+	if((rings = calloc(num_loops, sizeof(uring_t))) == NULL)
+		return -1;
+
+	// set every ring up first so that a failure leaves nothing running
+	for(int i = 0; i < num_loops; i++) {
+		if(uring_setup(&rings[i], URING_ENTRIES) < 0) {
+			while(i-- > 0)
+				close(rings[i].ring_fd);
+			free(rings);
+			return -1;
+		}
+		rings[i].listen_fd = listen_fds[i % num_listeners];
+		rings[i].map = map;
+	}
+
+	for(int i = 0; i < num_loops; i++) {
+		if(pthread_create(&rings[i].thread, NULL, uring_loop, &rings[i]))
+			return -1;
+	}
+
+	// the loops never exit unless the ring itself breaks
+	for(int i = 0; i < num_loops; i++)
+		pthread_join(rings[i].thread, NULL);
+	free(rings);
+	return -1;
+}
+
+#else
+
+bool uring_supported(void)
+{
+	return false;
+}
+
+int run_uring(int *listen_fds, int num_listeners, int num_loops,
+	hashmap_t *map)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif
@@ -15,7 +15,7 @@ hashmap_t *global_map;
 void print_map()
 {
     printf("  k | v  \n---------\n");
-    for (int i = 0; i < global_map->capacity; i++) {
+    for (int i = 0; i < global_map->slots; i++) {
         map_node_t *node = global_map->nodes+i;
         int k, v;
         if(node->key.key_base == NULL)
@@ -65,6 +65,69 @@ void map_init(void) {
     global_map = create_map(NUM_THREADS, jenkins_hash, map_free_function);
 }
 
+// Room for exactly three entries of an int key and an int value
+#define MEMORY_BUDGET (3 * (2 * sizeof(int) + MAP_ENTRY_OVERHEAD))
+
+void memory_map_init(void) {
+    map_config_t config = {NUM_THREADS, 0, jenkins_hash, map_free_function, false, MEMORY_BUDGET};
+    global_map = create_map_config(&config);
+}
+
+static void put_int(int key, int val) {
+    int *key_ptr = malloc(sizeof(int));
+    int *val_ptr = malloc(sizeof(int));
+    *key_ptr = key;
+    *val_ptr = val;
+    cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), true),
+        "Failed to insert %i", key);
+}
+
+// Every key collides under the seed the map starts out with
+static uint64_t flooded_seed;
+
+uint32_t flood_hash(map_key_t key, uint64_t seed) {
+    if(seed == flooded_seed)
+        return 0;
+    return jenkins_hash(key) ^ (uint32_t)seed;
+}
+
+void flooded_map_init(void) {
+    map_config_t config = {NUM_THREADS * 4, 0, NULL, map_free_function, false, 0, flood_hash};
+    global_map = create_map_config(&config);
+    flooded_seed = global_map->seed;
+}
+
+// Values of pinned maps are an int pin count followed by the int value
+static int pinned_destroyed;
+
+void pinned_free_function(map_key_t key, map_val_t val) {
+    pinned_destroyed++;
+    map_free_function(key, val);
+}
+
+int *val_refs(map_key_t key, map_val_t val) {
+    return val.val_base;
+}
+
+static map_val_t pinned_val(int val) {
+    int *val_ptr = malloc(2 * sizeof(int));
+    val_ptr[0] = 0;
+    val_ptr[1] = val;
+    return MAP_VAL(val_ptr, 2 * sizeof(int));
+}
+
+static map_key_t int_key(int key) {
+    int *key_ptr = malloc(sizeof(int));
+    *key_ptr = key;
+    return MAP_KEY(key_ptr, sizeof(int));
+}
+
+void pinned_map_init(void) {
+    map_config_t config = {NUM_THREADS, 0, jenkins_hash, pinned_free_function, false, 0, NULL, false, 0, val_refs};
+    global_map = create_map_config(&config);
+    pinned_destroyed = 0;
+}
+
 void *thread_query(void *arg) {
     pthread_exit(get(global_map, *(map_key_t *)arg).val_base);
     return NULL;
@@ -186,4 +249,154 @@ Test(map_suite, 03_deletion, .timeout = 2, .init = map_init, .fini = map_fini) {
         cr_assert_eq(*(int *)status, 2*index, "Found %i: expected %i", *(int *)status, 2*index);
     }
 
-}
\ No newline at end of file
+}
+
+Test(ec_map_suite, 04_max_memory, .timeout = 2, .init = memory_map_init, .fini = map_fini) {
+    for(int index = 0; index < 3; index++)
+        put_int(index, index * 2);
+    cr_assert_eq(map_memory(global_map), MEMORY_BUDGET, "Took %lu bytes", map_memory(global_map));
+
+    // reading 0 leaves 1 as the least recently used entry
+    int key = 0;
+    cr_assert_not_null(get(global_map, MAP_KEY(&key, sizeof(int))).val_base, "Failed to find 0");
+    put_int(3, 6);
+    cr_assert_eq(map_size(global_map), 3, "Had %lu items in map. Expected 3", map_size(global_map));
+    cr_assert_leq(map_memory(global_map), MEMORY_BUDGET, "Took %lu bytes", map_memory(global_map));
+
+    int expected[] = {0, 2, 3};
+    for(int index = 0; index < 3; index++)
+        cr_assert_not_null(get(global_map, MAP_KEY(&expected[index], sizeof(int))).val_base,
+            "Failed to find %i", expected[index]);
+    key = 1;
+    cr_assert_null(get(global_map, MAP_KEY(&key, sizeof(int))).val_base, "1 was not evicted");
+}
+
+Test(ec_map_suite, 05_reseed, .timeout = 2, .init = flooded_map_init, .fini = map_fini) {
+    for(int index = 0; index < NUM_THREADS * 2; index++)
+        put_int(index, index * 2);
+    cr_assert_geq(global_map->reseeds, 1, "The map was never reseeded");
+    cr_assert_neq(global_map->seed, flooded_seed, "The map kept its seed");
+    cr_assert_eq(map_size(global_map), NUM_THREADS * 2, "Had %lu items in map. Expected %d", map_size(global_map), NUM_THREADS * 2);
+
+    // the entries kept the order they were used in
+    cr_assert_eq(*(int *)global_map->front->key.key_base, 0, "0 is no longer the least recently used");
+    cr_assert_eq(*(int *)global_map->rear->key.key_base, NUM_THREADS * 2 - 1, "The last key is no longer the most recently used");
+    for(int index = 0; index < NUM_THREADS * 2; index++) {
+        map_val_t val = get(global_map, MAP_KEY(&index, sizeof(int)));
+        cr_assert_not_null(val.val_base, "Failed to find %i", index);
+        cr_assert_eq(*(int *)val.val_base, 2*index, "Found %i: expected %i", *(int *)val.val_base, 2*index);
+    }
+}
+
+Test(ec_map_suite, 06_hashed, .timeout = 2, .init = flooded_map_init, .fini = map_fini) {
+    map_hash_t hashes[NUM_THREADS * 2];
+    for(int index = 0; index < NUM_THREADS * 2; index++)
+        hashes[index] = map_hash(global_map, MAP_KEY(&index, sizeof(int)));
+
+    // the inserts reseed the map, after which every hash is stale
+    for(int index = 0; index < NUM_THREADS * 2; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index * 2;
+        cr_assert(put_hashed(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), hashes[index], false),
+            "Failed to insert %i", index);
+    }
+    cr_assert_geq(global_map->reseeds, 1, "The map was never reseeded");
+
+    for(int index = 0; index < NUM_THREADS * 2; index++) {
+        map_val_t val = get_hashed(global_map, MAP_KEY(&index, sizeof(int)), hashes[index]);
+        cr_assert_not_null(val.val_base, "Failed to find %i", index);
+        cr_assert_eq(*(int *)val.val_base, 2*index, "Found %i: expected %i", *(int *)val.val_base, 2*index);
+    }
+    for(int index = 0; index < NUM_THREADS; index++) {
+        map_node_t node = delete_hashed(global_map, MAP_KEY(&index, sizeof(int)), hashes[index]);
+        cr_assert_not_null(node.key.key_base, "Failed to delete %i", index);
+        map_free_function(node.key, node.val);
+    }
+    cr_assert_eq(map_size(global_map), NUM_THREADS, "Had %lu items in map. Expected %d", map_size(global_map), NUM_THREADS);
+}
+
+Test(ec_map_suite, 07_capacity, .timeout = 2, .init = map_init, .fini = map_fini) {
+    // NUM_THREADS slots round up to more, which the map still does not fill
+    cr_assert_gt(global_map->slots, NUM_THREADS, "Had %lu slots", global_map->slots);
+    for(int index = 0; index < NUM_THREADS * 2; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index * 2;
+        cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), true),
+            "Failed to insert %i", index);
+    }
+    cr_assert_eq(map_size(global_map), NUM_THREADS, "Had %lu items in map. Expected %d", map_size(global_map), NUM_THREADS);
+
+    // the least recently used half was evicted
+    for(int index = 0; index < NUM_THREADS * 2; index++) {
+        map_val_t val = get(global_map, MAP_KEY(&index, sizeof(int)));
+        if(index < NUM_THREADS) {
+            cr_assert_null(val.val_base, "Found evicted key %i", index);
+            continue;
+        }
+        cr_assert_not_null(val.val_base, "Failed to find %i", index);
+        cr_assert_eq(*(int *)val.val_base, 2*index, "Found %i: expected %i", *(int *)val.val_base, 2*index);
+    }
+
+    int key = NUM_THREADS * 2, val = 0;
+    cr_assert_not(put(global_map, MAP_KEY(&key, sizeof(int)), MAP_VAL(&val, sizeof(int)), false),
+        "Inserted into a full map");
+    cr_assert_eq(errno, ENOMEM, "errno was %d", errno);
+}
+
+Test(ec_map_suite, 08_pinned, .timeout = 2, .init = pinned_map_init, .fini = map_fini) {
+    int key = 1;
+    cr_assert(put(global_map, int_key(key), pinned_val(10), false), "Failed to insert %i", key);
+    map_node_t pin = get_pinned(global_map, MAP_KEY(&key, sizeof(int)), map_hash(global_map, MAP_KEY(&key, sizeof(int))));
+    cr_assert_not_null(pin.val.val_base, "Failed to pin %i", key);
+
+    // replacing the value lets go of the old one, but does not destroy it
+    cr_assert(put(global_map, int_key(key), pinned_val(20), false), "Failed to replace %i", key);
+    cr_assert_eq(pinned_destroyed, 0, "%d pinned entries were destroyed", pinned_destroyed);
+    cr_assert_eq(((int *)pin.val.val_base)[1], 10, "Pinned %i. Expected 10", ((int *)pin.val.val_base)[1]);
+    map_unpin(global_map, pin);
+    cr_assert_eq(pinned_destroyed, 1, "%d entries were destroyed. Expected 1", pinned_destroyed);
+
+    map_key_t keys[1] = {MAP_KEY(&key, sizeof(int))};
+    cr_assert(get_many_pinned(global_map, keys, &pin, 1), "Failed to pin a batch");
+    cr_assert_eq(((int *)pin.val.val_base)[1], 20, "Pinned %i. Expected 20", ((int *)pin.val.val_base)[1]);
+    map_node_t node = delete(global_map, MAP_KEY(&key, sizeof(int)));
+    map_retire(global_map, node.key, node.val);
+    cr_assert_eq(pinned_destroyed, 1, "%d entries were destroyed. Expected 1", pinned_destroyed);
+    map_unpin(global_map, pin);
+    cr_assert_eq(pinned_destroyed, 2, "%d entries were destroyed. Expected 2", pinned_destroyed);
+}
+
+Test(ec_map_suite, 09_clear, .timeout = 2, .init = pinned_map_init, .fini = map_fini) {
+    for(int index = 0; index < NUM_THREADS / 2; index++)
+        cr_assert(put(global_map, int_key(index), pinned_val(index), false), "Failed to insert %i", index);
+    int key = 0;
+    map_node_t pin = get_pinned(global_map, MAP_KEY(&key, sizeof(int)), map_hash(global_map, MAP_KEY(&key, sizeof(int))));
+    cr_assert_not_null(pin.val.val_base, "Failed to pin %i", key);
+
+    // the entries are gone at once, but stay in their nodes until swept
+    cr_assert(clear_map(global_map), "clear_map failed");
+    cr_assert_eq(pinned_destroyed, 0, "%d entries were destroyed before a sweep", pinned_destroyed);
+    cr_assert_eq(map_size(global_map), 0, "Had %lu items in map. Expected 0", map_size(global_map));
+    for(int index = 0; index < NUM_THREADS / 2; index++)
+        cr_assert_null(get(global_map, MAP_KEY(&index, sizeof(int))).val_base, "Found cleared key %i", index);
+
+    // a cleared key goes back in as a new entry
+    cr_assert(put(global_map, int_key(key), pinned_val(20), false), "Failed to insert %i", key);
+    cr_assert_eq(map_size(global_map), 1, "Had %lu items in map. Expected 1", map_size(global_map));
+    cr_assert_eq(((int *)get(global_map, MAP_KEY(&key, sizeof(int))).val_base)[1], 20, "Found an old value of %i", key);
+
+    // every put sweeps, so once they have gone over every slot the
+    // cleared entries are destroyed, but for the pinned one
+    for(uint64_t i = 0; i < global_map->slots / MAP_SWEEP_STEP; i++)
+        cr_assert(put(global_map, int_key(key), pinned_val(20), false), "Failed to replace %i", key);
+    cr_assert_eq(global_map->stale, 0, "%lu cleared entries were not swept", global_map->stale);
+    cr_assert_eq(*(int *)pin.val.val_base, 0, "The pin count is %i. Expected 0", *(int *)pin.val.val_base);
+    int expected = NUM_THREADS / 2 - 1 + global_map->slots / MAP_SWEEP_STEP;
+    cr_assert_eq(pinned_destroyed, expected, "%d entries were destroyed. Expected %d", pinned_destroyed, expected);
+    map_unpin(global_map, pin);
+    cr_assert_eq(pinned_destroyed, expected + 1, "%d entries were destroyed. Expected %d", pinned_destroyed, expected + 1);
+}
@@ -0,0 +1,87 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "cream.h"
+
+#define SEED 0x0123456789abcdefULL
+
+static uint8_t buffer[MAX_KEY_SIZE + 16];
+
+void hash_init(void) {
+    srand(1);
+    for(size_t i = 0; i < sizeof(buffer); i++)
+        buffer[i] = rand();
+}
+
+Test(hash_suite, 00_names, .timeout = 2) {
+    for(const hash_entry_t *entry = hash_functions; entry->name != NULL; entry++)
+        cr_assert_eq(hash_by_name(entry->name), entry, "Did not find %s", entry->name);
+    cr_assert_eq(hash_by_name("jenkins")->function, jenkins_one_at_a_time_hash, "jenkins is not the default hash");
+    cr_assert_null(hash_by_name("none"), "Found a hash that does not exist");
+}
+
+Test(hash_suite, 01_alignment, .timeout = 5, .init = hash_init) {
+    uint8_t copy[MAX_KEY_SIZE + 16];
+
+    // the same bytes hash the same wherever they start
+    for(const hash_entry_t *entry = hash_functions; entry->name != NULL; entry++) {
+        for(size_t len = MIN_KEY_SIZE; len <= MAX_KEY_SIZE; len += 1 + len / 8) {
+            uint32_t h = entry->function(MAP_KEY(buffer, len));
+            uint32_t keyed = entry->keyed_function(MAP_KEY(buffer, len), SEED);
+            for(int offset = 1; offset < 16; offset++) {
+                memcpy(copy + offset, buffer, len);
+                cr_assert_eq(entry->function(MAP_KEY(copy + offset, len)), h,
+                    "%s of %zu bytes changed at offset %d", entry->name, len, offset);
+                cr_assert_eq(entry->keyed_function(MAP_KEY(copy + offset, len), SEED), keyed,
+                    "Keyed %s of %zu bytes changed at offset %d", entry->name, len, offset);
+            }
+        }
+    }
+}
+
+Test(hash_suite, 02_every_byte, .timeout = 10, .init = hash_init) {
+    size_t lengths[] = {1, 3, 4, 8, 15, 16, 17, 48, 49, 63, 64, 65, 255, 256, 257, 511, 512, 513,
+        1023, 1024, 1025, 1100, MAX_KEY_SIZE};
+
+    // flipping any one bit of the key, or dropping its last byte, changes
+    // the hash
+    for(const hash_entry_t *entry = hash_functions; entry->name != NULL; entry++) {
+        for(size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+            size_t len = lengths[l];
+            uint32_t h = entry->function(MAP_KEY(buffer, len));
+            if(len > 1)
+                cr_assert_neq(entry->function(MAP_KEY(buffer, len - 1)), h,
+                    "%s of %zu bytes ignored the length", entry->name, len);
+            uint32_t keyed = entry->keyed_function(MAP_KEY(buffer, len), SEED);
+            for(size_t i = 0; i < len; i++) {
+                buffer[i] ^= 1 << (i % 8);
+                uint32_t flipped = entry->function(MAP_KEY(buffer, len));
+                uint32_t keyed_flipped = entry->keyed_function(MAP_KEY(buffer, len), SEED);
+                buffer[i] ^= 1 << (i % 8);
+                cr_assert_neq(flipped, h, "%s of %zu bytes ignored byte %zu", entry->name, len, i);
+                cr_assert_neq(keyed_flipped, keyed, "Keyed %s of %zu bytes ignored byte %zu", entry->name, len, i);
+            }
+        }
+    }
+}
+
+Test(hash_suite, 03_seeds, .timeout = 2, .init = hash_init) {
+    size_t lengths[] = {1, 8, 16, 100, HASH_STRIPE_MIN + 1, MAX_KEY_SIZE};
+
+    // both halves of the seed change every hash
+    for(const hash_entry_t *entry = hash_functions; entry->name != NULL; entry++) {
+        for(size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+            map_key_t key = MAP_KEY(buffer, lengths[l]);
+            uint32_t h = entry->keyed_function(key, SEED);
+            cr_assert_neq(entry->keyed_function(key, SEED ^ 1), h,
+                "%s of %zu bytes ignored the low half of the seed", entry->name, lengths[l]);
+            cr_assert_neq(entry->keyed_function(key, SEED ^ (1ULL << 63)), h,
+                "%s of %zu bytes ignored the high half of the seed", entry->name, lengths[l]);
+        }
+    }
+    cr_assert_neq(random_seed(), random_seed(), "Got the same seed twice");
+}
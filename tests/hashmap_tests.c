@@ -3,6 +3,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "hashmap.h"
 #define NUM_THREADS 100
@@ -14,20 +15,22 @@ hashmap_t *global_map;
 void print_map()
 {
     printf("  k | v  \n---------\n");
-    for (int i = 0; i < global_map->capacity; i++) {
-        map_node_t *node = global_map->nodes+i;
-        int k, v;
-        if(node->key.key_base == NULL)
-            k = -1;
-        else
-            k = *(int *)(node->key.key_base);
-
-        if(node->val.val_base == NULL)
-            v = -1;
-        else
-            v = *(int *)(node->val.val_base);
-
-        printf("| %i | %i |\n--------\n", k, v);
+    for (int s = 0; s < global_map->num_segments; s++) {
+        for (int i = 0; i < global_map->segments[s].table.capacity; i++) {
+            map_node_t *node = global_map->segments[s].table.nodes+i;
+            int k, v;
+            if(node->key.key_base == NULL)
+                k = -1;
+            else
+                k = *(int *)(node->key.key_base);
+
+            if(node->val.val_base == NULL)
+                v = -1;
+            else
+                v = *(int *)(node->val.val_base);
+
+            printf("| %i | %i |\n--------\n", k, v);
+        }
     }
 }
 
@@ -64,6 +67,115 @@ void map_init(void) {
     global_map = create_map(NUM_THREADS, jenkins_hash, map_free_function);
 }
 
+void segmented_map_init(void) {
+    global_map = create_map_segmented(NUM_THREADS * 4, 8, jenkins_hash, map_free_function);
+}
+
+void lockfree_map_init(void) {
+    map_config_t config = {NUM_THREADS * 4, 8, jenkins_hash, map_free_function, true};
+    global_map = create_map_config(&config);
+}
+
+// Room for exactly MEMORY_ENTRIES entries of an int key and an int value
+#define MEMORY_ENTRIES 10
+#define MEMORY_BUDGET (MEMORY_ENTRIES * (2 * sizeof(int) + MAP_ENTRY_OVERHEAD))
+
+void memory_map_init(void) {
+    map_config_t config = {NUM_THREADS, 1, jenkins_hash, map_free_function, false, MEMORY_BUDGET};
+    global_map = create_map_config(&config);
+}
+
+// Every key collides under the seed the map starts out with
+static uint64_t flooded_seed;
+
+uint32_t flood_hash(map_key_t key, uint64_t seed) {
+    if(seed == flooded_seed)
+        return 0;
+    return jenkins_hash(key) ^ (uint32_t)seed;
+}
+
+// Spreads keys differently for every seed, unlike flood_hash()
+uint32_t mixed_hash(map_key_t key, uint64_t seed) {
+    return ((jenkins_hash(key) ^ seed) * 0x9e3779b97f4a7c15ull) >> 32;
+}
+
+void flooded_map_init(void) {
+    map_config_t config = {NUM_THREADS * 4, 1, NULL, map_free_function, false, 0, flood_hash};
+    global_map = create_map_config(&config);
+    flooded_seed = global_map->seed;
+}
+
+// One segment whose table is grown to CUCKOO_CAPACITY slots by the time
+// CUCKOO_ENTRIES are in it, which fill it to MAP_CUCKOO_MAX_LOAD_PERCENT
+#define CUCKOO_CAPACITY 1024
+#define CUCKOO_ENTRIES (CUCKOO_CAPACITY * MAP_CUCKOO_MAX_LOAD_PERCENT / 100)
+
+void cuckoo_map_init(void) {
+    map_config_t config = {CUCKOO_CAPACITY, 1, jenkins_hash, map_free_function, true, 0, NULL, true};
+    global_map = create_map_config(&config);
+}
+
+void flooded_cuckoo_map_init(void) {
+    map_config_t config = {NUM_THREADS * 4, 1, NULL, map_free_function, false, 0, flood_hash, true};
+    global_map = create_map_config(&config);
+    flooded_seed = global_map->seed;
+}
+
+// Puts keys on only CLUSTERS hashes, more of them than a bucket holds
+#define CLUSTERS 1000
+#define CLUSTERED_KEYS (NUM_THREADS * 200)
+
+uint32_t clustered_hash(map_key_t key) {
+    return (*(uint32_t *)key.key_base % CLUSTERS) * 2654435761u;
+}
+
+void clustered_cuckoo_map_init(void) {
+    map_config_t config = {CLUSTERED_KEYS, 1, clustered_hash, map_free_function, false, 0, NULL, true};
+    global_map = create_map_config(&config);
+}
+
+// One segment that is full a few entries after its table grows from
+// GROWN_FROM slots to twice that, long before the migration is done
+#define GROWN_FROM 512
+#define GROWN_AT (GROWN_FROM * MAP_MAX_LOAD_PERCENT / 100 + 1)
+#define GROWN_CAP (GROWN_AT + 4)
+
+void grown_map_init(void) {
+    map_config_t config = {GROWN_CAP, 1, jenkins_hash, map_free_function, false, 0};
+    global_map = create_map_config(&config);
+}
+
+// Values of pinned maps are an int pin count followed by the int value
+static int pinned_destroyed;
+
+void pinned_free_function(map_key_t key, map_val_t val) {
+    pinned_destroyed++;
+    map_free_function(key, val);
+}
+
+int *val_refs(map_key_t key, map_val_t val) {
+    return val.val_base;
+}
+
+static map_val_t pinned_val(int val) {
+    int *val_ptr = malloc(2 * sizeof(int));
+    val_ptr[0] = 0;
+    val_ptr[1] = val;
+    return MAP_VAL(val_ptr, 2 * sizeof(int));
+}
+
+static map_key_t int_key(int key) {
+    int *key_ptr = malloc(sizeof(int));
+    *key_ptr = key;
+    return MAP_KEY(key_ptr, sizeof(int));
+}
+
+void pinned_map_init(void) {
+    map_config_t config = {NUM_THREADS, 0, jenkins_hash, pinned_free_function, true, 0, NULL, false, 0, val_refs};
+    global_map = create_map_config(&config);
+    pinned_destroyed = 0;
+}
+
 void *thread_query(void *arg) {
     pthread_exit(get(global_map, *(map_key_t *)arg).val_base);
     return NULL;
@@ -81,6 +193,23 @@ void *thread_put(void *arg) {
     return NULL;
 }
 
+// Keeps reading every key while other threads replace its value
+void *thread_read_section(void *arg) {
+    for(int round = 0; round < 50; round++) {
+        for(int index = 0; index < NUM_THREADS; index++) {
+            int token = map_read_begin(global_map);
+            map_val_t val = get(global_map, MAP_KEY(&index, sizeof(int)));
+            // the value may be replaced, but not freed, until the section ends
+            if(val.val_base == NULL || *(int *)val.val_base != 2*index) {
+                map_read_end(global_map, token);
+                return (void *)1;
+            }
+            map_read_end(global_map, token);
+        }
+    }
+    return NULL;
+}
+
 void map_fini(void) {
     print_map();
     invalidate_map(global_map);
@@ -113,7 +242,7 @@ Test(map_suite, 02_multithreaded, .timeout = 2, .init = map_init, .fini = map_fi
         pthread_join(thread_ids[index], NULL);
     }
 
-    int num_items = global_map->size;
+    int num_items = map_size(global_map);
     cr_assert_eq(num_items, NUM_THREADS, "Had %d items in map. Expected %d", num_items, NUM_THREADS);
 }
 */
@@ -140,7 +269,7 @@ Test(map_suite, 03_deletion, .timeout = 2, .init = map_init, .fini = map_fini) {
         pthread_join(thread_ids[index], NULL);
     }
 
-    int num_items = global_map->size;
+    int num_items = map_size(global_map);
     cr_assert_eq(num_items, NUM_THREADS, "Had %d items in map. Expected %d", num_items, NUM_THREADS);
     
 
@@ -164,7 +293,7 @@ Test(map_suite, 03_deletion, .timeout = 2, .init = map_init, .fini = map_fini) {
         cr_assert_not_null(status, "Failed to remove %i", index);
     }
 
-    num_items = global_map->size;
+    num_items = map_size(global_map);
     cr_assert_eq(num_items, NUM_THREADS - NUM_THREADS/2, "Had %d items in map. Expected %d", num_items, NUM_THREADS - NUM_THREADS/2);
 
     for(int index = 0; index < NUM_THREADS/2; index++) {
@@ -187,22 +316,671 @@ Test(map_suite, 03_deletion, .timeout = 2, .init = map_init, .fini = map_fini) {
 
 }
 
-//(int index = 0; index < NUM_THREADS/2; index++)
-//(int index = NUM_THREADS-1; index > NUM_THREADS/2; index--)
+Test(map_suite, 04_batch, .timeout = 2, .init = map_init, .fini = map_fini) {
+    map_key_t keys[NUM_THREADS/2 + 1];
+    map_val_t vals[NUM_THREADS/2 + 1];
+    map_node_t removed[NUM_THREADS/2];
+    bool done[NUM_THREADS/2];
+
+    for(int index = 0; index < NUM_THREADS/2; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index * 2;
+        keys[index] = MAP_KEY(key_ptr, sizeof(int));
+        vals[index] = MAP_VAL(val_ptr, sizeof(int));
+    }
+
+    cr_assert(put_many(global_map, keys, vals, done, NUM_THREADS/2, false), "put_many failed");
+    for(int index = 0; index < NUM_THREADS/2; index++)
+        cr_assert(done[index], "Failed to insert %i", index);
+    cr_assert_eq(map_size(global_map), NUM_THREADS/2, "Had %lu items in map. Expected %d", map_size(global_map), NUM_THREADS/2);
+
+    // one key that was never inserted
+    int missing = NUM_THREADS;
+    keys[NUM_THREADS/2] = MAP_KEY(&missing, sizeof(int));
+
+    cr_assert(get_many(global_map, keys, vals, NUM_THREADS/2 + 1), "get_many failed");
+    for(int index = 0; index < NUM_THREADS/2; index++) {
+        cr_assert_not_null(vals[index].val_base, "Failed to find %i", index);
+        cr_assert_eq(*(int *)vals[index].val_base, 2*index, "Found %i: expected %i", *(int *)vals[index].val_base, 2*index);
+    }
+    cr_assert_null(vals[NUM_THREADS/2].val_base, "Found a key that was never inserted");
+
+    cr_assert(delete_many(global_map, keys, removed, NUM_THREADS/2), "delete_many failed");
+    for(int index = 0; index < NUM_THREADS/2; index++) {
+        cr_assert_not_null(removed[index].key.key_base, "Failed to remove %i", index);
+        map_free_function(removed[index].key, removed[index].val);
+    }
+    cr_assert_eq(map_size(global_map), 0, "Had %lu items in map. Expected 0", map_size(global_map));
+}
+
+Test(map_suite, 05_segments, .timeout = 2, .init = segmented_map_init, .fini = map_fini) {
+    pthread_t thread_ids[NUM_THREADS];
+
+    cr_assert_eq(global_map->num_segments, 8, "Had %d segments. Expected 8", global_map->num_segments);
+
+    for(int index = 0; index < NUM_THREADS; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index * 2;
+
+        map_insert_t *insert = malloc(sizeof(map_insert_t));
+        insert->key_ptr = key_ptr;
+        insert->val_ptr = val_ptr;
+
+        if(pthread_create(&thread_ids[index], NULL, thread_put, insert) != 0)
+            exit(EXIT_FAILURE);
+    }
+
+    for(int index = 0; index < NUM_THREADS; index++) {
+        pthread_join(thread_ids[index], NULL);
+    }
+
+    int num_items = map_size(global_map);
+    cr_assert_eq(num_items, NUM_THREADS, "Had %d items in map. Expected %d", num_items, NUM_THREADS);
+
+    for(int index = 0; index < NUM_THREADS; index++) {
+        map_val_t val = get(global_map, MAP_KEY(&index, sizeof(int)));
+        cr_assert_not_null(val.val_base, "Failed to find %i", index);
+        cr_assert_eq(*(int *)val.val_base, 2*index, "Found %i: expected %i", *(int *)val.val_base, 2*index);
+    }
+
+    // clearing has to reach every segment
+    cr_assert(clear_map(global_map), "clear_map failed");
+    num_items = map_size(global_map);
+    cr_assert_eq(num_items, 0, "Had %d items in map. Expected 0", num_items);
+    for(int index = 0; index < NUM_THREADS; index++) {
+        map_val_t val = get(global_map, MAP_KEY(&index, sizeof(int)));
+        cr_assert_null(val.val_base, "Found %i after clearing", index);
+    }
+}
+
+Test(map_suite, 06_lockfree, .timeout = 5, .init = lockfree_map_init, .fini = map_fini) {
+    pthread_t readers[4];
+    pthread_t thread_ids[NUM_THREADS];
+
+    cr_assert(global_map->lockfree_get, "Map does not serve gets without a lock");
+    for(int index = 0; index < NUM_THREADS; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index * 2;
+        put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false);
+    }
+
+    for(int i = 0; i < 4; i++) {
+        if(pthread_create(&readers[i], NULL, thread_read_section, NULL) != 0)
+            exit(EXIT_FAILURE);
+    }
+
+    // replace every value with an equal one, retiring the old entries
+    for(int round = 0; round < 5; round++) {
+        for(int index = 0; index < NUM_THREADS; index++) {
+            int *key_ptr = malloc(sizeof(int));
+            int *val_ptr = malloc(sizeof(int));
+            *key_ptr = index;
+            *val_ptr = index * 2;
+
+            map_insert_t *insert = malloc(sizeof(map_insert_t));
+            insert->key_ptr = key_ptr;
+            insert->val_ptr = val_ptr;
+
+            if(pthread_create(&thread_ids[index], NULL, thread_put, insert) != 0)
+                exit(EXIT_FAILURE);
+        }
+        for(int index = 0; index < NUM_THREADS; index++)
+            pthread_join(thread_ids[index], NULL);
+    }
+
+    void *status;
+    for(int i = 0; i < 4; i++) {
+        pthread_join(readers[i], &status);
+        cr_assert_null(status, "A reader saw a missing or freed value");
+    }
+
+    int num_items = map_size(global_map);
+    cr_assert_eq(num_items, NUM_THREADS, "Had %d items in map. Expected %d", num_items, NUM_THREADS);
+}
+
+Test(map_suite, 07_churn, .timeout = 2, .init = map_init, .fini = map_fini) {
+    int keys[NUM_THREADS * 10];
+
+    // keep the map nearly full while keys come and go
+    for(int index = 0; index < NUM_THREADS * 10; index++) {
+        keys[index] = index;
+        if(index >= NUM_THREADS - 10) {
+            int old = index - (NUM_THREADS - 10);
+            map_node_t removed = delete(global_map, MAP_KEY(&keys[old], sizeof(int)));
+            cr_assert_not_null(removed.key.key_base, "Failed to remove %i", old);
+            map_free_function(removed.key, removed.val);
+        }
+
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index * 2;
+        cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false),
+            "Failed to insert %i", index);
+    }
+
+    int num_items = map_size(global_map);
+    cr_assert_eq(num_items, NUM_THREADS - 10, "Had %d items in map. Expected %d", num_items, NUM_THREADS - 10);
+
+    for(int index = 0; index < NUM_THREADS * 10; index++) {
+        map_val_t val = get(global_map, MAP_KEY(&keys[index], sizeof(int)));
+        if(index < NUM_THREADS * 9 + 10)
+            cr_assert_null(val.val_base, "Found %i after removing it", index);
+        else {
+            cr_assert_not_null(val.val_base, "Failed to find %i", index);
+            cr_assert_eq(*(int *)val.val_base, 2*index, "Found %i: expected %i", *(int *)val.val_base, 2*index);
+        }
+    }
+
+    // deleting leaves nothing behind to probe past
+    for(int s = 0; s < global_map->num_segments; s++) {
+        map_table_t *table = &global_map->segments[s].table;
+        for(int i = 0; i < table->capacity; i++) {
+            cr_assert(!table->nodes[i].tombstone, "Found a tombstone");
+            cr_assert(table->nodes[i].key.key_base != NULL || table->nodes[i].dist == 0,
+                "Empty node has a distance");
+            cr_assert_eq(table->nodes[i].key.key_base == NULL, table->tags[i] == 0,
+                "Tag of node %d does not match it", i);
+        }
+    }
+}
 
+Test(map_suite, 08_binary_keys, .timeout = 2, .init = map_init, .fini = map_fini) {
+    // the same up to the NUL byte, which a string compare stops at
+    char *one = malloc(4), *two = malloc(4);
+    int *one_val = malloc(sizeof(int)), *two_val = malloc(sizeof(int));
+    memcpy(one, "a\0bc", 4);
+    memcpy(two, "a\0xy", 4);
+    *one_val = 1;
+    *two_val = 2;
+
+    cr_assert(put(global_map, MAP_KEY(one, 4), MAP_VAL(one_val, sizeof(int)), false), "Failed to insert one");
+    cr_assert(put(global_map, MAP_KEY(two, 4), MAP_VAL(two_val, sizeof(int)), false), "Failed to insert two");
+    cr_assert_eq(map_size(global_map), 2, "Had %lu items in map. Expected 2", map_size(global_map));
+
+    map_val_t val = get(global_map, MAP_KEY("a\0bc", 4));
+    cr_assert_not_null(val.val_base, "Failed to find one");
+    cr_assert_eq(*(int *)val.val_base, 1, "Found %i: expected 1", *(int *)val.val_base);
+    val = get(global_map, MAP_KEY("a\0xy", 4));
+    cr_assert_not_null(val.val_base, "Failed to find two");
+    cr_assert_eq(*(int *)val.val_base, 2, "Found %i: expected 2", *(int *)val.val_base);
+    cr_assert_null(get(global_map, MAP_KEY("a\0zz", 4)).val_base, "Found a key that was never inserted");
+}
 
+Test(map_suite, 09_resize, .timeout = 2, .init = map_init, .fini = map_fini) {
+    map_segment_t *seg = global_map->segments;
 
+    cr_assert_eq(seg->table.capacity, MAP_TABLE_MIN_CAPACITY, "Table started with %lu slots", seg->table.capacity);
 
+    for(int index = 0; index < NUM_THREADS; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index * 2;
+        cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false),
+            "Failed to insert %i", index);
 
+        // every key stays reachable while the table is being migrated
+        for(int other = 0; other <= index; other++)
+            cr_assert_not_null(get(global_map, MAP_KEY(&other, sizeof(int))).val_base, "Lost %i", other);
+    }
+    cr_assert_geq(seg->table.capacity, NUM_THREADS, "Table only has %lu slots", seg->table.capacity);
+
+    // a full map still only takes what it was created for
+    int *key_ptr = malloc(sizeof(int)), *val_ptr = malloc(sizeof(int));
+    *key_ptr = *val_ptr = NUM_THREADS;
+    cr_assert(!put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false),
+        "Put into a full map");
+    cr_assert_eq(errno, ENOMEM, "errno was %d", errno);
+    free(key_ptr);
+    free(val_ptr);
+
+    for(int index = 0; index < NUM_THREADS - 1; index++) {
+        map_node_t removed = delete(global_map, MAP_KEY(&index, sizeof(int)));
+        cr_assert_not_null(removed.key.key_base, "Failed to remove %i", index);
+        map_free_function(removed.key, removed.val);
+    }
+    cr_assert_eq(map_size(global_map), 1, "Had %lu items in map. Expected 1", map_size(global_map));
+    cr_assert_lt(seg->table.capacity, NUM_THREADS, "Table did not shrink from %lu slots", seg->table.capacity);
 
+    int last = NUM_THREADS - 1;
+    map_val_t val = get(global_map, MAP_KEY(&last, sizeof(int)));
+    cr_assert_not_null(val.val_base, "Failed to find %i", last);
+    cr_assert_eq(*(int *)val.val_base, 2*last, "Found %i: expected %i", *(int *)val.val_base, 2*last);
+}
 
+Test(map_suite, 10_long_keys, .timeout = 2, .init = map_init, .fini = map_fini) {
+    // only the part of the keys past what a node keeps inline differs
+    char keys[3][MAP_INLINE_KEY_SIZE + 8];
+    for(int index = 0; index < 3; index++) {
+        memset(keys[index], 'k', sizeof(keys[index]));
+        keys[index][sizeof(keys[index]) - 1] = '0' + index;
+    }
 
+    for(int index = 0; index < 2; index++) {
+        char *key_ptr = malloc(sizeof(keys[index]));
+        int *val_ptr = malloc(sizeof(int));
+        memcpy(key_ptr, keys[index], sizeof(keys[index]));
+        *val_ptr = index;
+        cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(keys[index])), MAP_VAL(val_ptr, sizeof(int)), false),
+            "Failed to insert %i", index);
+    }
+    cr_assert_eq(map_size(global_map), 2, "Had %lu items in map. Expected 2", map_size(global_map));
 
+    for(int index = 0; index < 2; index++) {
+        map_val_t val = get(global_map, MAP_KEY(keys[index], sizeof(keys[index])));
+        cr_assert_not_null(val.val_base, "Failed to find %i", index);
+        cr_assert_eq(*(int *)val.val_base, index, "Found %i: expected %i", *(int *)val.val_base, index);
+    }
+    cr_assert_null(get(global_map, MAP_KEY(keys[2], sizeof(keys[2]))).val_base, "Found a key that was never inserted");
+    // a key that fits inline but is a prefix of the others
+    cr_assert_null(get(global_map, MAP_KEY(keys[0], MAP_INLINE_KEY_SIZE)).val_base, "Found a prefix of a key");
+}
 
+Test(map_suite, 11_max_memory, .timeout = 2, .init = memory_map_init, .fini = map_fini) {
+    for(int index = 0; index < NUM_THREADS; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index * 2;
+        cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), true),
+            "Failed to insert %i", index);
+        cr_assert_leq(map_memory(global_map), MEMORY_BUDGET, "Took %lu bytes after %i", map_memory(global_map), index);
+    }
+    // the budget, not the capacity, is what limited the map
+    cr_assert_eq(map_size(global_map), MEMORY_ENTRIES, "Had %lu items in map. Expected %d", map_size(global_map), MEMORY_ENTRIES);
+    cr_assert_eq(map_memory(global_map), MEMORY_BUDGET, "Took %lu bytes", map_memory(global_map));
+
+    // replacing an entry with one of the same size needs no room
+    int last = NUM_THREADS - 1;
+    int *key_ptr = malloc(sizeof(int)), *val_ptr = malloc(sizeof(int));
+    *key_ptr = last;
+    *val_ptr = 0;
+    cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false),
+        "Failed to replace %i", last);
+
+    // but a new one does
+    key_ptr = malloc(sizeof(int));
+    val_ptr = malloc(sizeof(int));
+    *key_ptr = *val_ptr = NUM_THREADS;
+    cr_assert(!put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false),
+        "Put past the budget");
+    cr_assert_eq(errno, ENOMEM, "errno was %d", errno);
+    free(key_ptr);
+    free(val_ptr);
+
+    map_node_t removed = delete(global_map, MAP_KEY(&last, sizeof(int)));
+    cr_assert_not_null(removed.key.key_base, "Failed to remove %i", last);
+    map_free_function(removed.key, removed.val);
+    cr_assert_eq(map_memory(global_map), MEMORY_BUDGET - MEMORY_BUDGET / MEMORY_ENTRIES,
+        "Took %lu bytes", map_memory(global_map));
+}
 
+Test(map_suite, 12_reseed, .timeout = 2, .init = flooded_map_init, .fini = map_fini) {
+    for(int index = 0; index < NUM_THREADS * 2; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index * 2;
+        cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false),
+            "Failed to insert %i", index);
+    }
+    cr_assert_geq(global_map->reseeds, 1, "The map was never reseeded");
+    cr_assert_neq(global_map->segments[0].seed, flooded_seed, "The segment kept its seed");
+
+    // every key moved, and none of them is far from home any more
+    map_table_t *table = &(global_map->segments[0].table);
+    for(int i = 0; i < table->capacity; i++)
+        cr_assert_leq(table->nodes[i].dist, MAP_PROBE_LIMIT, "Node %i is %u slots from home", i, table->nodes[i].dist);
+    cr_assert_eq(map_size(global_map), NUM_THREADS * 2, "Had %lu items in map. Expected %d", map_size(global_map), NUM_THREADS * 2);
+    for(int index = 0; index < NUM_THREADS * 2; index++) {
+        map_val_t val = get(global_map, MAP_KEY(&index, sizeof(int)));
+        cr_assert_not_null(val.val_base, "Failed to find %i", index);
+        cr_assert_eq(*(int *)val.val_base, 2*index, "Found %i: expected %i", *(int *)val.val_base, 2*index);
+    }
+    cr_assert_eq(map_memory(global_map), NUM_THREADS * 2 * (2 * sizeof(int) + MAP_ENTRY_OVERHEAD),
+        "Took %lu bytes", map_memory(global_map));
+}
 
+Test(map_suite, 13_hashed, .timeout = 2, .init = flooded_map_init, .fini = map_fini) {
+    map_hash_t hashes[NUM_THREADS * 2];
+    for(int index = 0; index < NUM_THREADS * 2; index++) {
+        hashes[index] = map_hash(global_map, MAP_KEY(&index, sizeof(int)));
+        cr_assert_eq(hashes[index].seed, flooded_seed, "Hashed %i with the wrong seed", index);
+    }
 
+    // the inserts reseed the map, after which every hash is stale
+    for(int index = 0; index < NUM_THREADS * 2; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index * 2;
+        cr_assert(put_hashed(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), hashes[index], false),
+            "Failed to insert %i", index);
+    }
+    cr_assert_geq(global_map->reseeds, 1, "The map was never reseeded");
+    cr_assert(map_reseed(global_map), "Failed to reseed");
 
+    for(int index = 0; index < NUM_THREADS * 2; index++) {
+        map_val_t val = get_hashed(global_map, MAP_KEY(&index, sizeof(int)), hashes[index]);
+        cr_assert_not_null(val.val_base, "Failed to find %i", index);
+        cr_assert_eq(*(int *)val.val_base, 2*index, "Found %i: expected %i", *(int *)val.val_base, 2*index);
+    }
+    for(int index = 0; index < NUM_THREADS; index++) {
+        map_node_t node = delete_hashed(global_map, MAP_KEY(&index, sizeof(int)), map_hash(global_map, MAP_KEY(&index, sizeof(int))));
+        cr_assert_not_null(node.key.key_base, "Failed to delete %i", index);
+        map_free_function(node.key, node.val);
+    }
+    cr_assert_eq(map_size(global_map), NUM_THREADS, "Had %lu items in map. Expected %d", map_size(global_map), NUM_THREADS);
+}
 
+Test(map_suite, 14_cuckoo, .timeout = 2, .init = cuckoo_map_init, .fini = map_fini) {
+    for(int index = 0; index < CUCKOO_ENTRIES; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index * 2;
+        cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false),
+            "Failed to insert %i", index);
+    }
+    map_table_t *table = &(global_map->segments[0].table);
+    cr_assert_eq(table->capacity, CUCKOO_CAPACITY, "The table has %lu slots. Expected %d", table->capacity, CUCKOO_CAPACITY);
+    cr_assert_eq(map_size(global_map), CUCKOO_ENTRIES, "Had %lu items in map. Expected %d", map_size(global_map), CUCKOO_ENTRIES);
+    cr_assert_eq(global_map->long_probes, 0, "%u inserts found no room", global_map->long_probes);
+
+    for(int index = 0; index < CUCKOO_ENTRIES; index += 2) {
+        map_node_t node = delete(global_map, MAP_KEY(&index, sizeof(int)));
+        cr_assert_not_null(node.key.key_base, "Failed to delete %i", index);
+        map_free_function(node.key, node.val);
+    }
+    for(int index = 0; index < CUCKOO_ENTRIES; index++) {
+        map_val_t val = get(global_map, MAP_KEY(&index, sizeof(int)));
+        if(index % 2 == 0) {
+            cr_assert_null(val.val_base, "Found deleted key %i", index);
+            continue;
+        }
+        cr_assert_not_null(val.val_base, "Failed to find %i", index);
+        cr_assert_eq(*(int *)val.val_base, 2*index, "Found %i: expected %i", *(int *)val.val_base, 2*index);
+    }
+}
 
+Test(map_suite, 15_cuckoo_reseed, .timeout = 2, .init = flooded_cuckoo_map_init, .fini = map_fini) {
+    for(int index = 0; index < NUM_THREADS * 2; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index * 2;
+        cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false),
+            "Failed to insert %i", index);
+    }
+    cr_assert_geq(global_map->reseeds, 1, "The map was never reseeded");
+
+    // the keys that came in before the reseed all kept their place
+    cr_assert_eq(map_size(global_map), NUM_THREADS * 2, "Had %lu items in map. Expected %d", map_size(global_map), NUM_THREADS * 2);
+    for(int index = 0; index < NUM_THREADS * 2; index++) {
+        map_val_t val = get(global_map, MAP_KEY(&index, sizeof(int)));
+        cr_assert_not_null(val.val_base, "Failed to find %i", index);
+        cr_assert_eq(*(int *)val.val_base, 2*index, "Found %i: expected %i", *(int *)val.val_base, 2*index);
+    }
+}
+
+Test(map_suite, 16_cuckoo_small_tables, .timeout = 2) {
+    // many segments of a few buckets each, which fill up unevenly long
+    // before the map does, with a new seed every round
+    for(int round = 0; round < 100; round++) {
+        map_config_t config = {CUCKOO_CAPACITY, 0, NULL, map_free_function, false, 0, mixed_hash, true};
+        hashmap_t *map = create_map_config(&config);
+        cr_assert_not_null(map, "Map returned was NULL");
+        for(int index = 0; index < CUCKOO_CAPACITY / 4; index++) {
+            int *key_ptr = malloc(sizeof(int));
+            int *val_ptr = malloc(sizeof(int));
+            *key_ptr = index;
+            *val_ptr = index * 2;
+            cr_assert(put(map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), true),
+                "Failed to insert %i", index);
+        }
+        cr_assert_eq(map_size(map), CUCKOO_CAPACITY / 4, "Had %lu items in map in round %d. Expected %d",
+            map_size(map), round, CUCKOO_CAPACITY / 4);
+        invalidate_map(map);
+    }
+}
+
+Test(map_suite, 17_pinned, .timeout = 2, .init = pinned_map_init) {
+    int key = 1, missing = 2;
+    cr_assert(put(global_map, int_key(key), pinned_val(10), false), "Failed to insert %i", key);
+    map_node_t pin = get_pinned(global_map, MAP_KEY(&key, sizeof(int)), map_hash(global_map, MAP_KEY(&key, sizeof(int))));
+    cr_assert_not_null(pin.val.val_base, "Failed to pin %i", key);
+    cr_assert_eq(*(int *)pin.val.val_base, 1, "The pin count is %i. Expected 1", *(int *)pin.val.val_base);
+
+    // the old value is retired, the new one pinned in the map
+    cr_assert(put(global_map, int_key(key), pinned_val(20), false), "Failed to replace %i", key);
+    map_key_t keys[2] = {MAP_KEY(&key, sizeof(int)), MAP_KEY(&missing, sizeof(int))};
+    map_node_t pins[2];
+    cr_assert(get_many_pinned(global_map, keys, pins, 2), "Failed to pin a batch");
+    cr_assert_not_null(pins[0].val.val_base, "Failed to pin %i", key);
+    cr_assert_eq(((int *)pins[0].val.val_base)[1], 20, "Pinned %i. Expected 20", ((int *)pins[0].val.val_base)[1]);
+    cr_assert_null(pins[1].val.val_base, "Pinned missing key %i", missing);
+
+    // the map lets go of both, but they are only destroyed once unpinned
+    invalidate_map(global_map);
+    cr_assert_eq(pinned_destroyed, 0, "%d pinned entries were destroyed", pinned_destroyed);
+    cr_assert_eq(((int *)pin.val.val_base)[1], 10, "Pinned %i. Expected 10", ((int *)pin.val.val_base)[1]);
+    map_unpin(global_map, pin);
+    cr_assert_eq(pinned_destroyed, 1, "%d entries were destroyed. Expected 1", pinned_destroyed);
+    map_unpin(global_map, pins[0]);
+    map_unpin(global_map, pins[1]);
+    cr_assert_eq(pinned_destroyed, 2, "%d entries were destroyed. Expected 2", pinned_destroyed);
+}
+
+Test(map_suite, 18_clear, .timeout = 2, .init = pinned_map_init) {
+    for(int index = 0; index < NUM_THREADS; index++)
+        cr_assert(put(global_map, int_key(index), pinned_val(index), false), "Failed to insert %i", index);
+    int key = 0;
+    map_node_t pin = get_pinned(global_map, MAP_KEY(&key, sizeof(int)), map_hash(global_map, MAP_KEY(&key, sizeof(int))));
+    cr_assert_not_null(pin.val.val_base, "Failed to pin %i", key);
+
+    // the entries are gone at once, but count until they are swept
+    cr_assert(clear_map(global_map), "clear_map failed");
+    cr_assert_eq(map_size(global_map), 0, "Had %lu items in map. Expected 0", map_size(global_map));
+    cr_assert_gt(global_map->num_sweeping, 0, "The cleared tables were not queued for sweeping");
+    cr_assert_gt(map_memory(global_map), 0, "Map counted no bytes for the unswept entries");
+
+    // gets alone get the cleared tables swept
+    for(int index = 0; index < NUM_THREADS; index++)
+        cr_assert_null(get(global_map, MAP_KEY(&index, sizeof(int))).val_base, "Found cleared key %i", index);
+    cr_assert_eq(global_map->num_sweeping, 0, "%u cleared tables were not swept", global_map->num_sweeping);
+    cr_assert_eq(map_memory(global_map), 0, "Map counted %lu bytes. Expected 0", map_memory(global_map));
+    cr_assert_eq(pinned_destroyed, NUM_THREADS - 1, "%d entries were destroyed. Expected %d", pinned_destroyed, NUM_THREADS - 1);
+    cr_assert_eq(*(int *)pin.val.val_base, 0, "The pin count is %i. Expected 0", *(int *)pin.val.val_base);
+
+    for(int round = 0; round < NUM_THREADS * 2; round++)
+        cr_assert(put(global_map, int_key(key), pinned_val(round), false), "Failed to replace %i", key);
+    cr_assert_eq(((int *)get(global_map, MAP_KEY(&key, sizeof(int))).val_base)[1], NUM_THREADS * 2 - 1, "Found an old value of %i", key);
+
+    invalidate_map(global_map);
+    cr_assert_eq(pinned_destroyed, NUM_THREADS * 3 - 1, "%d entries were destroyed. Expected %d", pinned_destroyed, NUM_THREADS * 3 - 1);
+    map_unpin(global_map, pin);
+    cr_assert_eq(pinned_destroyed, NUM_THREADS * 3, "%d entries were destroyed. Expected %d", pinned_destroyed, NUM_THREADS * 3);
+}
 
+// Puts keys (int)arg, (int)arg + 4, ... below NUM_THREADS * 2
+void *thread_put_stride(void *arg) {
+    for(int index = (int)(long)arg; index < NUM_THREADS * 2; index += 4) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index * 2;
+        if(!put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false))
+            return (void *)1;
+    }
+    return NULL;
+}
+
+Test(map_suite, 19_reseed_once, .timeout = 2, .init = flooded_map_init, .fini = map_fini) {
+    pthread_t thread_ids[4];
+    void *failed;
+
+    // every writer may see the flood, but only one of them rehashes
+    for(long i = 0; i < 4; i++)
+        pthread_create(&thread_ids[i], NULL, thread_put_stride, (void *)i);
+    for(int i = 0; i < 4; i++) {
+        pthread_join(thread_ids[i], &failed);
+        cr_assert_null(failed, "Thread %d failed to insert", i);
+    }
+    cr_assert_eq(global_map->reseeds, 1, "The map was reseeded %u times. Expected 1", global_map->reseeds);
+    cr_assert_eq(map_size(global_map), NUM_THREADS * 2, "Had %lu items in map. Expected %d", map_size(global_map), NUM_THREADS * 2);
+}
+
+Test(map_suite, 20_segment_budget, .timeout = 2) {
+    map_config_t config = {NUM_THREADS * 4, 4, jenkins_hash, map_free_function, false, MEMORY_BUDGET};
+    global_map = create_map_config(&config);
+    for(int index = 0; index < NUM_THREADS; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index * 2;
+        cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), true),
+            "Failed to insert %i", index);
+    }
+
+    // bigger than a segment's share but not the budget, so its segment
+    // makes room by holding only that entry
+    size_t big = MEMORY_BUDGET / 2;
+    int key = NUM_THREADS, *key_ptr = malloc(sizeof(int));
+    *key_ptr = key;
+    cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(calloc(1, big), big), true),
+        "Failed to insert a value of %lu bytes", big);
+    cr_assert_eq(get(global_map, MAP_KEY(&key, sizeof(int))).val_len, big, "Lost the big value");
+    cr_assert_leq(map_memory(global_map), MEMORY_BUDGET * 3 / 4 + big + sizeof(int) + MAP_ENTRY_OVERHEAD,
+        "Took %lu bytes", map_memory(global_map));
+
+    // only a value bigger than the whole budget is turned away
+    key_ptr = malloc(sizeof(int));
+    *key_ptr = key + 1;
+    void *val_ptr = calloc(1, MEMORY_BUDGET);
+    cr_assert(!put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, MEMORY_BUDGET), true),
+        "Put a value bigger than the budget");
+    cr_assert_eq(errno, ENOMEM, "errno was %d", errno);
+    free(key_ptr);
+    free(val_ptr);
+    invalidate_map(global_map);
+}
+
+// Tables still waiting on a retire list
+static int retired_tables(hashmap_t *map) {
+    int tables = 0;
+    for(int i = 0; i < MAP_READER_SLOTS; i++)
+        for(uint32_t j = 0; j < map->retire_lists[i].num; j++)
+            tables += map->retire_lists[i].items[j].table != NULL;
+    return tables;
+}
+
+Test(map_suite, 21_tables_freed, .timeout = 2, .init = map_init, .fini = map_fini) {
+    // every table the map grows out of is freed by the write that let go
+    // of it, without waiting for a batch of entries
+    for(int index = 0; index < NUM_THREADS; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index * 2;
+        cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false),
+            "Failed to insert %i", index);
+        cr_assert_eq(retired_tables(global_map), 0, "A retired table was left after %i", index);
+    }
+    cr_assert_gt(global_map->segments[0].table.capacity, MAP_TABLE_MIN_CAPACITY, "The table never grew");
+}
+
+Test(map_suite, 22_cuckoo_migrate, .timeout = 2, .init = clustered_cuckoo_map_init, .fini = map_fini) {
+    // a table too crowded for some of the keys makes them fail to go in,
+    // but never loses one that went in while it grows
+    static bool added[CLUSTERED_KEYS];
+    for(int index = 0; index < CLUSTERED_KEYS; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index * 2;
+        if((added[index] = put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false)))
+            continue;
+        free(key_ptr);
+        free(val_ptr);
+    }
+    uint64_t found = 0;
+    for(int index = 0; index < CLUSTERED_KEYS; index++) {
+        if(!added[index])
+            continue;
+        cr_assert_not_null(get(global_map, MAP_KEY(&index, sizeof(int))).val_base, "Lost %i", index);
+        found++;
+    }
+    cr_assert_eq(map_size(global_map), found, "Had %lu items in map. Expected %lu", map_size(global_map), found);
+}
+
+Test(map_suite, 23_evict_migrating, .timeout = 2, .init = grown_map_init, .fini = map_fini) {
+    map_segment_t *seg = global_map->segments;
+    for(int index = 0; index <= GROWN_CAP; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index * 2;
+        bool added = put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false);
+        cr_assert_eq(added, index < GROWN_CAP, "Put %i returned %d", index, added);
+        if(!added) {
+            free(key_ptr);
+            free(val_ptr);
+        }
+    }
+    cr_assert_eq(seg->old.capacity, GROWN_FROM, "The table did not just grow from %d slots", GROWN_FROM);
+
+    // a forced put into the full segment evicts without finishing the
+    // migration for it
+    uint64_t migrated = seg->migrated;
+    int *key_ptr = malloc(sizeof(int));
+    int *val_ptr = malloc(sizeof(int));
+    *key_ptr = GROWN_CAP + 1;
+    *val_ptr = 0;
+    cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), true), "Forced put failed");
+    cr_assert_not_null(seg->old.nodes, "The forced put finished the migration");
+    cr_assert_leq(seg->migrated - migrated, MAP_MIGRATE_STEP, "The forced put moved %lu slots", seg->migrated - migrated);
+    cr_assert_eq(map_size(global_map), GROWN_CAP, "Had %lu items in map. Expected %d", map_size(global_map), GROWN_CAP);
+    cr_assert_not_null(get(global_map, MAP_KEY(key_ptr, sizeof(int))).val_base, "The forced entry is missing");
+}
+
+Test(map_suite, 24_reseed_migrating, .timeout = 2, .init = flooded_map_init, .fini = map_fini) {
+    map_segment_t *seg = global_map->segments;
+    int index = 0;
+    for(; global_map->reseeds == 0; index++) {
+        cr_assert_lt(index, NUM_THREADS * 2, "The map was never reseeded");
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index * 2;
+        cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false),
+            "Failed to insert %i", index);
+    }
+
+    // the reseed only starts a migration, which every write moves along
+    cr_assert_not_null(seg->old.nodes, "The reseed moved every key at once");
+    for(; seg->old.nodes != NULL; index++) {
+        uint64_t migrated = seg->migrated;
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index * 2;
+        cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false),
+            "Failed to insert %i", index);
+        if(seg->old.nodes != NULL)
+            cr_assert_leq(seg->migrated - migrated, MAP_MIGRATE_STEP, "A put moved %lu slots", seg->migrated - migrated);
+        for(int i = 0; i <= index; i++)
+            cr_assert_not_null(get(global_map, MAP_KEY(&i, sizeof(int))).val_base, "Lost %i during the reseed", i);
+    }
+    cr_assert_eq(global_map->reseeds, 1, "The map was reseeded %u times. Expected 1", global_map->reseeds);
+    cr_assert_eq(map_size(global_map), index, "Had %lu items in map. Expected %d", map_size(global_map), index);
+}
+
+//(int index = 0; index < NUM_THREADS/2; index++)
+//(int index = NUM_THREADS-1; index > NUM_THREADS/2; index--)
@@ -0,0 +1,109 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "slab.h"
+#define NUM_THREADS 16
+#define NUM_OBJECTS 1000
+
+slab_t *global_slab;
+
+void slab_init(void) {
+    global_slab = slab_create();
+}
+
+void slab_fini(void) {
+    slab_destroy(global_slab);
+}
+
+// Allocates objects of every size, fills them with a pattern of its own
+// and checks that no other thread wrote over them before freeing them
+void *thread_alloc(void *arg) {
+    int id = *(int *)arg;
+    void *objects[NUM_OBJECTS];
+    size_t size;
+
+    for(int round = 0; round < 10; round++) {
+        for(int i = 0; i < NUM_OBJECTS; i++) {
+            size = 1 + (i * 97 + id) % SLAB_MAX_SIZE;
+            if((objects[i] = slab_alloc(global_slab, size)) == NULL)
+                return (void *)1;
+            memset(objects[i], id, size);
+        }
+        for(int i = 0; i < NUM_OBJECTS; i++) {
+            size = 1 + (i * 97 + id) % SLAB_MAX_SIZE;
+            for(size_t j = 0; j < size; j++) {
+                if(((unsigned char *)objects[i])[j] != id)
+                    return (void *)1;
+            }
+            slab_free(global_slab, objects[i], size);
+        }
+    }
+    return NULL;
+}
+
+Test(slab_suite, 00_creation, .timeout = 2, .init = slab_init, .fini = slab_fini) {
+    cr_assert_not_null(global_slab, "Slab returned was NULL");
+    cr_assert_gt(global_slab->num_classes, 1, "Only %d size classes", global_slab->num_classes);
+    cr_assert_eq(global_slab->classes[global_slab->num_classes - 1].size, SLAB_MAX_SIZE,
+        "Largest class holds %d bytes", global_slab->classes[global_slab->num_classes - 1].size);
+}
+
+Test(slab_suite, 01_reuse, .timeout = 2, .init = slab_init, .fini = slab_fini) {
+    slab_stats_t stats;
+    void *objects[NUM_OBJECTS];
+
+    for(int i = 0; i < NUM_OBJECTS; i++)
+        cr_assert_not_null(objects[i] = slab_alloc(global_slab, 100), "Failed to allocate %i", i);
+
+    uint32_t c = global_slab->class_of[(100 + SLAB_MIN_SIZE - 1) / SLAB_MIN_SIZE];
+    cr_assert(slab_stats(global_slab, c, &stats), "No stats for class %d", c);
+    cr_assert_geq(stats.size, 100, "Class of 100 bytes holds %d", stats.size);
+    cr_assert_eq(stats.live, NUM_OBJECTS, "Had %lu live objects. Expected %d", stats.live, NUM_OBJECTS);
+    cr_assert_eq(stats.requested, NUM_OBJECTS * 100, "Had %lu bytes requested", stats.requested);
+    uint64_t pages = stats.pages;
+
+    // freed objects are handed out again before any new page is taken
+    for(int i = 0; i < NUM_OBJECTS; i++)
+        slab_free(global_slab, objects[i], 100);
+    for(int i = 0; i < NUM_OBJECTS; i++)
+        cr_assert_not_null(objects[i] = slab_alloc(global_slab, 100), "Failed to allocate %i", i);
+    cr_assert(slab_stats(global_slab, c, &stats), "No stats for class %d", c);
+    cr_assert_eq(stats.pages, pages, "Went from %lu to %lu pages", pages, stats.pages);
+
+    for(int i = 0; i < NUM_OBJECTS; i++)
+        slab_free(global_slab, objects[i], 100);
+    cr_assert(slab_stats(global_slab, c, &stats), "No stats for class %d", c);
+    cr_assert_eq(stats.live, 0, "Had %lu live objects. Expected 0", stats.live);
+    // only what this thread's magazine keeps is still out of the pages
+    cr_assert_leq(stats.used, SLAB_MAGAZINE_SIZE, "Had %lu objects out of the pages", stats.used);
+}
+
+Test(slab_suite, 02_multithreaded, .timeout = 5, .init = slab_init, .fini = slab_fini) {
+    pthread_t thread_ids[NUM_THREADS];
+    int ids[NUM_THREADS];
+    slab_stats_t stats;
+
+    for(int index = 0; index < NUM_THREADS; index++) {
+        ids[index] = index + 1;
+        if(pthread_create(&thread_ids[index], NULL, thread_alloc, &ids[index]) != 0)
+            exit(EXIT_FAILURE);
+    }
+
+    void *status;
+    for(int index = 0; index < NUM_THREADS; index++) {
+        pthread_join(thread_ids[index], &status);
+        cr_assert_null(status, "Thread %i lost an object", index);
+    }
+
+    // the threads gave back their magazines when they exited
+    for(uint32_t c = 0; c < global_slab->num_classes; c++) {
+        cr_assert(slab_stats(global_slab, c, &stats), "No stats for class %d", c);
+        cr_assert_eq(stats.live, 0, "Class %d had %lu live objects", c, stats.live);
+        cr_assert_eq(stats.used, 0, "Class %d had %lu objects out", c, stats.used);
+        cr_assert_eq(stats.pages, 0, "Class %d kept %lu pages", c, stats.pages);
+    }
+}